@@ -7,33 +7,81 @@
 
 #include <sys/user.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <execinfo.h>
 
+#include <cxxabi.h>
 #include <exception>
 #include <new>
 
 #include <syslog.h>
 #include <pthread.h>
-#include <tcl.h>
 
 #include "Allocator.h"
 
-namespace {
-    int debug = 0;
+/** \brief linked to Allocator::debug in the Tcl interpreter
+ */
+int Allocator::debug = 0;
+
+/** \brief empty slabs each size class keeps for reuse
+ */
+int Allocator::retain_slabs = 1;
+
+/** \brief release empty slabs with munmap rather than madvise
+ */
+int Allocator::unmap_slabs = 1;
+
+/** \brief time one allocator call in this many, zero for none
+ */
+int Allocator::sample_interval = 0;
 
+/** \brief bytes allocated between heap profile samples, zero for none
+ */
+int Allocator::profile_interval = 0;
+
+namespace {
     void
     print_stack() {
         void *pointers[256];
 
-        int frame_count = backtrace( pointers, sizeof(pointers) );
+        int frame_count = backtrace( pointers, sizeof(pointers)/sizeof(pointers[0]) );
         char **frames = backtrace_symbols( pointers, frame_count );
         for ( int i = 0 ; i < frame_count ; ++i ) {
             fprintf( stderr, "frame(%03d): %s\n", i, frames[i] );
         }
     }
 
+    /**
+     * Hold a mutex for the life of a scope, so an exception thrown
+     * while the heap is locked does not leave it locked.
+     */
+    class Lock {
+        pthread_mutex_t *mutex;
+    public:
+        Lock( pthread_mutex_t *mutex ) : mutex(mutex) {
+            pthread_mutex_lock( mutex );
+        }
+        /**
+         * Count the times the lock was already held when we got here.
+         * The count is only touched once the lock is ours.
+         */
+        Lock( pthread_mutex_t *mutex, uint64_t *contended ) : mutex(mutex) {
+            if ( pthread_mutex_trylock(mutex) != 0 ) {
+                pthread_mutex_lock( mutex );
+                (*contended)++;
+            }
+        }
+        ~Lock() {
+            pthread_mutex_unlock( mutex );
+        }
+    };
+
 }
 
 class MemPoolException {
@@ -46,40 +94,71 @@ public:
 class invalid_object : public MemPoolException { };
 class double_free : public MemPoolException { };
 
-/*
+class SizeClass;
+
+/**
+ * A MemPool is one slab of objects that are all the same size.  The
+ * header lives at the front of the mmap'd zone and the objects follow
+ * it, so one mapping holds the whole slab.
+ *
+ * Objects too big for any size class get a MemPool of their own with a
+ * count of one, which keeps them visible to the page map.
  */
 class MemPool {
-    static const int count = 512;
-    static const int maps = count/32;
+public:
+    static const int slab_count = 512;
+private:
+    static const int maps = slab_count/64;
+    static const size_t page_size = 4096;
     size_t size;
-    MemPool *next;
+    size_t length;
+    SizeClass *size_class;
+    int count;
+    int available;
+    int hint;
+    bool purged;
     uint8_t *start;
-    uint32_t map[maps];
-    void initialize( size_t );
+    uint64_t map[maps];
 public:
-    MemPool() : size(0), next(NULL), start(NULL) {}
+    MemPool *next, *previous;
+    MemPool *partial, *unpartial;
+    int sampled;
+
+    MemPool( SizeClass *, size_t, int = slab_count );
     ~MemPool() {}
-    void *allocate( size_t );
+    void *allocate();
     void free( void * );
 
-    void usage( Tcl_Interp *, Tcl_Obj * );
-
-    static void* operator new (size_t size); 
-    static void operator delete (void *p);
+    static size_t header_size() { return (sizeof(MemPool) + 15) & ~15; }
+    static size_t zone_length( size_t size, int count ) {
+        return (header_size() + (size * count) + page_size - 1) & ~(page_size - 1);
+    }
+    static void* operator new ( size_t, size_t, int = slab_count );
+    static void operator delete ( void * );
 
     size_t get_size() { return size; }
     int get_count() { return count; }
+    size_t get_length() { return length; }
+    uint8_t *get_start() { return start; }
+    SizeClass *owner() { return size_class; }
     uint32_t available_slots();
-    MemPool *next_pool() { return next; }
+    bool full() { return available == 0; }
+    bool empty() { return available == count; }
+    size_t purge();
 };
-
+
 /**
  */
 void *
-MemPool::operator new ( size_t size ) {
-    void *address = mmap( 0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+MemPool::operator new ( size_t header, size_t object_size, int count ) {
+    size_t zone = zone_length( object_size, count );
+
+    if ( Allocator::debug ) {
+        fprintf( stderr, "Allocate %lu KB memory region for %lu byte objects\n", zone/1024, object_size );
+    }
+    void *address = mmap( 0, zone, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
     if ( address == MAP_FAILED ) {
-        fprintf( stderr, "new operator failed to allocate %ld bytes\n", size );
+        fprintf( stderr, "MemPool failed to allocate memory region for %lu byte objects\n", object_size );
         print_stack();
         throw std::bad_alloc();
     }
@@ -87,17 +166,33 @@ MemPool::operator new ( size_t size ) {
 }
 
 /**
+ * The header is the start of the zone, so releasing the header
+ * releases the whole slab.
  */
 void
 MemPool::operator delete ( void *object ) {
-    munmap( object, sizeof(MemPool) );
+    MemPool *pool = (MemPool *)object;
+    munmap( object, pool->length );
 }
 
-static const uint32_t m1  = 0x55555555;
-static const uint32_t m2  = 0x33333333;
-static const uint32_t m4  = 0x0F0F0F0F;
-static const uint32_t m8  = 0x00FF00FF;
-static const uint32_t m16 = 0x0000FFFF;
+/**
+ */
+MemPool::MemPool( SizeClass *size_class, size_t size, int count )
+: size(size), length(zone_length(size, count)), size_class(size_class),
+  count(count), available(count), hint(0), purged(false),
+  next(NULL), previous(NULL), partial(NULL), unpartial(NULL), sampled(0) {
+    start = ((uint8_t *)this) + header_size();
+    for ( int i = 0 ; i < maps ; i++ ) {
+        int bits = count - (i * 64);
+        if ( bits >= 64 ) {
+            map[i] = ~0ULL;
+        } else if ( bits > 0 ) {
+            map[i] = (1ULL << bits) - 1;
+        } else {
+            map[i] = 0;
+        }
+    }
+}
 
 /**
  */
@@ -105,213 +200,1436 @@ uint32_t
 MemPool::available_slots() {
     uint32_t sum = 0;
     for ( int word = 0 ; word < maps ; word++ ) {
-        uint32_t hw = map[word];
-        hw -= (hw >> 1 ) & m1;
-        hw = (hw & m2) + ((hw >> 2) & m2);
-        hw = (hw + (hw >> 4)) & m4;
-        hw += hw >> 8;
-        hw += hw >> 16;
-        hw &= 0x7f;
-        sum += hw;
+        sum += __builtin_popcountll( map[word] );
     }
     return sum;
 }
 
 /**
+ * A set bit is a free slot.  Every word before the hint is known to be
+ * full, so the search starts there and takes the lowest free slot of
+ * the first word that has one.
+ *
+ * The caller has already checked that this pool is not full.
+ */
+void *
+MemPool::allocate() {
+    for ( int word = hint ; word < maps ; word++ ) {
+        if ( map[word] == 0 ) {
+            continue;
+        }
+
+        int bit = __builtin_ctzll( map[word] );
+        int entry = ((word * 64) + bit);
+        if ( Allocator::debug > 1 ) {
+            fprintf( stderr, "allocate entry %d from %lu size table\n", entry, size );
+        }
+
+        map[word] &= map[word] - 1;
+        available--;
+        purged = false;
+        hint = word;
+        return start + (entry * size);
+    }
+
+    throw std::bad_alloc();
+}
+
+/**
+ * The caller found this pool through the page map, so the object is
+ * known to be inside the zone -- but not necessarily on an object
+ * boundary.
  */
 void
-MemPool::initialize( size_t object_size ) {
-    size = object_size;
-    size_t zone = size * count;
+MemPool::free( void *object ) {
+    uint8_t *address = (uint8_t*)object;
+    if ( address < start )  throw invalid_object();
 
-    fprintf( stderr, "Allocate %lu KB memory region for %lu byte objects\n", zone/1024, size );
-    start = (uint8_t *)mmap( 0, zone, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    uint32_t offset = address - start;
+    if ( (offset % size) != 0 )  throw invalid_object();
 
-    if ( start == MAP_FAILED ) {
-        fprintf( stderr, "MemPool failed to allocate memory region for %lu byte objects\n", size );
-        print_stack();
-        throw std::bad_alloc();
+    int entry = offset / size;
+    if ( entry >= count )  throw invalid_object();
+
+    int word  = entry / 64;
+    int bit   = entry % 64;
+    uint64_t mask = (1ULL << bit);
+
+    if ( map[word] & mask ) {
+        fprintf( stderr, "MemPool: map[%d] is 0x%016llx\n", word, (unsigned long long)map[word] );
+        fprintf( stderr, "MemPool: object 0x%p already freed\n", object );
+        throw double_free();
     }
 
-    for ( int i = 0 ; i < maps ; i++ ) {
-        map[i] = 0xFFFFFFFF;
+    if ( Allocator::debug > 1 ) {
+        fprintf( stderr, "free entry %d from %lu size table\n", entry, size );
     }
+    map[word] |= mask;
+    available++;
+    if ( word < hint )  hint = word;
+}
+
+/**
+ * Hand the pages of an empty slab back to the kernel but keep the
+ * mapping, so the slab stays in place and is zero filled again the next
+ * time it is touched.  The page holding the header is kept.  Returns
+ * the number of bytes released.
+ */
+size_t
+MemPool::purge() {
+    if ( purged )  return 0;
 
-    fprintf( stderr, "Creating new mempool\n" );
-    next = new MemPool;
+    uintptr_t first = ((uintptr_t)start + page_size - 1) & ~(page_size - 1);
+    uintptr_t end = ((uintptr_t)this) + length;
+    if ( first >= end )  return 0;
+
+    if ( madvise((void *)first, end - first, MADV_DONTNEED) < 0 )  return 0;
+    purged = true;
+    return end - first;
+}
+
+/**
+ * Map each 4K page of the address space to the MemPool that owns it,
+ * so free() finds the slab for an object in constant time.  This is a
+ * two level radix tree over a 48 bit address space.  The root is static
+ * and leaves are mapped the first time a slab lands in their range.
+ *
+ * Lookups take no lock.  A page is entered in the map before any object
+ * in it is handed out, and leaves are never released.
+ */
+class PageMap {
+    static const int page_shift = 12;
+    static const int leaf_bits = 18;
+    static const int root_bits = 48 - page_shift - leaf_bits;
+    MemPool **root[1 << root_bits];
+    void set( void *, size_t, MemPool * );
+public:
+    MemPool *lookup( void *address ) {
+        uintptr_t page = ((uintptr_t)address) >> page_shift;
+        if ( (page >> (root_bits + leaf_bits)) != 0 )  return NULL;
+        MemPool **leaf = root[ page >> leaf_bits ];
+        if ( leaf == NULL )  return NULL;
+        return leaf[ page & ((1 << leaf_bits) - 1) ];
+    }
+    void insert( MemPool *pool ) { set( pool, pool->get_length(), pool ); }
+    void remove( MemPool *pool ) { set( pool, pool->get_length(), NULL ); }
+};
+
+namespace {
+    PageMap pages;
+    pthread_mutex_t pages_lock = PTHREAD_MUTEX_INITIALIZER;
 }
 
 /**
  */
 void
-MemPool::usage( Tcl_Interp *interp, Tcl_Obj *result ) {
-    if ( size == 0 ) return;
+PageMap::set( void *address, size_t length, MemPool *pool ) {
+    uintptr_t first = ((uintptr_t)address) >> page_shift;
+    uintptr_t last = (((uintptr_t)address) + length - 1) >> page_shift;
 
-    Tcl_Obj *element = Tcl_NewListObj( 0, 0 );
+    Lock lock( &pages_lock );
+    for ( uintptr_t page = first ; page <= last ; page++ ) {
+        MemPool **&leaf = root[ page >> leaf_bits ];
+        if ( leaf == NULL ) {
+            if ( pool == NULL )  continue;
+            size_t bytes = sizeof(MemPool *) << leaf_bits;
+            void *map = mmap( 0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+            if ( map == MAP_FAILED ) {
+                fprintf( stderr, "PageMap failed to allocate a leaf\n" );
+                print_stack();
+                throw std::bad_alloc();
+            }
+            leaf = (MemPool **)map;
+        }
+        leaf[ page & ((1 << leaf_bits) - 1) ] = pool;
+    }
+}
 
-    Tcl_ListObjAppendElement( interp, element, Tcl_NewStringObj("size", -1) );
-    Tcl_ListObjAppendElement( interp, element, Tcl_NewLongObj(size) );
+/**
+ * Requests are rounded up to one of a fixed set of size classes spaced
+ * like jemalloc's: a step of 16 up to 128 and then four classes for each
+ * doubling up to small_max.  A table indexed by the request size in
+ * quantum units takes a request straight to its class.  Anything larger
+ * than small_max is mapped on its own by the large class.
+ *
+ * Each class has its own lock, and keeps a list of all of its slabs and
+ * a stack of the slabs that still have free slots.  The totals record
+ * allocation traffic that has been folded in from exited threads; live
+ * threads keep their own counts in their cache.
+ */
+class SizeClass {
+public:
+    static const size_t quantum = 8;
+    static const size_t small_max = 2048;
+    static const int small_classes = 25;
+    static const int large_class = small_classes;
+    static const int class_count = small_classes + 1;
+private:
+    pthread_mutex_t lock;
+    size_t size;
+    int index;
+    MemPool *pools;
+    MemPool *partial;
+    int slabs;
+    int empty;
+    size_t mapped;
+    size_t in_use;
+    size_t peak;
+    uint64_t contention;
+    Allocator::Traffic totals;
 
-    Tcl_ListObjAppendElement( interp, element, Tcl_NewStringObj("capacity", -1) );
-    Tcl_ListObjAppendElement( interp, element, Tcl_NewLongObj(count * size) );
+    void use( size_t bytes ) {
+        in_use += bytes;
+        if ( in_use > peak )  peak = in_use;
+    }
 
-    uint32_t sum = 0;
-    for ( int word = 0 ; word < maps ; word++ ) {
-        uint32_t hw = map[word];
-        hw -= (hw >> 1 ) & m1;
-        hw = (hw & m2) + ((hw >> 2) & m2);
-        hw = (hw + (hw >> 4)) & m4;
-        hw += hw >> 8;
-        hw += hw >> 16;
-        hw &= 0x7f;
-        sum += hw;
+    void initialize( size_t, int );
+    void grow();
+    size_t release( MemPool * );
+    void *allocate_locked();
+    void free_locked( MemPool *, void * );
+    void *allocate_large( size_t );
+    void free_large( MemPool *, void * );
+    static void initialize_classes();
+public:
+    static SizeClass *lookup( size_t size ) {
+        pthread_once( &classes_once, initialize_classes );
+        if ( size > small_max )  return &classes[large_class];
+        return &classes[ class_index[(size + quantum - 1) / quantum] ];
     }
+    static SizeClass *get( int index ) { return &classes[index]; }
+    static void inject( Allocator::Injector * );
+    static void usage( Allocator::ClassUsage * );
 
-    Tcl_ListObjAppendElement( interp, element, Tcl_NewStringObj("available", -1) );
-    Tcl_ListObjAppendElement( interp, element, Tcl_NewLongObj(sum * size) );
+    static pthread_once_t classes_once;
+    static SizeClass classes[class_count];
+    static uint8_t class_index[(small_max / quantum) + 1];
 
-    Tcl_ListObjAppendElement( interp, element, Tcl_NewStringObj("objects", -1) );
-    Tcl_ListObjAppendElement( interp, element, Tcl_NewLongObj(count - sum) );
+    size_t get_size() const { return size; }
+    int get_index() const { return index; }
+    bool is_large() const { return index == large_class; }
+    /**
+     * A large object gets the rest of its last page as well.
+     */
+    size_t round( size_t request ) const {
+        if ( is_large() ) {
+            return MemPool::zone_length( (request + 15) & ~15, 1 ) - MemPool::header_size();
+        }
+        return size;
+    }
 
-    Tcl_ListObjAppendElement( interp, result, element );
-    next->usage( interp, result );
+    void *allocate( size_t );
+    int allocate( void **, int );
+    void free( MemPool *, void * );
+    void free( void *, int );
+    void fold( const Allocator::Traffic& );
+    size_t trim( int );
+};
+
+pthread_once_t SizeClass::classes_once = PTHREAD_ONCE_INIT;
+SizeClass SizeClass::classes[SizeClass::class_count];
+uint8_t SizeClass::class_index[(SizeClass::small_max / SizeClass::quantum) + 1];
+
+namespace {
+    const size_t class_sizes[SizeClass::small_classes] = {
+           8,   16,   32,   48,   64,   80,   96,  112,  128,
+         160,  192,  224,  256,  320,  384,  448,  512,
+         640,  768,  896, 1024, 1280, 1536, 1792, 2048
+    };
 }
-
+
+/**
+ */
+void
+SizeClass::initialize( size_t object_size, int class_index ) {
+    pthread_mutex_init( &lock, NULL );
+    size = object_size;
+    index = class_index;
+    pools = NULL;
+    partial = NULL;
+    slabs = 0;
+    empty = 0;
+    mapped = 0;
+    in_use = 0;
+    peak = 0;
+    contention = 0;
+    memset( &totals, 0, sizeof(totals) );
+}
+
+/**
+ * The class table has no constructors so it is usable from static
+ * constructors that run before this translation unit's.
+ */
+void
+SizeClass::initialize_classes() {
+    int c = 0;
+    for ( size_t units = 0 ; units <= small_max / quantum ; units++ ) {
+        while ( class_sizes[c] < units * quantum )  c++;
+        class_index[units] = c;
+    }
+    for ( int i = 0 ; i < small_classes ; i++ ) {
+        classes[i].initialize( class_sizes[i], i );
+    }
+    classes[large_class].initialize( 0, large_class );
+}
+
+/**
+ * A new slab is entered in the page map before any of its objects
+ * are handed out.
+ */
+void
+SizeClass::grow() {
+    if ( Allocator::debug ) {
+        fprintf( stderr, "Creating new mempool for %lu byte objects\n", size );
+    }
+    MemPool *pool = new (size) MemPool( this, size );
+    pages.insert( pool );
+
+    pool->next = pools;
+    if ( pools != NULL )  pools->previous = pool;
+    pools = pool;
+
+    pool->partial = partial;
+    if ( partial != NULL )  partial->unpartial = pool;
+    partial = pool;
+
+    slabs++;
+    empty++;
+    mapped += pool->get_length();
+}
+
+/**
+ * Release an empty slab, either by unmapping it or by purging its
+ * pages, depending on Allocator::unmap_slabs.  Returns the number of
+ * bytes given back to the kernel.
+ */
+size_t
+SizeClass::release( MemPool *pool ) {
+    if ( Allocator::unmap_slabs == 0 )  return pool->purge();
+
+    if ( pool->previous != NULL ) {
+        pool->previous->next = pool->next;
+    } else {
+        pools = pool->next;
+    }
+    if ( pool->next != NULL )  pool->next->previous = pool->previous;
+
+    if ( pool->unpartial != NULL ) {
+        pool->unpartial->partial = pool->partial;
+    } else {
+        partial = pool->partial;
+    }
+    if ( pool->partial != NULL )  pool->partial->unpartial = pool->unpartial;
+
+    size_t length = pool->get_length();
+    pages.remove( pool );
+    slabs--;
+    empty--;
+    mapped -= length;
+    delete pool;
+    return length;
+}
+
 /**
  */
 void *
-MemPool::allocate( size_t object_size ) {
-    if ( size == 0 )  initialize( object_size );
+SizeClass::allocate_locked() {
+    if ( partial == NULL )  grow();
 
-    if ( object_size != size ) {
-        return next->allocate( object_size );
+    MemPool *pool = partial;
+    if ( pool->empty() )  empty--;
+    void *object = pool->allocate();
+    use( size );
+    if ( pool->full() ) {
+        partial = pool->partial;
+        if ( partial != NULL )  partial->unpartial = NULL;
+        pool->partial = NULL;
     }
+    return object;
+}
 
-    for ( int word = 0 ; word < maps ; word++ ) {
-        if ( map[word] == 0 ) {
-            continue;
+/**
+ * A pool that was full is not on the partial stack, so put it back.
+ * A pool that is now empty is released if the class already holds as
+ * many empty slabs as Allocator::retain_slabs allows.
+ */
+void
+SizeClass::free_locked( MemPool *pool, void *object ) {
+    bool was_full = pool->full();
+    pool->free( object );
+    in_use -= size;
+    if ( was_full ) {
+        pool->partial = partial;
+        if ( partial != NULL )  partial->unpartial = pool;
+        pool->unpartial = NULL;
+        partial = pool;
+    }
+    if ( pool->empty() ) {
+        empty++;
+        if ( empty > Allocator::retain_slabs )  release( pool );
+    }
+}
+
+/**
+ * Large objects are mapped one to a zone and go straight back to the
+ * kernel when they are freed.  The class lock only covers the counts.
+ */
+void *
+SizeClass::allocate_large( size_t request ) {
+    size_t object_size = round( request );
+    MemPool *pool = new (object_size, 1) MemPool( this, object_size, 1 );
+    pages.insert( pool );
+
+    Lock lock( &this->lock, &contention );
+    slabs++;
+    mapped += pool->get_length();
+    use( object_size );
+    return pool->allocate();
+}
+
+/**
+ */
+void
+SizeClass::free_large( MemPool *pool, void *object ) {
+    pool->free( object );
+    pages.remove( pool );
+    {
+        Lock lock( &this->lock, &contention );
+        slabs--;
+        mapped -= pool->get_length();
+        in_use -= pool->get_size();
+    }
+    delete pool;
+}
+
+/**
+ */
+void *
+SizeClass::allocate( size_t request ) {
+    if ( is_large() )  return allocate_large( request );
+    Lock lock( &this->lock, &contention );
+    return allocate_locked();
+}
+
+/**
+ * Fill a list of objects chained through their first word.  If memory
+ * runs out part way through, the caller gets what was allocated and
+ * only sees bad_alloc if there was nothing at all.
+ */
+int
+SizeClass::allocate( void **list, int quantity ) {
+    Lock lock( &this->lock, &contention );
+    int allocated = 0;
+    try {
+        while ( allocated < quantity ) {
+            void *object = allocate_locked();
+            *(void **)object = *list;
+            *list = object;
+            allocated++;
         }
+    } catch ( std::bad_alloc& ) {
+        if ( allocated == 0 )  throw;
+    }
+    return allocated;
+}
+
+/**
+ */
+void
+SizeClass::free( MemPool *pool, void *object ) {
+    if ( is_large() ) {
+        free_large( pool, object );
+        return;
+    }
+    Lock lock( &this->lock, &contention );
+    free_locked( pool, object );
+}
 
-        for ( int bit = 0 ; bit < 32 ; bit++ ) {
-            uint32_t mask = 1 << bit;
-            if ( (map[word] & mask) == 0 ) {
-                continue;
+/**
+ * Release a list of objects chained through their first word.
+ */
+void
+SizeClass::free( void *list, int quantity ) {
+    Lock lock( &this->lock, &contention );
+    while ( (quantity-- > 0) && (list != NULL) ) {
+        void *object = list;
+        list = *(void **)object;
+        free_locked( pages.lookup(object), object );
+    }
+}
+
+/**
+ * Release empty slabs until no more than retain are left.  Returns the
+ * number of bytes given back to the kernel.
+ */
+size_t
+SizeClass::trim( int retain ) {
+    Lock lock( &this->lock, &contention );
+    size_t released = 0;
+    int kept = 0;
+
+    MemPool *pool = pools;
+    while ( pool != NULL ) {
+        MemPool *next = pool->next;
+        if ( pool->empty() ) {
+            if ( kept < retain ) {
+                kept++;
+            } else {
+                released += release( pool );
             }
+        }
+        pool = next;
+    }
+    return released;
+}
 
-            int entry = ((word * 32) + bit);
-            fprintf( stderr, "allocate entry %d from %lu size table\n", entry, size );
-            void *address = start + (entry * size);
+/**
+ * Add the traffic counted by a thread that is exiting.
+ */
+void
+SizeClass::fold( const Allocator::Traffic& traffic ) {
+    Lock lock( &this->lock, &contention );
+    totals += traffic;
+}
+
+/**
+ * The injector is called outside the class locks, so it is free to
+ * allocate.  Slabs can be released at any time, so each class is
+ * copied out under its lock before it is reported.
+ */
+void
+SizeClass::inject( Allocator::Injector *injector ) {
+    Allocator::Injector &f = *injector;
+    pthread_once( &classes_once, initialize_classes );
+
+    for ( int i = 0 ; i < small_classes ; i++ ) {
+        SizeClass *c = &classes[i];
+        int reserved;
+        {
+            Lock lock( &c->lock );
+            reserved = c->slabs + 16;
+        }
+
+        uint32_t *available = new uint32_t[reserved];
+        int found = 0;
+        {
+            Lock lock( &c->lock );
+            MemPool *pool = c->pools;
+            while ( (pool != NULL) && (found < reserved) ) {
+                available[found++] = pool->available_slots();
+                pool = pool->next;
+            }
+        }
+
+        for ( int j = 0 ; j < found ; j++ ) {
+            f( c->size, MemPool::slab_count, available[j] );
+        }
+        delete [] available;
+    }
+}
+
+/**
+ * Fill in the slab side of the usage for every class.  The caller
+ * holds the cache registry lock and adds the traffic of live threads.
+ */
+void
+SizeClass::usage( Allocator::ClassUsage *usage ) {
+    pthread_once( &classes_once, initialize_classes );
+
+    for ( int i = 0 ; i < class_count ; i++ ) {
+        SizeClass *c = &classes[i];
+        Allocator::ClassUsage &u = usage[i];
+        Lock lock( &c->lock );
 
-            map[word] &= ~mask;
-            return address;
+        u.size = c->size;
+        u.slabs = c->slabs;
+        u.mapped = c->mapped;
+        u.peak = c->peak;
+        u.contention = c->contention;
+        u.traffic = c->totals;
+        u.objects = 0;
+        if ( c->is_large() ) {
+            u.objects = c->slabs;
+            continue;
+        }
+        for ( MemPool *pool = c->pools ; pool != NULL ; pool = pool->next ) {
+            u.objects += pool->get_count() - pool->available_slots();
         }
     }
-    fprintf( stderr, "this table is full, looking for another\n" );
+}
+
+/**
+ * Each thread keeps a small cache of free objects for each size class
+ * up to max_size.  Objects are moved between the cache and the heap in
+ * batches, so the heap lock is only taken when a bin runs dry or grows
+ * past its capacity.  The common new/delete path touches only thread
+ * local memory.
+ *
+ * Free objects in a bin are chained through their first word, which is
+ * why the global allocator never hands out less than a pointer.
+ *
+ * The cache also counts the allocation traffic of its thread for every
+ * class, so the counts cost no more than the cache itself.
+ *
+ * The cache has no constructor so it can live in thread local storage
+ * and be used by static constructors before main() runs.
+ */
+class ThreadCache {
+public:
+    static const size_t max_size = 256;
+    static const size_t capacity_bytes = 4096;
+    static const int bin_count = SizeClass::small_classes;
+private:
+    struct Bin {
+        void *head;
+        int count;
+    } bins[bin_count];
+    Allocator::Traffic traffic[SizeClass::class_count];
+    Allocator::Latency latency;
+    ThreadCache *next, *previous;
+    pid_t tid;
+    int epoch;
+    int countdown;
+    int64_t profile_countdown;
+    bool active;
 
-    return next->allocate( object_size );
+    static int capacity( size_t size ) {
+        int slots = capacity_bytes / size;
+        if ( slots > 64 )  slots = 64;
+        if ( slots < 8 )   slots = 8;
+        return slots;
+    }
+    void drain( SizeClass *, int );
+    void activate();
+    void record( uint64_t *, uint64_t );
+public:
+    static ThreadCache *current();
+    static void inject( Allocator::CacheInjector * );
+    static void usage( Allocator::ClassUsage * );
+    static void usage( Allocator::Latency * );
+    static void destroy( void * );
+    static volatile int trim_epoch;
+    bool profiling;
+    Allocator::Arena *arena;
+
+    static bool cacheable( SizeClass *c ) {
+        return c->get_size() <= max_size && c->is_large() == false;
+    }
+
+    void count( SizeClass *c, size_t request ) {
+        Allocator::Traffic& t = traffic[ c->get_index() ];
+        t.allocations++;
+        t.requested += request;
+        t.allocated += c->round( request );
+    }
+
+    void count_free( SizeClass *c, size_t size ) {
+        Allocator::Traffic& t = traffic[ c->get_index() ];
+        t.frees++;
+        t.freed += size;
+    }
+
+    /**
+     * True for one operation in every Allocator::sample_interval.
+     */
+    bool sample() {
+        if ( Allocator::sample_interval <= 0 )  return false;
+        if ( --countdown > 0 )  return false;
+        countdown = Allocator::sample_interval;
+        return true;
+    }
+
+    /**
+     * True once the thread has allocated another profile_interval
+     * bytes.  Never true while the thread is inside the profiler, so
+     * anything the profiler allocates is not itself sampled.
+     */
+    bool profile( size_t size ) {
+        if ( Allocator::profile_interval <= 0 )  return false;
+        profile_countdown -= size;
+        if ( profile_countdown > 0 )  return false;
+        profile_countdown += Allocator::profile_interval;
+        if ( profile_countdown <= 0 )  profile_countdown = Allocator::profile_interval;
+        return profiling == false;
+    }
+
+    void record_allocate( uint64_t start ) { record( latency.allocate, start ); }
+    void record_free( uint64_t start ) { record( latency.free, start ); }
+
+    void *allocate( SizeClass *c ) {
+        Bin& bin = bins[ c->get_index() ];
+        if ( bin.head == NULL ) {
+            if ( epoch != trim_epoch )  flush();
+            bin.count += c->allocate( &bin.head, capacity(c->get_size()) / 2 );
+        }
+        void *object = bin.head;
+        bin.head = *(void **)object;
+        bin.count--;
+        return object;
+    }
+
+    void free( SizeClass *c, void *object ) {
+        Bin& bin = bins[ c->get_index() ];
+        if ( bin.head == object )  throw double_free();
+        *(void **)object = bin.head;
+        bin.head = object;
+        int limit = capacity( c->get_size() );
+        if ( ++bin.count > limit )  drain( c, limit / 2 );
+    }
+
+    void flush();
+};
+
+volatile int ThreadCache::trim_epoch = 0;
+
+namespace {
+    __thread ThreadCache local_cache;
+
+    pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+    pthread_key_t cache_key;
+    pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+    ThreadCache *caches = NULL;
+    Allocator::Latency exited_latency;
+
+    uint64_t
+    nanoseconds() {
+        struct timespec now;
+        clock_gettime( CLOCK_MONOTONIC, &now );
+        return (now.tv_sec * 1000000000ULL) + now.tv_nsec;
+    }
+
+    void
+    create_cache_key() {
+        pthread_key_create( &cache_key, ThreadCache::destroy );
+    }
 }
 
 /**
+ * The cache is registered on first use.  The key destructor returns
+ * the cached objects to the heap when the thread exits.  If the thread
+ * allocates again after that (from another TLS destructor) the cache is
+ * simply registered again and the destructor runs again.
  */
 void
-MemPool::free( void *object ) {
-    uint32_t length = count * size;
-    uint8_t *end = (start + length) - 1;
+ThreadCache::activate() {
+    pthread_once( &cache_once, create_cache_key );
+    tid = syscall( SYS_gettid );
+    epoch = trim_epoch;
+    active = true;
+    pthread_setspecific( cache_key, this );
+
+    Lock lock( &caches_lock );
+    previous = NULL;
+    next = caches;
+    if ( caches != NULL )  caches->previous = this;
+    caches = this;
+}
+
+/**
+ */
+ThreadCache *
+ThreadCache::current() {
+    ThreadCache *cache = &local_cache;
+    if ( cache->active == false )  cache->activate();
+    return cache;
+}
+
+/**
+ * Add the time since start to a log2 histogram of nanoseconds.
+ */
+void
+ThreadCache::record( uint64_t *histogram, uint64_t start ) {
+    uint64_t elapsed = nanoseconds() - start;
+    int bucket = (elapsed == 0) ? 0 : 64 - __builtin_clzll( elapsed );
+    if ( bucket >= Allocator::Latency::buckets )  bucket = Allocator::Latency::buckets - 1;
+    histogram[bucket]++;
+}
+
+/**
+ * Detach up to quantity objects from the bin and return them to the
+ * heap under one lock.
+ */
+void
+ThreadCache::drain( SizeClass *c, int quantity ) {
+    if ( epoch != trim_epoch )  flush();
+
+    Bin& bin = bins[ c->get_index() ];
+    void *list = bin.head;
+    void **tail = &bin.head;
+    int detached = 0;
+
+    while ( (detached < quantity) && (*tail != NULL) ) {
+        tail = (void **)*tail;
+        detached++;
+    }
+    bin.head = *tail;
+    *tail = NULL;
+    bin.count -= detached;
+
+    c->free( list, detached );
+}
+
+/**
+ * Return every cached object to the heap.  A thread also does this the
+ * first time it needs the heap after Allocator::trim() has been called,
+ * so objects parked in idle bins do not keep slabs alive.
+ */
+void
+ThreadCache::flush() {
+    epoch = trim_epoch;
+    for ( int index = 0 ; index < bin_count ; index++ ) {
+        if ( bins[index].count > 0 )  drain( SizeClass::get(index), bins[index].count );
+    }
+}
+
+/**
+ * pthread key destructor -- called as the thread exits.  The traffic
+ * counts move to the classes under the registry lock so a report never
+ * sees them twice or not at all.
+ */
+void
+ThreadCache::destroy( void *data ) {
+    ThreadCache *cache = (ThreadCache *)data;
+    cache->flush();
+
+    Lock lock( &caches_lock );
+    for ( int index = 0 ; index < SizeClass::class_count ; index++ ) {
+        SizeClass::get(index)->fold( cache->traffic[index] );
+        memset( &cache->traffic[index], 0, sizeof(cache->traffic[index]) );
+    }
+    exited_latency += cache->latency;
+    memset( &cache->latency, 0, sizeof(cache->latency) );
+    if ( cache->previous != NULL ) {
+        cache->previous->next = cache->next;
+    } else {
+        caches = cache->next;
+    }
+    if ( cache->next != NULL )  cache->next->previous = cache->previous;
+    cache->active = false;
+}
+
+/**
+ * The injector is called with the cache registry locked, so a thread
+ * cannot exit and release its cache while it is being reported.  The
+ * calling thread's cache is activated first, so an injector that
+ * allocates does not try to register itself while the lock is held.
+ */
+void
+ThreadCache::inject( Allocator::CacheInjector *injector ) {
+    Allocator::CacheInjector &f = *injector;
+    current();
+
+    Lock lock( &caches_lock );
+    for ( ThreadCache *cache = caches ; cache != NULL ; cache = cache->next ) {
+        for ( int index = 0 ; index < bin_count ; index++ ) {
+            int count = cache->bins[index].count;
+            if ( count > 0 )  f( cache->tid, SizeClass::get(index)->get_size(), count );
+        }
+    }
+}
+
+/**
+ * The counts of live threads are read without stopping them, so they
+ * may be a few allocations behind.
+ */
+void
+ThreadCache::usage( Allocator::ClassUsage *usage ) {
+    Lock lock( &caches_lock );
+    SizeClass::usage( usage );
+    for ( ThreadCache *cache = caches ; cache != NULL ; cache = cache->next ) {
+        for ( int index = 0 ; index < SizeClass::class_count ; index++ ) {
+            usage[index].traffic += cache->traffic[index];
+        }
+    }
+}
+
+/**
+ */
+void
+ThreadCache::usage( Allocator::Latency *latency ) {
+    Lock lock( &caches_lock );
+    *latency = exited_latency;
+    for ( ThreadCache *cache = caches ; cache != NULL ; cache = cache->next ) {
+        *latency += cache->latency;
+    }
+}
+
+/**
+ * Sampled allocations, grouped by the stack that made them.  Both
+ * tables are fixed size and mapped the first time a sample is taken.
+ * When a table fills, further stacks or objects are dropped rather than
+ * growing it, so the profile costs at most a few megabytes.
+ *
+ * Each slab counts its sampled objects, so a free only looks in the
+ * object table when its slab holds at least one.
+ */
+class HeapProfile {
+public:
+    static const int depth_max = 32;
+    static const int skip_frames = 2;
+    static const int bucket_count = 4096;
+    static const int object_count = 65536;
+private:
+    struct Bucket {
+        uintptr_t hash;
+        int depth;
+        void *stack[depth_max];
+        uint64_t live_objects;
+        uint64_t live_bytes;
+        uint64_t total_objects;
+        uint64_t total_bytes;
+    };
+    struct Object {
+        void *address;
+        int bucket;
+        size_t size;
+    };
+    Bucket *buckets;
+    Object *objects;
+    uint64_t dropped;
+
+    static uintptr_t hash( void *address ) {
+        return ((uintptr_t)address >> 4) * 0x9e3779b97f4a7c15ULL;
+    }
+    bool map_tables();
+    int find_bucket( void **, int );
+    void remove_object( int );
+    void write_pprof( FILE * );
+    void write_folded( FILE * );
+public:
+    void record( MemPool *, void *, size_t );
+    void forget( MemPool *, void * );
+    bool write( FILE *, Allocator::ProfileFormat );
+};
+
+namespace {
+    HeapProfile heap_profile;
+    pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+}
+
+/**
+ */
+bool
+HeapProfile::map_tables() {
+    if ( objects != NULL )  return true;
+
+    size_t bytes = (sizeof(Bucket) * bucket_count) + (sizeof(Object) * object_count);
+    void *zone = mmap( 0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if ( zone == MAP_FAILED ) {
+        fprintf( stderr, "HeapProfile failed to allocate its tables\n" );
+        return false;
+    }
+    buckets = (Bucket *)zone;
+    objects = (Object *)(buckets + bucket_count);
+    return true;
+}
+
+/**
+ * Find the bucket for a stack, claiming an empty one if it is new.
+ * Returns -1 when the table is full.
+ */
+int
+HeapProfile::find_bucket( void **stack, int depth ) {
+    uintptr_t h = depth;
+    for ( int i = 0 ; i < depth ; i++ ) {
+        h = (h * 31) + hash( stack[i] );
+    }
+    if ( h == 0 )  h = 1;
+
+    int mask = bucket_count - 1;
+    for ( int probe = 0 ; probe < bucket_count ; probe++ ) {
+        Bucket& b = buckets[ (h + probe) & mask ];
+        if ( b.hash == 0 ) {
+            b.hash = h;
+            b.depth = depth;
+            memcpy( b.stack, stack, depth * sizeof(void *) );
+            return (h + probe) & mask;
+        }
+        if ( b.hash == h && b.depth == depth &&
+             memcmp(b.stack, stack, depth * sizeof(void *)) == 0 ) {
+            return (h + probe) & mask;
+        }
+    }
+    return -1;
+}
 
-    if ( (object < start) || (object > end) ) {
-        if ( next == 0 )  throw invalid_object();
-        next->free( object );
+/**
+ * Empty a slot of the object table, moving later entries of the same
+ * probe run back so lookups never need tombstones.
+ */
+void
+HeapProfile::remove_object( int slot ) {
+    int mask = object_count - 1;
+    int hole = slot;
+    for ( int next = (hole + 1) & mask ; objects[next].address != NULL ; next = (next + 1) & mask ) {
+        int home = hash( objects[next].address ) & mask;
+        bool stays = (hole <= next) ? (hole < home && home <= next)
+                                    : (hole < home || home <= next);
+        if ( stays )  continue;
+        objects[hole] = objects[next];
+        hole = next;
+    }
+    objects[hole].address = NULL;
+}
+
+/**
+ * Called from operator new for a sampled allocation.  Kept out of line
+ * so the frames to skip are always this one and operator new.
+ */
+void __attribute__((noinline))
+HeapProfile::record( MemPool *pool, void *address, size_t size ) {
+    void *stack[depth_max + skip_frames];
+    int depth = backtrace( stack, depth_max + skip_frames ) - skip_frames;
+    if ( depth < 0 )  depth = 0;
+
+    Lock lock( &profile_lock );
+    if ( map_tables() == false )  return;
+
+    int index = find_bucket( stack + skip_frames, depth );
+    if ( index < 0 ) {
+        dropped++;
         return;
     }
+    Bucket& b = buckets[index];
+    b.total_objects++;
+    b.total_bytes += size;
 
-    uint8_t *address = (uint8_t*)object;
-    uint32_t offset = address - start;
-    int entry = offset / size;
-    int word  = entry / 32;
-    int bit   = entry % 32;
-    uint32_t mask = (1<<bit);
+    int mask = object_count - 1;
+    for ( int probe = 0 ; probe < object_count ; probe++ ) {
+        Object& o = objects[ (hash(address) + probe) & mask ];
+        if ( o.address != NULL )  continue;
+        o.address = address;
+        o.bucket = index;
+        o.size = size;
+        b.live_objects++;
+        b.live_bytes += size;
+        pool->sampled++;
+        return;
+    }
+    dropped++;
+}
 
-    if ( map[word] & mask ) {
-        fprintf( stderr, "MemPool: map[%d] is 0x%08x\n", word, map[word] );
-        fprintf( stderr, "MemPool: object 0x%p already freed\n", object );
-        throw double_free();
+/**
+ * Called before a sampled object is released.
+ */
+void
+HeapProfile::forget( MemPool *pool, void *address ) {
+    Lock lock( &profile_lock );
+    if ( objects == NULL )  return;
+
+    int mask = object_count - 1;
+    for ( int slot = hash(address) & mask ; objects[slot].address != NULL ; slot = (slot + 1) & mask ) {
+        Object& o = objects[slot];
+        if ( o.address != address )  continue;
+        Bucket& b = buckets[ o.bucket ];
+        b.live_objects--;
+        b.live_bytes -= o.size;
+        pool->sampled--;
+        remove_object( slot );
+        return;
     }
+}
 
-    fprintf( stderr, "free entry %d from %lu size table\n", entry, size );
-    map[word] |= mask;
+/**
+ * The legacy gperftools heap profile.  Counts are of sampled objects,
+ * pprof scales them up using the interval in the header.
+ */
+void
+HeapProfile::write_pprof( FILE *f ) {
+    uint64_t live_objects = 0, live_bytes = 0, total_objects = 0, total_bytes = 0;
+    for ( int index = 0 ; index < bucket_count ; index++ ) {
+        Bucket& b = buckets[index];
+        live_objects += b.live_objects;
+        live_bytes += b.live_bytes;
+        total_objects += b.total_objects;
+        total_bytes += b.total_bytes;
+    }
+
+    fprintf( f, "heap profile: %6llu: %8llu [%6llu: %8llu] @ heap_v2/%d\n",
+             (unsigned long long)live_objects, (unsigned long long)live_bytes,
+             (unsigned long long)total_objects, (unsigned long long)total_bytes,
+             Allocator::profile_interval );
+
+    for ( int index = 0 ; index < bucket_count ; index++ ) {
+        Bucket& b = buckets[index];
+        if ( b.hash == 0 )  continue;
+        fprintf( f, "%6llu: %8llu [%6llu: %8llu] @",
+                 (unsigned long long)b.live_objects, (unsigned long long)b.live_bytes,
+                 (unsigned long long)b.total_objects, (unsigned long long)b.total_bytes );
+        for ( int i = 0 ; i < b.depth ; i++ ) {
+            fprintf( f, " %p", b.stack[i] );
+        }
+        fprintf( f, "\n" );
+    }
+
+    fprintf( f, "\nMAPPED_LIBRARIES:\n" );
+    FILE *maps = fopen( "/proc/self/maps", "r" );
+    if ( maps == NULL )  return;
+    char line[512];
+    while ( fgets(line, sizeof(line), maps) != NULL ) {
+        fputs( line, f );
+    }
+    fclose( maps );
 }
-
-/** \brief the static primary MemPool object used by the
- * global allocators.
+
+/**
+ * One line per stack that still has live objects, outermost frame
+ * first.  A sample stands for at least profile_interval bytes, so the
+ * live bytes are scaled up to that for stacks of small objects.
+ * Frames are named from the dynamic symbol table, which needs the
+ * program linked with -rdynamic to name its own functions.
  */
-MemPool heap;
+void
+HeapProfile::write_folded( FILE *f ) {
+    uint64_t interval = (Allocator::profile_interval > 0) ? Allocator::profile_interval : 1;
+
+    for ( int index = 0 ; index < bucket_count ; index++ ) {
+        Bucket& b = buckets[index];
+        if ( b.hash == 0 || b.live_objects == 0 )  continue;
 
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+        char **frames = backtrace_symbols( b.stack, b.depth );
+        for ( int i = b.depth - 1 ; i >= 0 ; i-- ) {
+            const char *name = NULL;
+            char *open = (frames == NULL) ? NULL : strchr( frames[i], '(' );
+            char *plus = (open == NULL) ? NULL : strchr( open, '+' );
+            if ( plus != NULL && plus > open + 1 ) {
+                *plus = '\0';
+                name = open + 1;
+            }
+
+            char *demangled = NULL;
+            if ( name != NULL ) {
+                int status;
+                demangled = abi::__cxa_demangle( name, NULL, NULL, &status );
+                if ( demangled != NULL )  name = demangled;
+            }
+
+            if ( name != NULL ) {
+                fprintf( f, "%s", name );
+            } else {
+                fprintf( f, "%p", b.stack[i] );
+            }
+            fprintf( f, "%s", (i > 0) ? ";" : " " );
+            free( demangled );
+        }
+        free( frames );
+
+        uint64_t estimate = b.live_objects * interval;
+        if ( estimate < b.live_bytes )  estimate = b.live_bytes;
+        fprintf( f, "%llu\n", (unsigned long long)estimate );
+    }
+}
+
+/**
+ * The profile lock is held while writing, so the calling thread is
+ * marked as inside the profiler in case the stream allocates.
+ */
+bool
+HeapProfile::write( FILE *f, Allocator::ProfileFormat format ) {
+    ThreadCache *cache = ThreadCache::current();
+    cache->profiling = true;
+    {
+        Lock lock( &profile_lock );
+        if ( map_tables() ) {
+            if ( format == Allocator::folded ) {
+                write_folded( f );
+            } else {
+                write_pprof( f );
+            }
+        }
+        if ( dropped > 0 && Allocator::debug ) {
+            fprintf( stderr, "HeapProfile dropped %llu samples\n", (unsigned long long)dropped );
+        }
+    }
+    cache->profiling = false;
+    return ferror( f ) == 0;
+}
+
+namespace {
+
+    inline void *
+    allocate( ThreadCache *cache, size_t size ) {
+        if ( size < sizeof(void *) )  size = sizeof(void *);
+        SizeClass *c = SizeClass::lookup( size );
+
+        cache->count( c, size );
+        if ( ThreadCache::cacheable(c) ) {
+            return cache->allocate( c );
+        }
+
+        return c->allocate( size );
+    }
+
+    inline void
+    release( ThreadCache *cache, void *address ) {
+        /**
+         * operator delete cannot throw, and a pointer from an Arena
+         * that has since been destroyed is no longer in the page map.
+         */
+        MemPool *pool = pages.lookup( address );
+        if ( pool == NULL ) {
+            syslog( LOG_ERR, "Allocator: delete of unknown object %p, ignored", address );
+            return;
+        }
+
+        SizeClass *c = pool->owner();
+        if ( c == NULL )  return;
+
+        if ( pool->sampled > 0 )  heap_profile.forget( pool, address );
+
+        cache->count_free( c, pool->get_size() );
+        if ( ThreadCache::cacheable(c) ) {
+            cache->free( c, address );
+            return;
+        }
+
+        c->free( pool, address );
+    }
+
+}
 
 /**
  */
 void* operator new (size_t size) throw(std::bad_alloc) {
-    pthread_mutex_lock( &mutex );
-    void *address = heap.allocate( size );
-    pthread_mutex_unlock( &mutex );
+    ThreadCache *cache = ThreadCache::current();
+    if ( cache->arena != NULL )  return cache->arena->allocate( size );
+
+    void *address;
+    if ( cache->sample() == false ) {
+        address = allocate( cache, size );
+    } else {
+        uint64_t start = nanoseconds();
+        address = allocate( cache, size );
+        cache->record_allocate( start );
+    }
+
+    if ( cache->profile(size) ) {
+        cache->profiling = true;
+        heap_profile.record( pages.lookup(address), address, size );
+        cache->profiling = false;
+    }
     return address;
 }
 
 /**
  */
 void operator delete ( void *address ) throw() {
-    pthread_mutex_lock( &mutex );
-    heap.free( address );
-    pthread_mutex_unlock( &mutex );
+    if ( address == NULL )  return;
+
+    ThreadCache *cache = ThreadCache::current();
+    if ( cache->sample() == false ) {
+        release( cache, address );
+        return;
+    }
+
+    uint64_t start = nanoseconds();
+    release( cache, address );
+    cache->record_free( start );
 }
-
+
 /**
+ * Arena chunks are slabs of one object with no size class, so the page
+ * map knows them and operator delete can tell their objects apart.
  */
-static int
-stats_cmd( ClientData data, Tcl_Interp *interp,
-             int objc, Tcl_Obj * CONST *objv )
-{
-    if ( objc != 1 ) {
-        Tcl_ResetResult( interp );
-        Tcl_WrongNumArgs( interp, 1, objv, "" );
-        return TCL_ERROR;
-    }
+Allocator::Arena::Arena( size_t chunk )
+: first(NULL), current(NULL), cursor(NULL), limit(NULL), outer(NULL),
+  chunk_size(chunk), allocated(0) {
+}
+
+/**
+ */
+Allocator::Arena::~Arena() {
+    if ( ThreadCache::current()->arena == this )  pop();
 
-    Tcl_ResetResult( interp );
-    return TCL_OK;
+    MemPool *chunk = first;
+    while ( chunk != NULL ) {
+        MemPool *next = chunk->next;
+        pages.remove( chunk );
+        delete chunk;
+        chunk = next;
+    }
 }
 
 /**
+ * Move to the next chunk, mapping a new one if there is none or it is
+ * too small for this object.  A chunk that is skipped stays in the list
+ * and is used again after the next reset.
  */
-static int
-usage_cmd( ClientData data, Tcl_Interp *interp,
-             int objc, Tcl_Obj * CONST *objv )
-{
-    if ( objc != 1 ) {
-        Tcl_ResetResult( interp );
-        Tcl_WrongNumArgs( interp, 1, objv, "" );
-        return TCL_ERROR;
+void
+Allocator::Arena::grow( size_t size ) {
+    MemPool *next = (current == NULL) ? first : current->next;
+
+    if ( next == NULL || next->get_size() < size ) {
+        size_t length = (size > chunk_size) ? size : chunk_size;
+        MemPool *chunk = new (length, 1) MemPool( NULL, length, 1 );
+        pages.insert( chunk );
+        chunk->next = next;
+        if ( current == NULL ) {
+            first = chunk;
+        } else {
+            current->next = chunk;
+        }
+        next = chunk;
     }
 
-    Tcl_Obj *result = Tcl_NewListObj( 0, 0 );
-    heap.usage( interp, result );
+    current = next;
+    cursor = current->get_start();
+    limit = cursor + current->get_size();
+}
+
+/**
+ */
+void
+Allocator::Arena::reset() {
+    current = NULL;
+    cursor = limit = NULL;
+    allocated = 0;
+}
+
+/**
+ * Route this thread's operator new to the arena until pop().  Arenas
+ * nest; pop() returns to the one that was pushed before.
+ */
+void
+Allocator::Arena::push() {
+    ThreadCache *cache = ThreadCache::current();
+    outer = cache->arena;
+    cache->arena = this;
+}
+
+/**
+ */
+void
+Allocator::Arena::pop() {
+    ThreadCache *cache = ThreadCache::current();
+    if ( cache->arena != this ) {
+        syslog( LOG_ERR, "Allocator::Arena popped out of order" );
+        return;
+    }
+    cache->arena = outer;
+    outer = NULL;
+}
 
-    Tcl_SetObjResult( interp, result );
-    return TCL_OK;
+/**
+ */
+size_t
+Allocator::Arena::mapped() const {
+    size_t length = 0;
+    for ( MemPool *chunk = first ; chunk != NULL ; chunk = chunk->next ) {
+        length += chunk->get_length();
+    }
+    return length;
 }
-
+
 /**
  */
 void
 Allocator::inject( Allocator::Injector *injector ) {
-    Allocator::Injector &f = *injector;
-    MemPool *pool = &heap;
+    SizeClass::inject( injector );
+}
 
-    while ( pool != NULL ) {
-        if ( pool->get_size() == 0 ) return;
-        f( pool->get_size(), pool->get_count(), pool-> available_slots() );
-        pool = pool->next_pool();
+/**
+ */
+void
+Allocator::inject( Allocator::CacheInjector *injector ) {
+    ThreadCache::inject( injector );
+}
+
+/**
+ * The injector is called once for each class after all of the locks
+ * have been dropped, so it is free to allocate.
+ */
+void
+Allocator::inject( Allocator::ClassInjector *injector ) {
+    Allocator::ClassInjector &f = *injector;
+    Allocator::ClassUsage usage[SizeClass::class_count];
+
+    ThreadCache::current();
+    ThreadCache::usage( usage );
+
+    for ( int index = 0 ; index < SizeClass::class_count ; index++ ) {
+        if ( usage[index].traffic.allocations == 0 && usage[index].slabs == 0 )  continue;
+        f( usage[index] );
+    }
+}
+
+/**
+ */
+void
+Allocator::latency( Allocator::Latency *latency ) {
+    ThreadCache::current();
+    ThreadCache::usage( latency );
+}
+
+/**
+ * Write the class counters and latency histograms to a file, one
+ * line per class or bucket.  The file is written with stdio, which
+ * does not use the global operator new.
+ */
+bool
+Allocator::dump( const char *filename ) {
+    Allocator::ClassUsage usage[SizeClass::class_count];
+    Allocator::Latency latency;
+
+    ThreadCache::current();
+    ThreadCache::usage( usage );
+    ThreadCache::usage( &latency );
+
+    FILE *f = fopen( filename, "w" );
+    if ( f == NULL )  return false;
+
+    fprintf( f, "%8s %12s %12s %12s %12s %8s %10s\n",
+             "class", "allocations", "frees", "live", "peak", "slabs", "contention" );
+    for ( int index = 0 ; index < SizeClass::class_count ; index++ ) {
+        Allocator::ClassUsage& u = usage[index];
+        if ( u.traffic.allocations == 0 && u.slabs == 0 )  continue;
+        char name[24];
+        if ( u.size == 0 ) {
+            snprintf( name, sizeof(name), "large" );
+        } else {
+            snprintf( name, sizeof(name), "%lu", (unsigned long)u.size );
+        }
+        fprintf( f, "%8s %12llu %12llu %12llu %12lu %8d %10llu\n", name,
+                 (unsigned long long)u.traffic.allocations,
+                 (unsigned long long)u.traffic.frees,
+                 (unsigned long long)u.traffic.live(),
+                 (unsigned long)u.peak, u.slabs,
+                 (unsigned long long)u.contention );
+    }
+
+    fprintf( f, "\n%12s %12s %12s\n", "ns", "allocate", "free" );
+    for ( int bucket = 0 ; bucket < Allocator::Latency::buckets ; bucket++ ) {
+        if ( latency.allocate[bucket] == 0 && latency.free[bucket] == 0 )  continue;
+        fprintf( f, "%12llu %12llu %12llu\n", 1ULL << bucket,
+                 (unsigned long long)latency.allocate[bucket],
+                 (unsigned long long)latency.free[bucket] );
+    }
+
+    return fclose( f ) == 0;
+}
+
+/**
+ */
+bool
+Allocator::profile( FILE *f, Allocator::ProfileFormat format ) {
+    return heap_profile.write( f, format );
+}
+
+/**
+ * Flush this thread's cache, ask every other thread to flush its cache
+ * the next time it goes to the heap, and release every empty slab.
+ * Returns the number of bytes given back to the kernel.
+ */
+size_t
+Allocator::trim() {
+    __sync_fetch_and_add( &ThreadCache::trim_epoch, 1 );
+    ThreadCache::current()->flush();
+
+    size_t released = 0;
+    for ( int index = 0 ; index < SizeClass::small_classes ; index++ ) {
+        released += SizeClass::get(index)->trim( 0 );
     }
+    return released;
 }
 
 /* vim: set autoindent expandtab sw=4 : */
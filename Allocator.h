@@ -7,8 +7,42 @@
 #ifndef _ALLOCATOR_H_
 #define _ALLOCATOR_H_
 
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+
+class MemPool;
+
 namespace Allocator {
 
+    /**
+     * Non-zero reports slab creation on stderr, greater than one also
+     * reports every slot allocated and freed.
+     */
+    extern int debug;
+
+    /**
+     * Each size class keeps up to retain_slabs empty slabs for reuse.
+     * Any more are given back to the kernel as they empty, by unmapping
+     * them if unmap_slabs is set or by purging their pages with
+     * madvise() if it is not.
+     */
+    extern int retain_slabs;
+    extern int unmap_slabs;
+
+    /**
+     * When positive, one allocate or free in every sample_interval on
+     * each thread is timed and added to the latency histograms.
+     */
+    extern int sample_interval;
+
+    /**
+     * When positive, about one allocation in every profile_interval
+     * bytes on each thread has its backtrace recorded for the heap
+     * profile.
+     */
+    extern int profile_interval;
+
     /**
      * The Injector object will be called once for each slab of allocated
      * data.  Each slab stores objects all of the same size.
@@ -20,7 +54,147 @@ namespace Allocator {
         virtual void operator () ( size_t objsize, int allocated, uint32_t available ) = 0;
     };
 
+    /**
+     * The CacheInjector will be called once for each non-empty bin of
+     * each thread's object cache.
+     */
+    class CacheInjector {
+    public:
+        CacheInjector() {}
+        virtual ~CacheInjector() {}
+        virtual void operator () ( pid_t thread, size_t objsize, int cached ) = 0;
+    };
+
+    /**
+     * Allocation traffic for a size class.  Allocated is what the
+     * requests were rounded up to, so the difference from requested
+     * is the internal fragmentation of the class.
+     */
+    struct Traffic {
+        uint64_t allocations;
+        uint64_t frees;
+        uint64_t requested;
+        uint64_t allocated;
+        uint64_t freed;
+
+        Traffic& operator += ( const Traffic& that ) {
+            allocations += that.allocations;
+            frees += that.frees;
+            requested += that.requested;
+            allocated += that.allocated;
+            freed += that.freed;
+            return *this;
+        }
+        uint64_t live() const { return allocated - freed; }
+    };
+
+    /**
+     * Usage of one size class.  A size of zero is the class of large
+     * objects, which are mapped one per slab.
+     *
+     * Peak is the most bytes the class has had handed out of its slabs
+     * at once, which includes objects parked in thread caches.
+     * Contention is the number of times a thread found the class lock
+     * already held.
+     */
+    struct ClassUsage {
+        size_t size;
+        int slabs;
+        size_t mapped;
+        size_t objects;
+        size_t peak;
+        uint64_t contention;
+        Traffic traffic;
+    };
+
+    /**
+     * Sampled call times.  Bucket n counts calls that took less than
+     * 2^n nanoseconds and at least 2^(n-1).
+     */
+    struct Latency {
+        static const int buckets = 32;
+        uint64_t allocate[buckets];
+        uint64_t free[buckets];
+
+        Latency& operator += ( const Latency& that ) {
+            for ( int i = 0 ; i < buckets ; i++ ) {
+                allocate[i] += that.allocate[i];
+                free[i] += that.free[i];
+            }
+            return *this;
+        }
+    };
+
+    /**
+     * The ClassInjector will be called once for each size class that
+     * has been used.
+     */
+    class ClassInjector {
+    public:
+        ClassInjector() {}
+        virtual ~ClassInjector() {}
+        virtual void operator () ( const ClassUsage& ) = 0;
+    };
+
     void inject( Injector * );
+    void inject( CacheInjector * );
+    void inject( ClassInjector * );
+
+    /**
+     * Heap profile formats.  Pprof is the legacy heap_v2 text format,
+     * followed by the process maps so pprof can symbolize it.  Folded is
+     * one line of frames per stack, outermost first, with the estimated
+     * live bytes, as read by flamegraph.pl.
+     */
+    enum ProfileFormat { pprof, folded };
+
+    /**
+     * A bump pointer arena for objects that all die together, such as
+     * the allocations made while handling one request.  Objects are
+     * carved from chunks in order and never freed one at a time;
+     * reset() frees all of them at once in constant time and keeps the
+     * chunks for reuse.
+     *
+     * While an arena is pushed, operator new on that thread allocates
+     * from it.  operator delete ignores arena objects on any thread, so
+     * code that deletes what it allocated still works.  Nothing that
+     * must outlive reset() may be allocated while the arena is pushed.
+     */
+    class Arena {
+        MemPool *first, *current;
+        uint8_t *cursor, *limit;
+        Arena *outer;
+        size_t chunk_size;
+        size_t allocated;
+
+        Arena( const Arena& );
+        Arena& operator = ( const Arena& );
+        void grow( size_t );
+    public:
+        static const size_t default_chunk = 64 * 1024;
+
+        Arena( size_t = default_chunk );
+        ~Arena();
+        void *allocate( size_t size ) {
+            size = (size + 15) & ~(size_t)15;
+            if ( size == 0 )  size = 16;
+            if ( (size_t)(limit - cursor) < size )  grow( size );
+            void *object = cursor;
+            cursor += size;
+            allocated += size;
+            return object;
+        }
+        void reset();
+        void push();
+        void pop();
+        size_t bytes() const { return allocated; }
+        size_t mapped() const;
+    };
+
+    void latency( Latency * );
+    bool dump( const char * );
+    bool profile( FILE *, ProfileFormat );
+    size_t trim();
 }
 
 #endif
@@ -37,17 +37,23 @@
 #include <sys/types.h>
 #include <sys/ipc.h>
 #include <sys/msg.h>
+#include <sys/mman.h>
 
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
 #include <syslog.h>
-#include <glob.h>
 
 #include "string_util.h"
+#include "Liveness.h"
 #include "Channel.h"
+#include "ChannelShm.h"
+#include "ChannelSocket.h"
 #include "Service.h"
 
 namespace { int debug = 0; }
@@ -55,59 +61,38 @@ namespace { int debug = 0; }
 /**
  * dst is the destination service id
  * src is the source service id
+ * id is the client's id for the request, returned with the response
  */
 struct channel_message {
     long dst;
     long src;
     long error;
+    long id;
     char body[1012];
 };
-#define MESSAGE_OK        0
-#define MESSAGE_ERROR     1
-#define MESSAGE_EXCEPTION 2
-
-/** 
- * Look through list of processes to see if the named service is
- * alive.  We check by looking a process that has its executable
- * as /usr/sbin/[service_name].
- *
- * Note: readlink does not NULL terminate the strings it reads, so
- *   we must do it explicitly.
- */
-static int
-is_alive( char *service_name ) {
-    int result = 0;
-    glob_t processes;
-    size_t i;
-    char exe[256], path[80];
-
-    sprintf( path, "/usr/sbin/%s", service_name );
-
-    memset( &processes, 0, sizeof(processes) );
-    glob( "/proc/*/exe", GLOB_NOSORT, NULL, &processes );
-
-    for ( i = 0 ; i < processes.gl_pathc ; i++ ) {
-        int count = readlink( processes.gl_pathv[i], exe, sizeof(exe) );
-        if ( count == -1 ) continue;
-        exe[count] = '\0';
-        if ( strcmp(exe, path) == 0 ) {
-            result = 1;
-            break;
-        }
-    }
 
-    globfree( &processes );
-    return result;
-}
+/**
+ * Everything msgsnd() counts after dst, apart from the body.
+ */
+#define MESSAGE_HEADER (sizeof(long) + sizeof(long) + sizeof(long) + sizeof(char))
+
+/**
+ * Set in the error of every fragment of a long response but the last.
+ */
+#define MESSAGE_MORE 0x100
 
 /**
+ * FNV-1a over the whole name.  Services that share their first four
+ * characters must not share a queue.
  */
 key_t service_key( const char *service_name ) {
-    key_t key = *( (key_t*)service_name );
-    if ( key == -1 ) {
-        syslog( LOG_ERR, "could not generate a key for '%s'", service_name );
-        exit( 1 );
+    unsigned int hash = 2166136261u;
+    for ( const char *p = service_name ; *p != '\0' ; p++ ) {
+        hash ^= (unsigned char)*p;
+        hash *= 16777619u;
     }
+    key_t key = (key_t)hash;
+    if ( key == IPC_PRIVATE || key == -1 )  key ^= 1;
     // send this to stdout if the tcl interpreter is interactive
     // syslog( LOG_NOTICE, "channel key for '%s' is 0x%08x", service_name, key );
     return key;
@@ -134,38 +119,98 @@ key_t service_key( const char *service_name ) {
  * so neither could start.  So, the client needs to be able to
  * create the server's directory also.
  */
-Channel::Channel( Service *service )
-: service(service) {
-    key_t key = service_key( service->name() );
+class MsgqTransport : public ChannelTransport {
+    static const int lock_count = 64;
+    int q;
+    pthread_mutex_t locks[lock_count];
+    Liveness *clients;
+public:
+    MsgqTransport( const char * );
+    virtual ~MsgqTransport() {}
+    virtual long receive( ChannelMessage&, uint32_t *, int * );
+    virtual void send( long, uint32_t, int, const char *, size_t );
+    virtual bool alive( long );
+};
+
+/**
+ * Responses still queued for a client that has exited would sit in the
+ * queue for ever, using up its space.
+ */
+class MsgqReaper : public LivenessReaper {
+    int q;
+public:
+    MsgqReaper( int q ) : q(q) {}
+    virtual ~MsgqReaper() {}
+    virtual void operator () ( pid_t pid ) {
+        struct channel_message m;
+        int count = 0;
+        while ( msgrcv(q, &m, sizeof(m), pid, IPC_NOWAIT | MSG_NOERROR) >= 0 )  count++;
+        if ( count > 0 ) {
+            syslog( LOG_NOTICE, "dropped %d responses for exited client %d", count, pid );
+        }
+    }
+};
+
+/**
+ */
+MsgqTransport::MsgqTransport( const char *service_name ) {
+    for ( int i = 0 ; i < lock_count ; i++ ) {
+        pthread_mutex_init( &locks[i], NULL );
+    }
+    key_t key = service_key( service_name );
     syslog( LOG_NOTICE, "msgQ id = 0x%08x", key );
 
     // Eventually change this so only root can send...
     q = msgget( key, IPC_CREAT | 0777 );
     if ( q < 0 ) {
-        syslog( LOG_ERR, "could not create a msgQ for '%s'", service->name() );
+        syslog( LOG_ERR, "could not create a msgQ for '%s'", service_name );
         exit( 1 );
     }
+    clients = new Liveness( "liveness", new MsgqReaper(q) );
+    clients->start();
 }
 
 /**
- * \todo should use IPC_NOWAIT -- and try again if EAGAIN
- * \todo fix message length calculation
+ * A long response goes as several messages, all but the last flagged
+ * with MESSAGE_MORE.  They all carry the client's pid, so it reads them
+ * back in order, and a lock per client keeps two workers from mixing
+ * their fragments.  While the queue is full this retries for as long
+ * as the client is still there to drain it.
  */
 void
-Channel::send( long dst, int result, char *message ) {
-    int flags = 0; // IPC_NOWAIT | MSG_NOERROR
+MsgqTransport::send( long dst, uint32_t id, int result, const char *message, size_t length ) {
     struct channel_message m;
+    struct timespec delay = { 0, 1000000 };
+    size_t offset = 0;
     m.dst = dst;
     m.src = 1;
-    m.error = result;
-    int bytes = strlcpy( m.body, message, sizeof(m.body) );
-    if ( bytes > sizeof(m.body) ) {
-        syslog( LOG_WARNING, "message body truncated" );
-        bytes = sizeof(m.body) - 1;
-    }
-    if ( msgsnd(q, &m, bytes + sizeof(char) + sizeof(long) + sizeof(long), flags) < 0 ) {
-        syslog( LOG_ERR, "failed to msgsnd" );
-    }
+    m.id = id;
+
+    pthread_mutex_t *lock = &locks[ dst % lock_count ];
+    pthread_mutex_lock( lock );
+    do {
+        size_t bytes = length - offset;
+        m.error = result;
+        if ( bytes >= sizeof(m.body) ) {
+            bytes = sizeof(m.body) - 1;
+            m.error |= MESSAGE_MORE;
+        }
+        memcpy( m.body, message + offset, bytes );
+        m.body[bytes] = '\0';
+        offset += bytes;
+
+        while ( msgsnd(q, &m, bytes + MESSAGE_HEADER, IPC_NOWAIT) < 0 ) {
+            if ( errno == EINTR )  continue;
+            if ( errno == EAGAIN && alive(dst) ) {
+                nanosleep( &delay, NULL );
+                continue;
+            }
+            syslog( LOG_ERR, "failed to msgsnd" );
+            pthread_mutex_unlock( lock );
+            return;
+        }
+    } while ( offset < length );
+    pthread_mutex_unlock( lock );
 }
 
 /**
@@ -173,7 +218,7 @@ Channel::send( long dst, int result, char *message ) {
  * \todo add retry logic when we get a msgrcv err on Channel
  */
 long
-Channel::receive( char *buffer, int length ) {
+MsgqTransport::receive( ChannelMessage& message, uint32_t *id, int *kind ) {
     int flags = 0; // IPC_NOWAIT | MSG_NOERROR
     struct channel_message request;
     int bytes = msgrcv( q, &request, sizeof(request), 1, flags );
@@ -182,13 +227,61 @@ Channel::receive( char *buffer, int length ) {
         syslog( LOG_ERR, "Error receiving Channel request" );
     }
     if ( debug > 0 ) syslog( LOG_NOTICE, "request '%s'", request.body );
-    strlcpy( buffer, request.body, length );
+    size_t body = (bytes > (int)MESSAGE_HEADER) ? bytes - MESSAGE_HEADER : 0;
+    message.clear();
+    message.append( request.body, body );
+    *id = request.id;
+    *kind = request.error;
     return request.src;
 }
 
 /**
+ * The sender is the client's pid.
  */
-ChannelClient::ChannelClient( char *service_name ) {
+bool
+MsgqTransport::alive( long sender ) {
+    return clients->alive( sender );
+}
+
+/**
+ * A message queue has no way to wait for a message with a time limit,
+ * so the first receive() that has one starts a reader thread for the
+ * process.  It blocks in msgrcv() and hands each message over to
+ * whoever is waiting on the condition variable, which can time out.
+ * From then on every receive() takes its messages from the reader.
+ */
+class MsgqClientTransport : public ChannelClientTransport {
+    struct Arrival {
+        struct channel_message m;
+        int bytes;
+        Arrival *next;
+    };
+
+    int q;
+    char service[80];
+    ChannelMessage partial;
+    pid_t reader;
+    pthread_t reader_thread;
+    pthread_mutex_t lock;
+    pthread_cond_t arrived;
+    Arrival *head, *tail;
+    int failure;
+
+    static void *read_responses( void * );
+    bool start_reader();
+    int take( struct channel_message *, const struct timespec * );
+    void discard();
+public:
+    MsgqClientTransport( const char * );
+    virtual ~MsgqClientTransport();
+    virtual bool send( uint32_t, int, const char *, size_t );
+    virtual int receive( ChannelMessage&, uint32_t *, int );
+};
+
+/**
+ */
+MsgqClientTransport::MsgqClientTransport( const char *service_name )
+: reader(0), head(NULL), tail(NULL), failure(0) {
     strlcpy( service, service_name, sizeof(service) );
     key_t key = service_key( service_name );
     // Eventually change this so only root can send...
@@ -200,75 +293,631 @@ ChannelClient::ChannelClient( char *service_name ) {
 }
 
 /**
- * \todo should use IPC_NOWAIT -- and try again if EAGAIN
- * \todo fix message length calculation
+ * The queue is shared by requests and responses, so if it is full this
+ * gives up after a moment and lets the caller read responses.  A
+ * request carries its kind where a response carries its result.
  */
-void
-ChannelClient::send( char *message ) {
-    int flags = 0; // IPC_NOWAIT | MSG_NOERROR
+bool
+MsgqClientTransport::send( uint32_t id, int kind, const char *message, size_t length ) {
+    struct timespec delay = { 0, 1000000 };
     struct channel_message m;
     m.dst = 1;
     m.src = getpid();
-    m.error = 0;
-    int bytes = strlcpy( m.body, message, sizeof(m.body) );
-    if ( bytes > sizeof(m.body) ) {
+    m.error = kind;
+    m.id = id;
+    size_t bytes = length;
+    if ( bytes >= sizeof(m.body) ) {
         syslog( LOG_WARNING, "message body truncated" );
         bytes = sizeof(m.body) - 1;
     }
-    if ( msgsnd(q, &m, bytes + sizeof(char) + sizeof(long) + sizeof(long), flags) < 0 ) {
+    memcpy( m.body, message, bytes );
+    m.body[bytes] = '\0';
+    for (;;) {
+        if ( msgsnd(q, &m, bytes + MESSAGE_HEADER, IPC_NOWAIT) == 0 )  return true;
+        if ( errno == EINTR )  continue;
+        if ( errno == EAGAIN ) {
+            nanosleep( &delay, NULL );
+            return false;
+        }
         syslog( LOG_ERR, "failed to msgsnd" );
+        return true;
     }
 }
 
 /**
- * block ... read from Q and process msg
  */
-int
-ChannelClient::receive( char *buffer, int length ) {
-    int flags = 0; // IPC_NOWAIT | MSG_NOERROR
-    struct channel_message request;
+MsgqClientTransport::~MsgqClientTransport() {
+    if ( reader == getpid() ) {
+        pthread_cancel( reader_thread );
+        pthread_join( reader_thread, NULL );
+    }
+    discard();
+}
 
-    int bytes = msgrcv( q, &request, sizeof(request), getpid(), flags );
-    if ( bytes < 0 ) {
-        // how to handle error -- try again
+/**
+ * Free any messages the reader has queued.
+ */
+void
+MsgqClientTransport::discard() {
+    while ( head != NULL ) {
+        Arrival *arrival = head;
+        head = arrival->next;
+        free( arrival );
     }
-    strlcpy( buffer, request.body, length );
-    return request.error;
+    tail = NULL;
 }
 
 /**
+ * The reader only lets itself be cancelled while it waits in msgrcv(),
+ * never while it holds the lock.  It takes no signals, so they still go
+ * to the application's own threads.
+ */
+void *
+MsgqClientTransport::read_responses( void *data ) {
+    MsgqClientTransport *self = (MsgqClientTransport *)data;
+    pid_t pid = self->reader;
+    sigset_t all;
+    sigfillset( &all );
+    pthread_sigmask( SIG_BLOCK, &all, NULL );
+
+    for (;;) {
+        struct channel_message m;
+        int bytes = msgrcv( self->q, &m, sizeof(m), pid, 0 );
+        if ( bytes < 0 && errno == EINTR )  continue;
+
+        int state;
+        pthread_setcancelstate( PTHREAD_CANCEL_DISABLE, &state );
+        pthread_mutex_lock( &self->lock );
+        if ( bytes < 0 ) {
+            self->failure = errno;
+            syslog( LOG_ERR, "channel msgrcv failed: %s", strerror(errno) );
+            pthread_cond_broadcast( &self->arrived );
+            pthread_mutex_unlock( &self->lock );
+            return NULL;
+        }
+        Arrival *arrival = (Arrival *)malloc( sizeof(Arrival) );
+        if ( arrival == NULL ) {
+            syslog( LOG_ERR, "no memory for a channel response, dropped" );
+        } else {
+            memcpy( &arrival->m, &m, bytes + sizeof(m.dst) );
+            arrival->bytes = bytes;
+            arrival->next = NULL;
+            if ( self->tail == NULL )  self->head = arrival;
+            else                       self->tail->next = arrival;
+            self->tail = arrival;
+            pthread_cond_signal( &self->arrived );
+        }
+        pthread_mutex_unlock( &self->lock );
+        pthread_setcancelstate( state, NULL );
+    }
+}
+
+/**
+ * Start this process's reader if it is not running.  After fork() the
+ * parent's reader is not running in the child, and what it had queued
+ * was for the parent, so the child starts afresh.
+ */
+bool
+MsgqClientTransport::start_reader() {
+    pid_t pid = getpid();
+    if ( reader == pid )  return true;
+
+    pthread_condattr_t attributes;
+    pthread_condattr_init( &attributes );
+    pthread_condattr_setclock( &attributes, CLOCK_MONOTONIC );
+    pthread_cond_init( &arrived, &attributes );
+    pthread_condattr_destroy( &attributes );
+    pthread_mutex_init( &lock, NULL );
+    discard();
+    failure = 0;
+
+    reader = pid;
+    int error = pthread_create( &reader_thread, NULL, read_responses, this );
+    if ( error != 0 ) {
+        syslog( LOG_ERR, "could not start a channel reader: %s", strerror(error) );
+        reader = 0;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Wait for the reader's next message until the deadline, or for ever if
+ * there is none.  Returns its size as msgrcv() would, or -1 with errno
+ * set to ETIMEDOUT, or to the error the reader stopped on.
  */
 int
-ChannelClient::receive( char *buffer, int length, time_t time_limit ) {
-    struct channel_message request;
-    time_t elapsed = 0;
-    struct timespec delay = { 1, 0 };
+MsgqClientTransport::take( struct channel_message *m, const struct timespec *deadline ) {
+    pthread_mutex_lock( &lock );
+    while ( head == NULL && failure == 0 ) {
+        if ( deadline == NULL ) {
+            pthread_cond_wait( &arrived, &lock );
+        } else if ( pthread_cond_timedwait(&arrived, &lock, deadline) == ETIMEDOUT ) {
+            break;
+        }
+    }
+    Arrival *arrival = head;
+    if ( arrival == NULL ) {
+        int error = (failure != 0) ? failure : ETIMEDOUT;
+        pthread_mutex_unlock( &lock );
+        errno = error;
+        return -1;
+    }
+    head = arrival->next;
+    if ( head == NULL )  tail = NULL;
+    pthread_mutex_unlock( &lock );
+
+    int bytes = arrival->bytes;
+    memcpy( m, &arrival->m, bytes + sizeof(m->dst) );
+    free( arrival );
+    return bytes;
+}
+
+/**
+ * Read until every fragment of the response has arrived.  Without a
+ * time limit, and until a receive() with one has started the reader,
+ * this blocks in msgrcv() itself.  Fragments read before a timeout are
+ * kept for the next call.
+ */
+int
+MsgqClientTransport::receive( ChannelMessage& message, uint32_t *id, int milliseconds ) {
+    struct channel_message response;
+    const size_t header = MESSAGE_HEADER;
     pid_t pid = getpid();
 
-    do {
-        int bytes = msgrcv( q, &request, sizeof(request), pid, IPC_NOWAIT );
+    bool reading = reader == pid;
+    if ( milliseconds >= 0 && reading == false ) {
+        if ( start_reader() == false )  return MESSAGE_EXCEPTION;
+        reading = true;
+    }
 
-        if ( bytes > 0 ) {
-            strlcpy( buffer, request.body, length );
-            return request.error;
+    struct timespec deadline;
+    clock_gettime( CLOCK_MONOTONIC, &deadline );
+    if ( milliseconds > 0 ) {
+        deadline.tv_sec += milliseconds / 1000;
+        deadline.tv_nsec += (milliseconds % 1000) * 1000000L;
+        if ( deadline.tv_nsec >= 1000000000L ) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
         }
+    }
+
+    for (;;) {
+        int bytes;
+        if ( reading ) {
+            bytes = take( &response, (milliseconds < 0) ? NULL : &deadline );
+        } else {
+            bytes = msgrcv( q, &response, sizeof(response), pid, 0 );
+        }
+        if ( bytes >= (int)header ) {
+            partial.append( response.body, bytes - header );
+            if ( response.error & MESSAGE_MORE )  continue;
+            message.swap( partial );
+            partial.clear();
+            *id = response.id;
+            return response.error;
+        }
+        if ( bytes >= 0 ) {
+            syslog( LOG_ERR, "short channel message" );
+            return MESSAGE_EXCEPTION;
+        }
+        if ( errno == EINTR )  continue;
+        if ( reading == false )  syslog( LOG_ERR, "channel msgrcv failed: %s", strerror(errno) );
+        return MESSAGE_EXCEPTION;
+    }
+}
+
+/**
+ */
+Channel::Channel( Service *service, Kind kind )
+: service(service) {
+    switch ( kind ) {
+    case shm:
+        transport = shm_channel( service->name() );
+        break;
+    case seqpacket:
+        transport = socket_channel( service->name() );
+        break;
+    default:
+        transport = NULL;
+        break;
+    }
+    if ( transport != NULL )  return;
+    if ( kind != msgq ) {
+        syslog( LOG_WARNING, "falling back to a msgQ for '%s'", service->name() );
+    }
+    transport = new MsgqTransport( service->name() );
+}
+
+/**
+ */
+void
+Channel::send( long dst, uint32_t id, int result, const char *message, size_t length ) {
+    transport->send( dst, id, result, message, length );
+}
+
+/**
+ */
+long
+Channel::receive( ChannelMessage& message, uint32_t *id, int *kind ) {
+    return transport->receive( message, id, kind );
+}
+
+/**
+ * True while the client that sent a request can still take the
+ * response.
+ */
+bool
+Channel::alive( long sender ) {
+    return transport->alive( sender );
+}
 
-#if 0 // where is valgrind on OSX
-        /**
-         * We only want this error correction when we are not running under
-         * valgrind, since valgrind changes the name of the program that is
-         * running and all messaging would fail since we can not detect process
-         * liveness after the program name change.
-         */
-        if ( RUNNING_ON_VALGRIND == 0 ) {
-            if ( is_alive(service) == false ) return MESSAGE_EXCEPTION;
+/**
+ * Use the service's shared memory segment if it has one, otherwise its
+ * socket if something is listening on it.
+ */
+ChannelClient::ChannelClient( char *service_name )
+: next_id(0), pending(NULL) {
+    strlcpy( service, service_name, sizeof(service) );
+    transport = shm_client( service_name );
+    if ( transport == NULL )  transport = socket_client( service_name );
+    if ( transport == NULL )  transport = new MsgqClientTransport( service_name );
+}
+
+/**
+ * A request that has been sent and not yet handed back.  Its response
+ * is kept here if it arrives while the client waits for another.
+ */
+struct ChannelClient::Pending {
+    uint32_t id;
+    bool done;
+    int error;
+    ChannelMessage response;
+    Pending *next;
+};
+
+namespace {
+
+    void
+    deadline_after( struct timespec *deadline, int milliseconds ) {
+        clock_gettime( CLOCK_MONOTONIC, deadline );
+        deadline->tv_sec += milliseconds / 1000;
+        deadline->tv_nsec += (milliseconds % 1000) * 1000000L;
+        if ( deadline->tv_nsec >= 1000000000L ) {
+            deadline->tv_sec += 1;
+            deadline->tv_nsec -= 1000000000L;
         }
-#endif
-        nanosleep( &delay, NULL );
-    } while ( ++elapsed < time_limit );
+    }
+
+    /**
+     * Milliseconds left before a deadline, or -1 for none.
+     */
+    int
+    remaining( const struct timespec *deadline ) {
+        if ( deadline == NULL )  return -1;
+        struct timespec now;
+        clock_gettime( CLOCK_MONOTONIC, &now );
+        long left = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+        return (left > 0) ? left : 0;
+    }
+
+}
 
-    syslog( LOG_ERR, "ERROR channel recv timed out" );
-    return MESSAGE_EXCEPTION;
+/**
+ */
+ChannelClient::~ChannelClient() {
+    while ( pending != NULL )  forget( pending );
+    delete transport;
+}
+
+/**
+ */
+ChannelClient::Pending *
+ChannelClient::find( uint32_t id ) {
+    for ( Pending *p = pending ; p != NULL ; p = p->next ) {
+        if ( p->id == id )  return p;
+    }
+    return NULL;
+}
+
+/**
+ */
+void
+ChannelClient::forget( Pending *request ) {
+    Pending **link = &pending;
+    while ( *link != request )  link = &(*link)->next;
+    *link = request->next;
+    delete request;
+}
+
+/**
+ * Read the next whole response from the transport.  The id is left at
+ * zero, which no request uses, if nothing arrived in time.
+ */
+int
+ChannelClient::next_response( ChannelMessage& message, uint32_t *id, const struct timespec *deadline ) {
+    *id = 0;
+    int result = transport->receive( message, id, remaining(deadline) );
+    if ( *id == 0 )  message.clear();
+    return result;
+}
+
+/**
+ * Hold a response until it is asked for.  One to a request that has
+ * been abandoned is dropped.
+ */
+void
+ChannelClient::complete( uint32_t id, int error, ChannelMessage& response ) {
+    Pending *request = find( id );
+    if ( request == NULL )  return;
+    request->response.swap( response );
+    request->error = error;
+    request->done = true;
+}
+
+/**
+ * Send a request without waiting for its response, and return its id.
+ * While there is no room for it, take the responses that have arrived,
+ * in case the service is waiting for room to send them.  The kind says
+ * whether the message is a script or a command list.
+ */
+uint32_t
+ChannelClient::submit( const char *message, int kind ) {
+    return submit( message, strlen(message), kind );
+}
+
+/**
+ * A request that may hold nul bytes.
+ */
+uint32_t
+ChannelClient::submit( const char *message, size_t length, int kind ) {
+    if ( ++next_id == 0 )  next_id = 1;
+
+    Pending *request = new Pending;
+    request->id = next_id;
+    request->done = false;
+    request->error = MESSAGE_OK;
+    request->next = NULL;
+
+    Pending **link = &pending;
+    while ( *link != NULL )  link = &(*link)->next;
+    *link = request;
+
+    while ( transport->send(request->id, kind, message, length) == false ) {
+        struct timespec now;
+        deadline_after( &now, 0 );
+        for (;;) {
+            ChannelMessage response;
+            uint32_t other;
+            int error = next_response( response, &other, &now );
+            if ( other == 0 )  break;
+            complete( other, error, response );
+        }
+    }
+    return request->id;
+}
+
+/**
+ * Wait for the response to one request.  If none comes in time the
+ * request is abandoned.
+ */
+int
+ChannelClient::wait( uint32_t id, ChannelMessage& message, int milliseconds ) {
+    Pending *request = find( id );
+    if ( request == NULL ) {
+        message.clear();
+        return MESSAGE_EXCEPTION;
+    }
+
+    struct timespec deadline;
+    if ( milliseconds >= 0 )  deadline_after( &deadline, milliseconds );
+
+    while ( request->done == false ) {
+        ChannelMessage response;
+        uint32_t other;
+        int error = next_response( response, &other, (milliseconds < 0) ? NULL : &deadline );
+        if ( other == 0 ) {
+            syslog( LOG_ERR, "ERROR channel recv timed out" );
+            forget( request );
+            message.clear();
+            return error;
+        }
+        complete( other, error, response );
+    }
+
+    message.swap( request->response );
+    int result = request->error;
+    forget( request );
+    return result;
+}
+
+/**
+ * Take the next response to any outstanding request, and set id to
+ * that request.
+ */
+int
+ChannelClient::receive_any( uint32_t *id, ChannelMessage& message, int milliseconds ) {
+    for ( Pending *p = pending ; p != NULL ; p = p->next ) {
+        if ( p->done == false )  continue;
+        *id = p->id;
+        message.swap( p->response );
+        int result = p->error;
+        forget( p );
+        return result;
+    }
+
+    message.clear();
+    if ( pending == NULL )  return MESSAGE_EXCEPTION;
+
+    struct timespec deadline;
+    if ( milliseconds >= 0 )  deadline_after( &deadline, milliseconds );
+
+    for (;;) {
+        uint32_t other;
+        int error = next_response( message, &other, (milliseconds < 0) ? NULL : &deadline );
+        if ( other == 0 ) {
+            syslog( LOG_ERR, "ERROR channel recv timed out" );
+            return error;
+        }
+        Pending *p = find( other );
+        if ( p == NULL )  continue;
+        forget( p );
+        *id = other;
+        return error;
+    }
+}
+
+/**
+ */
+int
+ChannelClient::outstanding() {
+    int count = 0;
+    for ( Pending *p = pending ; p != NULL ; p = p->next )  count++;
+    return count;
+}
+
+/**
+ */
+void
+ChannelClient::send( char *message ) {
+    submit( message );
+}
+
+/**
+ */
+int
+ChannelClient::receive( char *buffer, int length ) {
+    return receive_within( buffer, length, -1 );
+}
+
+/**
+ */
+int
+ChannelClient::receive( char *buffer, int length, time_t time_limit ) {
+    return receive_within( buffer, length, time_limit * 1000 );
+}
+
+/**
+ */
+int
+ChannelClient::receive_within( char *buffer, int length, int milliseconds ) {
+    ChannelMessage message;
+    int result = receive( message, milliseconds );
+    strlcpy( buffer, message.data(), length );
+    return result;
+}
+
+/**
+ * The response to the oldest outstanding request.
+ */
+int
+ChannelClient::receive( ChannelMessage& message, int milliseconds ) {
+    if ( pending == NULL ) {
+        message.clear();
+        return MESSAGE_EXCEPTION;
+    }
+    return wait( pending->id, message, milliseconds );
+}
+
+/**
+ */
+ChannelMessage::ChannelMessage()
+: buffer(NULL), used(0), capacity(0), mapping(NULL), mapped(0) {
+}
+
+/**
+ */
+ChannelMessage::~ChannelMessage() {
+    clear();
+    free( buffer );
+}
+
+/**
+ * Keeps the buffer for the next message, unless an unusually long one
+ * has grown it.
+ */
+void
+ChannelMessage::clear() {
+    if ( mapping != NULL )  munmap( mapping, mapped );
+    mapping = NULL;
+    mapped = 0;
+    used = 0;
+    if ( capacity > 65536 ) {
+        free( buffer );
+        buffer = NULL;
+        capacity = 0;
+    }
+    if ( buffer != NULL )  buffer[0] = '\0';
+}
+
+/**
+ */
+void
+ChannelMessage::append( const char *bytes, size_t length ) {
+    char *room = extend( length );
+    if ( room != NULL )  memcpy( room, bytes, length );
+}
+
+/**
+ * Add length bytes to the end and return where they are, for the caller
+ * to fill in.  Returns NULL if the buffer cannot grow.
+ */
+char *
+ChannelMessage::extend( size_t length ) {
+    if ( used + length + 1 > capacity ) {
+        size_t size = (capacity == 0) ? 1024 : capacity;
+        while ( size < used + length + 1 )  size *= 2;
+        char *grown = (char *)realloc( buffer, size );
+        if ( grown == NULL ) {
+            syslog( LOG_ERR, "could not grow a channel message to %zu bytes", size );
+            return NULL;
+        }
+        buffer = grown;
+        capacity = size;
+    }
+    char *room = buffer + used;
+    used += length;
+    buffer[used] = '\0';
+    return room;
+}
+
+/**
+ * Take over a mapping of size bytes that holds length bytes of text
+ * and a nul.  It is unmapped by clear().
+ */
+void
+ChannelMessage::adopt( void *map, size_t size, size_t length ) {
+    clear();
+    mapping = map;
+    mapped = size;
+    used = length;
+}
+
+/**
+ */
+void
+ChannelMessage::swap( ChannelMessage& other ) {
+    char *b = buffer;  buffer = other.buffer;  other.buffer = b;
+    size_t u = used;  used = other.used;  other.used = u;
+    size_t c = capacity;  capacity = other.capacity;  other.capacity = c;
+    void *m = mapping;  mapping = other.mapping;  other.mapping = m;
+    size_t s = mapped;  mapped = other.mapped;  other.mapped = s;
+}
+
+/**
+ */
+const char *
+ChannelMessage::data() const {
+    if ( mapping != NULL )  return (const char *)mapping;
+    if ( buffer == NULL )  return "";
+    return buffer;
+}
+
+/**
+ */
+size_t
+ChannelMessage::length() const {
+    return used;
 }
 
 /* vim: set autoindent expandtab sw=4 : */
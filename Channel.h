@@ -30,27 +30,112 @@
 #define _CHANNEL_H_
 
 #include <time.h>
+#include <stdint.h>
 #include <tcl.h>
 #include "Thread.h"
 
 class Service;
 
+#define MESSAGE_OK        0
+#define MESSAGE_ERROR     1
+#define MESSAGE_EXCEPTION 2
+
+/**
+ * A script request is evaluated as it is.  A command request is a Tcl
+ * list of a command and its arguments, which are passed to the command
+ * without any substitution.  A frame request is a command list in the
+ * binary frame format, see ChannelFrame.h, and its response is a frame
+ * too.
+ */
+#define REQUEST_SCRIPT    0
+#define REQUEST_COMMAND   1
+#define REQUEST_FRAME     2
+
+/**
+ * A request or response of any length.  Transports append() the
+ * fragments as they arrive, or extend() it and read straight into the
+ * new space, or adopt() a read-only mapping of a large payload that the
+ * service handed over whole.  data() is always nul terminated.
+ */
+class ChannelMessage {
+    char *buffer;
+    size_t used;
+    size_t capacity;
+    void *mapping;
+    size_t mapped;
+    ChannelMessage( const ChannelMessage& );
+    ChannelMessage& operator = ( const ChannelMessage& );
+public:
+    ChannelMessage();
+    ~ChannelMessage();
+    void clear();
+    void append( const char *, size_t );
+    char *extend( size_t );
+    void adopt( void *, size_t, size_t );
+    void swap( ChannelMessage& );
+    const char *data() const;
+    size_t length() const;
+};
+
+/**
+ * The service end of a channel transport.  A sender is whatever the
+ * transport needs to route the response back to the client.  Each
+ * request carries an id chosen by the client, which the response
+ * carries back, and its kind.  receive() replaces the message with the
+ * whole request, which may hold nul bytes.  Responses have no size
+ * limit, and nor do requests on the shm and socket transports; a
+ * transport splits them up as it needs to, and keeps the pieces of one
+ * message together.  The message queue client cuts a request down to
+ * one queue message.
+ */
+class ChannelTransport {
+public:
+    ChannelTransport() {}
+    virtual ~ChannelTransport() {}
+    virtual long receive( ChannelMessage&, uint32_t *, int * ) = 0;
+    virtual void send( long, uint32_t, int, const char *, size_t ) = 0;
+    virtual bool alive( long ) = 0;
+};
+
+/**
+ * The client end of a channel transport.  send() returns false if there
+ * is no room for the request yet; the service may be waiting for room
+ * for our responses, so the caller takes those before trying again.
+ * receive() takes the next response to any request, waiting at most
+ * the given number of milliseconds, or for ever if it is negative.  It
+ * sets the id only when a whole response has arrived, and keeps a
+ * partial one for the next call.
+ */
+class ChannelClientTransport {
+public:
+    ChannelClientTransport() {}
+    virtual ~ChannelClientTransport() {}
+    virtual bool send( uint32_t, int, const char *, size_t ) = 0;
+    virtual int receive( ChannelMessage&, uint32_t *, int ) = 0;
+};
+
 /**
  * The Channel is a singleton for a service.  It is the
  * communication mechanism to the service.  The receive method
- * accepts requests from a client and populates a buffer with
+ * accepts requests from a client and populates a message with
  * the request.  The return value is the id of the client.
- * The response is sent to this id.
+ * The response is sent to this id, with the id of the request.
+ *
+ * The transport is chosen by the service: a SysV message queue, rings
+ * in a shared memory segment, or a unix domain socket in its rundir.
+ * Clients use the shared memory segment when the service has one, then
+ * the socket, then the message queue.
  */
 class Channel {
 private:
     Service *service;
-    long id;
-    int q;
+    ChannelTransport *transport;
 public:
-    Channel( Service * );
-    void send( long, int, char * );
-    long receive( char *, int );
+    enum Kind { msgq, shm, seqpacket };
+    Channel( Service *, Kind = msgq );
+    void send( long, uint32_t, int, const char *, size_t );
+    long receive( ChannelMessage&, uint32_t *, int * );
+    bool alive( long );
 };
 
 /**
@@ -58,17 +143,42 @@ public:
  * we are connecting.  All requests sent from this object go
  * to this service.  The receive method is passed a buffer to
  * populate with the response, and return an int error value.
- * 0 means no error.
+ * 0 means no error.  A time limit is in seconds for receive() and in
+ * milliseconds for receive_within().  A response too long for the
+ * buffer is cut short; receive it into a ChannelMessage to get all of it.
+ *
+ * Any number of requests may be outstanding.  submit() returns the id
+ * of a request, wait() takes the response to one request, and
+ * receive_any() the next response to any of them.  Responses that
+ * arrive while waiting for another are held until asked for.  send()
+ * and receive() work on the oldest outstanding request.  A request
+ * whose wait times out is abandoned, and its response is dropped if it
+ * arrives later.
  */
 class ChannelClient {
 private:
-    int q;
+    struct Pending;
+    ChannelClientTransport *transport;
     char service[80];
+    uint32_t next_id;
+    Pending *pending;
+    Pending *find( uint32_t );
+    void forget( Pending * );
+    void complete( uint32_t, int, ChannelMessage& );
+    int next_response( ChannelMessage&, uint32_t *, const struct timespec * );
 public:
     ChannelClient( char * );
+    ~ChannelClient();
     void send( char * );
     int receive( char *, int );
     int receive( char *, int, time_t );
+    int receive_within( char *, int, int );
+    int receive( ChannelMessage&, int = -1 );
+    uint32_t submit( const char *, int = REQUEST_SCRIPT );
+    uint32_t submit( const char *, size_t, int );
+    int wait( uint32_t, ChannelMessage&, int = -1 );
+    int receive_any( uint32_t *, ChannelMessage&, int = -1 );
+    int outstanding();
 };
 
 bool Channel_Initialize( Tcl_Interp * );
@@ -0,0 +1,246 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file ChannelFrame.cc
+ * \brief A typed binary encoding of Tcl values for the Channel
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <tcl.h>
+#include "ChannelFrame.h"
+
+namespace {
+
+    /**
+     * Deeper frames are refused rather than risk the stack.
+     */
+    const int max_depth = 64;
+
+    const Tcl_ObjType *int_type;
+    const Tcl_ObjType *wide_type;
+    const Tcl_ObjType *double_type;
+    const Tcl_ObjType *bytes_type;
+    const Tcl_ObjType *list_type;
+    const Tcl_ObjType *dict_type;
+
+    /**
+     * The types are looked up the first time a value is encoded.  Two
+     * threads doing so at once write the same pointers.
+     */
+    void
+    find_types() {
+        if ( list_type != NULL )  return;
+        int_type = Tcl_GetObjType( "int" );
+        wide_type = Tcl_GetObjType( "wideInt" );
+        double_type = Tcl_GetObjType( "double" );
+        bytes_type = Tcl_GetObjType( "bytearray" );
+        dict_type = Tcl_GetObjType( "dict" );
+        list_type = Tcl_GetObjType( "list" );
+    }
+
+    void
+    put_tag( ChannelMessage& frame, char tag ) {
+        frame.append( &tag, 1 );
+    }
+
+    void
+    put_count( ChannelMessage& frame, char tag, uint32_t count ) {
+        put_tag( frame, tag );
+        frame.append( (const char *)&count, sizeof(count) );
+    }
+
+    void
+    encode( Tcl_Obj *value, ChannelMessage& frame, int depth ) {
+        const Tcl_ObjType *type = value->typePtr;
+
+        if ( type != NULL && (type == int_type || type == wide_type) ) {
+            Tcl_WideInt n;
+            if ( Tcl_GetWideIntFromObj(NULL, value, &n) == TCL_OK ) {
+                int64_t number = n;
+                put_tag( frame, 'i' );
+                frame.append( (const char *)&number, sizeof(number) );
+                return;
+            }
+        }
+
+        if ( type != NULL && type == double_type ) {
+            double number;
+            Tcl_GetDoubleFromObj( NULL, value, &number );
+            put_tag( frame, 'd' );
+            frame.append( (const char *)&number, sizeof(number) );
+            return;
+        }
+
+        if ( type != NULL && type == bytes_type ) {
+            int length;
+            unsigned char *bytes = Tcl_GetByteArrayFromObj( value, &length );
+            put_count( frame, 'b', length );
+            frame.append( (const char *)bytes, length );
+            return;
+        }
+
+        if ( type != NULL && type == dict_type && depth < max_depth ) {
+            int size;
+            Tcl_DictObjSize( NULL, value, &size );
+            put_count( frame, 'm', size );
+            Tcl_DictSearch search;
+            Tcl_Obj *key, *element;
+            int done;
+            Tcl_DictObjFirst( NULL, value, &search, &key, &element, &done );
+            for ( ; done == 0 ; Tcl_DictObjNext(&search, &key, &element, &done) ) {
+                encode( key, frame, depth + 1 );
+                encode( element, frame, depth + 1 );
+            }
+            Tcl_DictObjDone( &search );
+            return;
+        }
+
+        if ( type != NULL && type == list_type && depth < max_depth ) {
+            int count;
+            Tcl_Obj **elements;
+            Tcl_ListObjGetElements( NULL, value, &count, &elements );
+            put_count( frame, 'l', count );
+            for ( int i = 0 ; i < count ; i++ ) {
+                encode( elements[i], frame, depth + 1 );
+            }
+            return;
+        }
+
+        int length;
+        const char *string = Tcl_GetStringFromObj( value, &length );
+        put_count( frame, 's', length );
+        frame.append( string, length );
+    }
+
+    /**
+     * value() reads the next value in the frame.  It returns NULL if
+     * the frame ends too soon or is not well formed.  Values are
+     * returned with no references held, so a failed one is freed with
+     * a single Tcl_DecrRefCount().
+     */
+    class Decoder {
+        const char *cursor;
+        const char *end;
+        bool take( void *, size_t );
+    public:
+        Decoder( const char *frame, size_t length ) : cursor(frame), end(frame + length) {}
+        Tcl_Obj *value( int );
+        bool finished() const { return cursor == end; }
+    };
+
+    bool
+    Decoder::take( void *into, size_t length ) {
+        if ( (size_t)(end - cursor) < length )  return false;
+        memcpy( into, cursor, length );
+        cursor += length;
+        return true;
+    }
+
+    Tcl_Obj *
+    Decoder::value( int depth ) {
+        char tag;
+        if ( depth > max_depth || take(&tag, 1) == false )  return NULL;
+
+        switch ( tag ) {
+        case 'i': {
+            int64_t number;
+            if ( take(&number, sizeof(number)) == false )  return NULL;
+            return Tcl_NewWideIntObj( number );
+        }
+        case 'd': {
+            double number;
+            if ( take(&number, sizeof(number)) == false )  return NULL;
+            return Tcl_NewDoubleObj( number );
+        }
+        case 'b':
+        case 's': {
+            uint32_t length;
+            if ( take(&length, sizeof(length)) == false )  return NULL;
+            if ( (size_t)(end - cursor) < length )  return NULL;
+            const char *bytes = cursor;
+            cursor += length;
+            if ( tag == 'b' )  return Tcl_NewByteArrayObj( (const unsigned char *)bytes, length );
+            return Tcl_NewStringObj( bytes, length );
+        }
+        case 'l':
+        case 'm': {
+            uint32_t count;
+            if ( take(&count, sizeof(count)) == false )  return NULL;
+            Tcl_Obj *result = (tag == 'l') ? Tcl_NewListObj(0, NULL) : Tcl_NewDictObj();
+            for ( uint32_t i = 0 ; i < count ; i++ ) {
+                Tcl_Obj *element = value( depth + 1 );
+                if ( element == NULL ) {
+                    Tcl_DecrRefCount( result );
+                    return NULL;
+                }
+                if ( tag == 'l' ) {
+                    Tcl_ListObjAppendElement( NULL, result, element );
+                    continue;
+                }
+                Tcl_IncrRefCount( element );
+                Tcl_Obj *entry = value( depth + 1 );
+                if ( entry == NULL ) {
+                    Tcl_DecrRefCount( element );
+                    Tcl_DecrRefCount( result );
+                    return NULL;
+                }
+                Tcl_DictObjPut( NULL, result, element, entry );
+                Tcl_DecrRefCount( element );
+            }
+            return result;
+        }
+        }
+        return NULL;
+    }
+
+}
+
+/**
+ * Append the frame for a value.
+ */
+void
+frame_encode( Tcl_Obj *value, ChannelMessage& frame ) {
+    find_types();
+    encode( value, frame, 0 );
+}
+
+/**
+ * Returns the value in a frame with no references held, or NULL with
+ * an error left in the interpreter.
+ */
+Tcl_Obj *
+frame_decode( Tcl_Interp *interp, const char *frame, size_t length ) {
+    Decoder decoder( frame, length );
+    Tcl_Obj *result = decoder.value( 0 );
+    if ( result != NULL && decoder.finished() )  return result;
+
+    if ( result != NULL )  Tcl_DecrRefCount( result );
+    if ( interp != NULL ) {
+        Tcl_SetObjResult( interp, Tcl_NewStringObj("malformed channel frame", -1) );
+    }
+    return NULL;
+}
+
+/* vim: set autoindent expandtab sw=4 : */
@@ -0,0 +1,53 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file ChannelFrame.h
+ * \brief A typed binary encoding of Tcl values for the Channel
+ *
+ * A frame is one value: a tag byte followed by the value.
+ *
+ *   'i'  a 64 bit integer
+ *   'd'  a double
+ *   'b'  a 32 bit length and that many bytes of a byte array
+ *   's'  a 32 bit length and that many bytes of UTF-8
+ *   'l'  a 32 bit count and that many values
+ *   'm'  a 32 bit count and that many pairs of key and value
+ *
+ * Numbers are in the host's byte order, since both ends of a channel
+ * are on the same host.  A value is encoded by its Tcl type, so an
+ * integer or a byte array crosses as it is, without being formatted
+ * and parsed again.  Anything else is sent as its string.
+ */
+
+#ifndef _CHANNEL_FRAME_H_
+#define _CHANNEL_FRAME_H_
+
+#include <tcl.h>
+#include "Channel.h"
+
+void frame_encode( Tcl_Obj *, ChannelMessage& );
+Tcl_Obj *frame_decode( Tcl_Interp *, const char *, size_t );
+
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
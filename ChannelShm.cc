@@ -0,0 +1,534 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file ChannelShm.cc
+ * \brief Channel transport over a shared memory segment
+ *
+ * The service creates /dev/shm/service.<name>, which holds a fixed
+ * number of client slots.  A client claims a slot and owns its pair of
+ * rings: requests from the client to the service, and responses back.
+ * Each ring has a single producer and a single consumer, so a message
+ * is copied once into the segment and once out of it, with no system
+ * call unless the other side is asleep on a futex.
+ *
+ * A slot whose owner has died may be claimed by another client.  Each
+ * claim bumps the slot's generation, and messages are stamped with the
+ * generation they were sent under, so neither end acts on a message
+ * meant for an earlier owner.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <new>
+
+#include "Futex.h"
+#include "Liveness.h"
+#include "ChannelShm.h"
+
+namespace {
+
+    const uint32_t segment_magic = 0x334e4843;
+    const int slot_count = 64;
+    const int ring_depth = 4;
+    const int cell_body = 4076;
+
+    /**
+     * A request or response longer than one cell is split over several,
+     * each but the last marked with more.
+     */
+    struct Cell {
+        uint32_t generation;
+        uint32_t id;
+        int32_t error;
+        uint32_t length;
+        uint32_t more;
+        char body[cell_body];
+    };
+
+    /**
+     * One direction of a slot.  The producer fills back() and then
+     * push()es it, the consumer reads front() and then pop()s it.
+     */
+    struct ShmRing {
+        uint32_t head;
+        char pad0[60];
+        uint32_t tail;
+        char pad1[60];
+        Waiters readable;
+        Waiters writable;
+        Cell cells[ring_depth];
+
+        ShmRing() : head(0), tail(0), readable(true), writable(true) {}
+
+        bool empty() {
+            return __atomic_load_n(&tail, __ATOMIC_ACQUIRE) == __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+        }
+        bool full() {
+            return __atomic_load_n(&tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&head, __ATOMIC_ACQUIRE) >= (uint32_t)ring_depth;
+        }
+        Cell *back() { return &cells[ tail % ring_depth ]; }
+        Cell *front() { return &cells[ head % ring_depth ]; }
+        void push() {
+            __atomic_store_n( &tail, tail + 1, __ATOMIC_RELEASE );
+        }
+        void pop() {
+            __atomic_store_n( &head, head + 1, __ATOMIC_RELEASE );
+            writable.wake();
+        }
+    };
+
+    struct Slot {
+        pid_t owner;
+        uint32_t generation;
+        ShmRing request;
+        ShmRing response;
+    };
+
+    struct Segment {
+        uint32_t magic;
+        pid_t server;
+        Waiters arrivals;
+        Slot slots[slot_count];
+
+        Segment() : magic(0), server(0), arrivals(true) {}
+    };
+
+    /**
+     * A process owned by another user is still alive.
+     */
+    bool
+    process_alive( pid_t pid ) {
+        if ( pid <= 0 )  return false;
+        return (::kill(pid, 0) == 0) || (errno == EPERM);
+    }
+
+    void
+    segment_path( char *path, size_t length, const char *service_name ) {
+        snprintf( path, length, "/dev/shm/service.%s", service_name );
+    }
+
+    /**
+     * Fill a cell with as much of the message as fits, and return how
+     * many bytes that was.
+     */
+    size_t
+    fill( Cell *cell, uint32_t generation, uint32_t id, int error, const char *message, size_t length ) {
+        cell->more = 0;
+        if ( length >= sizeof(cell->body) ) {
+            length = sizeof(cell->body) - 1;
+            cell->more = 1;
+        }
+        cell->generation = generation;
+        cell->id = id;
+        cell->error = error;
+        cell->length = length;
+        memcpy( cell->body, message, length );
+        cell->body[length] = '\0';
+        return length;
+    }
+
+}
+
+/**
+ * A sender is the slot index in the low 16 bits and the slot's
+ * generation above them.
+ *
+ * Service workers send from several threads, so each response ring has
+ * a lock to keep it single producer.  The cells of a request are
+ * gathered in the slot's partial message, which is started afresh when
+ * a cell of another generation turns up.
+ */
+class ShmTransport : public ChannelTransport {
+    Segment *segment;
+    int next;
+    pthread_mutex_t locks[slot_count];
+    ChannelMessage partial[slot_count];
+    uint32_t assembling[slot_count];
+    Liveness *clients;
+    bool pending();
+public:
+    ShmTransport( Segment * );
+    virtual ~ShmTransport() {}
+    virtual long receive( ChannelMessage&, uint32_t *, int * );
+    virtual void send( long, uint32_t, int, const char *, size_t );
+    virtual bool alive( long );
+};
+
+/**
+ * When a client exits its slot is freed straight away rather than
+ * when the next client looks for one, and any worker waiting for room
+ * in its response ring gives up.
+ */
+class ShmReaper : public LivenessReaper {
+    Segment *segment;
+public:
+    ShmReaper( Segment *segment ) : segment(segment) {}
+    virtual ~ShmReaper() {}
+    virtual void operator () ( pid_t pid ) {
+        for ( int i = 0 ; i < slot_count ; i++ ) {
+            Slot& slot = segment->slots[i];
+            pid_t owner = pid;
+            if ( __atomic_compare_exchange_n(&slot.owner, &owner, 0, false,
+                                             __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) == false )  continue;
+            __atomic_add_fetch( &slot.generation, 1, __ATOMIC_ACQ_REL );
+            slot.response.writable.wake();
+        }
+    }
+};
+
+/**
+ */
+ShmTransport::ShmTransport( Segment *segment ) : segment(segment), next(0) {
+    for ( int i = 0 ; i < slot_count ; i++ ) {
+        pthread_mutex_init( &locks[i], NULL );
+        assembling[i] = 0;
+    }
+    clients = new Liveness( "liveness", new ShmReaper(segment) );
+    clients->start();
+}
+
+/**
+ */
+bool
+ShmTransport::pending() {
+    for ( int index = 0 ; index < slot_count ; index++ ) {
+        if ( segment->slots[index].request.empty() == false )  return true;
+    }
+    return false;
+}
+
+/**
+ * Slots are visited round robin from the one after the last request, so
+ * a busy client cannot starve the others.  A request may take several
+ * cells, and is only returned once its last cell has been read.
+ */
+long
+ShmTransport::receive( ChannelMessage& message, uint32_t *id, int *kind ) {
+    for (;;) {
+        for ( int i = 0 ; i < slot_count ; i++ ) {
+            int index = (next + i) % slot_count;
+            Slot& slot = segment->slots[index];
+            ShmRing& ring = slot.request;
+            ChannelMessage& request = partial[index];
+
+            while ( ring.empty() == false ) {
+                Cell *cell = ring.front();
+                uint32_t generation = cell->generation;
+                bool more = cell->more != 0;
+                if ( generation != assembling[index] ) {
+                    request.clear();
+                    assembling[index] = generation;
+                }
+                request.append( cell->body, cell->length );
+                *id = cell->id;
+                *kind = cell->error;
+                ring.pop();
+                if ( more )  continue;
+
+                if ( generation != __atomic_load_n(&slot.generation, __ATOMIC_ACQUIRE) ) {
+                    request.clear();
+                    continue;
+                }
+                message.swap( request );
+                request.clear();
+                next = index + 1;
+                return ((long)generation << 16) | index;
+            }
+        }
+        segment->arrivals.block( this, &ShmTransport::pending, true );
+    }
+}
+
+/**
+ * If the client stops reading, this waits a second at a time for room
+ * and gives up once the client is gone.  A long response is written a
+ * cell at a time as the client drains the ring.
+ */
+void
+ShmTransport::send( long dst, uint32_t id, int result, const char *message, size_t length ) {
+    int index = dst & 0xffff;
+    if ( index >= slot_count )  return;
+
+    ShmRing& ring = segment->slots[index].response;
+    size_t offset = 0;
+    pthread_mutex_lock( &locks[index] );
+    do {
+        while ( ring.full() ) {
+            if ( alive(dst) == false ) {
+                pthread_mutex_unlock( &locks[index] );
+                return;
+            }
+            ring.writable.block( &ring, &ShmRing::full, false, 1000 );
+        }
+        offset += fill( ring.back(), dst >> 16, id, result, message + offset, length - offset );
+        ring.push();
+        ring.readable.wake();
+    } while ( offset < length );
+    pthread_mutex_unlock( &locks[index] );
+}
+
+/**
+ */
+bool
+ShmTransport::alive( long sender ) {
+    int index = sender & 0xffff;
+    if ( index >= slot_count )  return false;
+    Slot& slot = segment->slots[index];
+    if ( __atomic_load_n(&slot.generation, __ATOMIC_ACQUIRE) != (uint32_t)(sender >> 16) )  return false;
+    return clients->alive( __atomic_load_n(&slot.owner, __ATOMIC_ACQUIRE) );
+}
+
+/**
+ */
+ChannelTransport *
+shm_channel( const char *service_name ) {
+    char path[128];
+    segment_path( path, sizeof(path), service_name );
+    unlink( path );
+
+    int fd = open( path, O_RDWR | O_CREAT | O_EXCL, 0600 );
+    if ( fd < 0 ) {
+        syslog( LOG_ERR, "could not create '%s': %s", path, strerror(errno) );
+        return NULL;
+    }
+    if ( ftruncate(fd, sizeof(Segment)) < 0 ) {
+        syslog( LOG_ERR, "could not size '%s': %s", path, strerror(errno) );
+        close( fd );
+        unlink( path );
+        return NULL;
+    }
+    void *map = mmap( 0, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if ( map == MAP_FAILED ) {
+        syslog( LOG_ERR, "could not map '%s': %s", path, strerror(errno) );
+        unlink( path );
+        return NULL;
+    }
+
+    Segment *segment = new (map) Segment;
+    segment->server = getpid();
+    __atomic_store_n( &segment->magic, segment_magic, __ATOMIC_RELEASE );
+
+    syslog( LOG_NOTICE, "channel segment '%s'", path );
+    return new ShmTransport( segment );
+}
+
+/**
+ * The client end holds one slot for the life of the object.  A child
+ * made by fork() claims a slot of its own the first time it sends, and
+ * if the service restarts the client attaches to the new segment.
+ */
+class ShmClientTransport : public ChannelClientTransport {
+    char service[80];
+    Segment *segment;
+    pid_t pid;
+    int index;
+    uint32_t generation;
+    ChannelMessage partial;
+    size_t sent;
+
+    bool claim();
+    void detach();
+
+public:
+    ShmClientTransport( const char *service_name ) : segment(NULL), pid(0), index(-1), generation(0), sent(0) {
+        snprintf( service, sizeof(service), "%s", service_name );
+    }
+    virtual ~ShmClientTransport() { detach(); }
+    bool attach();
+    virtual bool send( uint32_t, int, const char *, size_t );
+    virtual int receive( ChannelMessage&, uint32_t *, int );
+};
+
+/**
+ */
+bool
+ShmClientTransport::attach() {
+    char path[128];
+    segment_path( path, sizeof(path), service );
+
+    int fd = open( path, O_RDWR );
+    if ( fd < 0 )  return false;
+
+    struct stat s;
+    if ( fstat(fd, &s) < 0 || s.st_size != (off_t)sizeof(Segment) ) {
+        close( fd );
+        return false;
+    }
+    void *map = mmap( 0, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if ( map == MAP_FAILED )  return false;
+
+    segment = (Segment *)map;
+    if ( __atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != segment_magic ||
+         process_alive(segment->server) == false || claim() == false ) {
+        munmap( map, sizeof(Segment) );
+        segment = NULL;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Take a free slot, or one whose owner has died.
+ */
+bool
+ShmClientTransport::claim() {
+    pid = getpid();
+    for ( int i = 0 ; i < slot_count ; i++ ) {
+        Slot& slot = segment->slots[i];
+        pid_t owner = __atomic_load_n( &slot.owner, __ATOMIC_ACQUIRE );
+        if ( owner != 0 && process_alive(owner) )  continue;
+        if ( __atomic_compare_exchange_n(&slot.owner, &owner, pid, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) == false )  continue;
+        generation = __atomic_add_fetch( &slot.generation, 1, __ATOMIC_ACQ_REL );
+        index = i;
+        partial.clear();
+        sent = 0;
+        return true;
+    }
+    syslog( LOG_ERR, "no free channel slot for '%s'", service );
+    index = -1;
+    return false;
+}
+
+/**
+ */
+void
+ShmClientTransport::detach() {
+    if ( segment == NULL )  return;
+    if ( index >= 0 && pid == getpid() ) {
+        pid_t owner = pid;
+        __atomic_compare_exchange_n( &segment->slots[index].owner, &owner, 0, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED );
+    }
+    munmap( segment, sizeof(Segment) );
+    segment = NULL;
+    index = -1;
+}
+
+/**
+ * While the request ring is full, give the caller the chance to drain
+ * the response ring as soon as it has anything in it, or after a few
+ * milliseconds anyway.  A long request is written a cell at a time, and
+ * how much of it has gone is kept so that the caller's next try carries
+ * on where this one stopped.
+ */
+bool
+ShmClientTransport::send( uint32_t id, int kind, const char *message, size_t length ) {
+    if ( segment == NULL || process_alive(segment->server) == false ) {
+        detach();
+        if ( attach() == false ) {
+            syslog( LOG_ERR, "service '%s' is not running", service );
+            return true;
+        }
+    }
+    if ( pid != getpid() && claim() == false )  return true;
+
+    ShmRing& ring = segment->slots[index].request;
+    ShmRing& responses = segment->slots[index].response;
+    do {
+        for ( int waited = 0 ; ring.full() ; waited++ ) {
+            if ( process_alive(segment->server) == false ) {
+                sent = 0;
+                return true;
+            }
+            if ( responses.empty() == false || waited == 10 )  return false;
+            ring.writable.block( &ring, &ShmRing::full, false, 1 );
+        }
+        sent += fill( ring.back(), generation, id, kind, message + sent, length - sent );
+        ring.push();
+        segment->arrivals.wake();
+    } while ( sent < length );
+    sent = 0;
+    return true;
+}
+
+/**
+ * Wait up to milliseconds for a response, or for ever if negative,
+ * checking every second that the service is still running.  Cells left
+ * over from an earlier generation of this slot are skipped, and those
+ * read before a timeout are kept for the next call.
+ */
+int
+ShmClientTransport::receive( ChannelMessage& message, uint32_t *id, int milliseconds ) {
+    if ( segment == NULL || index < 0 )  return MESSAGE_EXCEPTION;
+    ShmRing& ring = segment->slots[index].response;
+
+    struct timespec start;
+    clock_gettime( CLOCK_MONOTONIC, &start );
+
+    for (;;) {
+        while ( ring.empty() ) {
+            if ( process_alive(segment->server) == false )  return MESSAGE_EXCEPTION;
+            int wait = 1000;
+            if ( milliseconds >= 0 ) {
+                struct timespec now;
+                clock_gettime( CLOCK_MONOTONIC, &now );
+                long elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+                long remaining = milliseconds - elapsed;
+                if ( remaining <= 0 )  return MESSAGE_EXCEPTION;
+                if ( remaining < wait )  wait = remaining;
+            }
+            if ( ring.readable.block(&ring, &ShmRing::empty, false, wait) )  break;
+        }
+
+        Cell *cell = ring.front();
+        uint32_t stamp = cell->generation;
+        uint32_t request = cell->id;
+        int error = cell->error;
+        bool more = cell->more != 0;
+        if ( stamp == generation )  partial.append( cell->body, cell->length );
+        ring.pop();
+        if ( stamp == generation && more == false ) {
+            message.swap( partial );
+            partial.clear();
+            *id = request;
+            return error;
+        }
+    }
+}
+
+/**
+ */
+ChannelClientTransport *
+shm_client( const char *service_name ) {
+    ShmClientTransport *transport = new ShmClientTransport( service_name );
+    if ( transport->attach() )  return transport;
+    delete transport;
+    return NULL;
+}
+
+/* vim: set autoindent expandtab sw=4 : */
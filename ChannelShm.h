@@ -0,0 +1,51 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file ChannelShm.h
+ * \brief Channel transport over a shared memory segment
+ */
+
+#ifndef _CHANNEL_SHM_H_
+#define _CHANNEL_SHM_H_
+
+#include "Channel.h"
+
+/**
+ * Create the named service's segment, replacing any left by an earlier
+ * run.  Returns NULL if it cannot be created.
+ *
+ * Any process that can write the segment can inject requests or corrupt
+ * its slots, so it is created 0600: only processes running as the
+ * service's user can be clients.
+ */
+ChannelTransport *shm_channel( const char * );
+
+/**
+ * Attach to the named service's segment.  Returns NULL if the service
+ * has no segment or it is not running.
+ */
+ChannelClientTransport *shm_client( const char * );
+
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
@@ -0,0 +1,671 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file ChannelSocket.cc
+ * \brief Channel transport over a unix domain socket
+ *
+ * The service listens on a SOCK_SEQPACKET socket in its rundir and
+ * multiplexes every client connection through one epoll set.  The
+ * socket keeps message boundaries, so a message is a small header
+ * followed by the body.  The peer's credentials are read when a client
+ * connects, and a client that goes away is noticed as soon as its
+ * connection closes.
+ *
+ * A request is a single packet.  A response of any size is either sent
+ * in fragments, or for a large one written once to a sealed memfd that
+ * is passed to the client, which maps it instead of reading it through
+ * the socket.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "ChannelSocket.h"
+
+namespace {
+
+    const int socket_buffer = 4 * 1024 * 1024;
+    const size_t fragment = 60 * 1024;
+    const size_t handoff = 64 * 1024;
+
+    /**
+     * How long, in milliseconds, the service waits for a client to make
+     * room for each packet of a response before it gives up on the client.
+     */
+    const int response_patience = 250;
+
+    enum { more = 1, descriptor = 2 };
+
+    /**
+     * Every packet starts with this.  id is the client's id for the
+     * request, and length is the size of the body that follows, or of
+     * the payload behind a descriptor.
+     */
+    struct Header {
+        int32_t error;
+        uint32_t flags;
+        uint32_t id;
+        uint32_t reserved;
+        uint64_t length;
+    };
+
+    void
+    socket_path( struct sockaddr_un *address, const char *service_name ) {
+        memset( address, 0, sizeof(*address) );
+        address->sun_family = AF_UNIX;
+        snprintf( address->sun_path, sizeof(address->sun_path), "/var/run/%s/channel", service_name );
+    }
+
+    /**
+     * Ask for large socket buffers, so big messages fit in one packet.
+     * The kernel may clamp these.
+     */
+    void
+    size_buffers( int fd ) {
+        setsockopt( fd, SOL_SOCKET, SO_SNDBUF, &socket_buffer, sizeof(socket_buffer) );
+        setsockopt( fd, SOL_SOCKET, SO_RCVBUF, &socket_buffer, sizeof(socket_buffer) );
+    }
+
+    /**
+     * Send one packet, and a descriptor with it if passed is not -1.
+     * While the socket is full this waits for room until the peer hangs
+     * up, or for at most patience milliseconds if that is not negative,
+     * failing with EAGAIN.
+     */
+    bool
+    send_packet( int fd, Header *header, const char *body, int passed, int patience = -1 ) {
+        struct iovec parts[2];
+        parts[0].iov_base = header;
+        parts[0].iov_len = sizeof(*header);
+        parts[1].iov_base = (void *)body;
+        parts[1].iov_len = (body == NULL) ? 0 : header->length;
+
+        struct msghdr m;
+        memset( &m, 0, sizeof(m) );
+        m.msg_iov = parts;
+        m.msg_iovlen = 2;
+
+        char control[CMSG_SPACE(sizeof(int))];
+        if ( passed >= 0 ) {
+            memset( control, 0, sizeof(control) );
+            m.msg_control = control;
+            m.msg_controllen = sizeof(control);
+            struct cmsghdr *c = CMSG_FIRSTHDR( &m );
+            c->cmsg_level = SOL_SOCKET;
+            c->cmsg_type = SCM_RIGHTS;
+            c->cmsg_len = CMSG_LEN( sizeof(int) );
+            memcpy( CMSG_DATA(c), &passed, sizeof(int) );
+        }
+
+        for (;;) {
+            if ( sendmsg(fd, &m, MSG_NOSIGNAL | MSG_DONTWAIT) >= 0 )  return true;
+            if ( errno == EINTR )  continue;
+            if ( errno != EAGAIN )  return false;
+
+            struct pollfd p;
+            p.fd = fd;
+            p.events = POLLOUT;
+            p.revents = 0;
+            int count = poll( &p, 1, (patience < 0) ? 1000 : patience );
+            if ( count < 0 && errno != EINTR )  return false;
+            if ( p.revents & (POLLHUP | POLLERR) )  return false;
+            if ( count == 0 && patience >= 0 ) {
+                errno = EAGAIN;
+                return false;
+            }
+        }
+    }
+
+    /**
+     * Copy a payload into a sealed memfd, nul terminated.  Returns -1 if
+     * that cannot be done.
+     */
+    int
+    payload_descriptor( const char *message, size_t length ) {
+        int fd = memfd_create( "channel", MFD_CLOEXEC | MFD_ALLOW_SEALING );
+        if ( fd < 0 )  return -1;
+
+        size_t offset = 0;
+        while ( offset < length ) {
+            ssize_t bytes = write( fd, message + offset, length - offset );
+            if ( bytes < 0 && errno == EINTR )  continue;
+            if ( bytes <= 0 ) {
+                close( fd );
+                return -1;
+            }
+            offset += bytes;
+        }
+        if ( write(fd, "", 1) != 1 ) {
+            close( fd );
+            return -1;
+        }
+        fcntl( fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL );
+        return fd;
+    }
+
+    /**
+     * Send a response.  A large one is handed over as a descriptor;
+     * anything else, or a large one when no memfd can be made, goes as
+     * fragments.  Each packet waits at most response_patience for room.
+     */
+    bool
+    send_response( int fd, uint32_t id, int error, const char *message, size_t length ) {
+        Header header;
+        header.error = error;
+        header.id = id;
+        header.reserved = 0;
+
+        if ( length >= handoff ) {
+            int payload = payload_descriptor( message, length );
+            if ( payload >= 0 ) {
+                header.flags = descriptor;
+                header.length = length;
+                bool sent = send_packet( fd, &header, NULL, payload, response_patience );
+                close( payload );
+                return sent;
+            }
+        }
+
+        size_t offset = 0;
+        do {
+            size_t bytes = length - offset;
+            header.flags = 0;
+            if ( bytes > fragment ) {
+                bytes = fragment;
+                header.flags = more;
+            }
+            header.length = bytes;
+            if ( send_packet(fd, &header, message + offset, -1, response_patience) == false )  return false;
+            offset += bytes;
+        } while ( offset < length );
+        return true;
+    }
+
+    /**
+     * A request carries its kind where a response carries its result.
+     */
+    bool
+    send_request( int fd, uint32_t id, int kind, const char *message, size_t length, int patience ) {
+        Header header;
+        header.error = kind;
+        header.flags = 0;
+        header.id = id;
+        header.reserved = 0;
+        header.length = length;
+        return send_packet( fd, &header, message, -1, patience );
+    }
+
+    /**
+     * Read one packet, its body into buffer and any descriptor passed
+     * with it into *passed.  Returns the size of the packet, which may be
+     * more than was kept, or -1 with errno set, or 0 when the peer has
+     * closed the connection.
+     */
+    ssize_t
+    receive_packet( int fd, Header *header, char *buffer, size_t length, int *passed, int flags ) {
+        struct iovec parts[2];
+        parts[0].iov_base = header;
+        parts[0].iov_len = sizeof(*header);
+        parts[1].iov_base = buffer;
+        parts[1].iov_len = length;
+
+        char control[CMSG_SPACE(sizeof(int))];
+        struct msghdr m;
+        memset( &m, 0, sizeof(m) );
+        m.msg_iov = parts;
+        m.msg_iovlen = 2;
+        m.msg_control = control;
+        m.msg_controllen = sizeof(control);
+
+        *passed = -1;
+        ssize_t bytes = recvmsg( fd, &m, flags | MSG_TRUNC | MSG_CMSG_CLOEXEC );
+        if ( bytes <= 0 )  return bytes;
+
+        for ( struct cmsghdr *c = CMSG_FIRSTHDR(&m) ; c != NULL ; c = CMSG_NXTHDR(&m, c) ) {
+            if ( c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS ) {
+                memcpy( passed, CMSG_DATA(c), sizeof(int) );
+            }
+        }
+        if ( bytes < (ssize_t)sizeof(*header) ) {
+            if ( *passed >= 0 )  close( *passed );
+            *passed = -1;
+            errno = EPROTO;
+            return -1;
+        }
+        return bytes;
+    }
+
+    /**
+     * Read a request into message, which is sized from the packet.
+     * Returns as receive_packet() does.  If no room can be made for the
+     * request it is taken off the socket and dropped, and -1 is returned
+     * with errno set to EMSGSIZE and *id and *kind describing it, so the
+     * caller can refuse it rather than run part of it.
+     */
+    ssize_t
+    receive_request( int fd, ChannelMessage& message, uint32_t *id, int *kind, int flags ) {
+        Header header;
+        int passed;
+        ssize_t bytes = recv( fd, &header, sizeof(header), flags | MSG_PEEK | MSG_TRUNC );
+        if ( bytes <= 0 )  return bytes;
+        size_t body = (bytes > (ssize_t)sizeof(header)) ? bytes - sizeof(header) : 0;
+
+        message.clear();
+        char *buffer = message.extend( body );
+        bytes = receive_packet( fd, &header, buffer, (buffer == NULL) ? 0 : body, &passed, flags );
+        if ( passed >= 0 )  close( passed );
+        if ( bytes <= 0 )  return bytes;
+
+        *id = header.id;
+        *kind = header.error;
+        if ( buffer == NULL ) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        return bytes;
+    }
+
+}
+
+/**
+ * Connections are kept in a table indexed by file descriptor.  A sender
+ * is the descriptor in the low 32 bits and the connection's generation
+ * above them, so a late response cannot go to a new client that has
+ * been given the same descriptor.
+ *
+ * receive() runs on the service thread; send() and alive() may be called
+ * from the workers, so each connection has a lock that covers closing it.
+ */
+class SocketTransport : public ChannelTransport {
+    static const int max_connections = 4096;
+    static const int batch = 64;
+
+    struct Connection {
+        pthread_mutex_t lock;
+        uint32_t generation;
+        bool open;
+        pid_t pid;
+        uid_t uid;
+    };
+
+    int listener;
+    int poller;
+    struct epoll_event events[batch];
+    int ready, cursor;
+    Connection connections[max_connections];
+
+    void accept_clients();
+    void close_connection( int );
+public:
+    SocketTransport( int );
+    virtual ~SocketTransport() {}
+    virtual long receive( ChannelMessage&, uint32_t *, int * );
+    virtual void send( long, uint32_t, int, const char *, size_t );
+    virtual bool alive( long );
+};
+
+/**
+ */
+SocketTransport::SocketTransport( int listener )
+: listener(listener), ready(0), cursor(0) {
+    for ( int fd = 0 ; fd < max_connections ; fd++ ) {
+        pthread_mutex_init( &connections[fd].lock, NULL );
+        connections[fd].generation = 0;
+        connections[fd].open = false;
+    }
+
+    poller = epoll_create1( EPOLL_CLOEXEC );
+    struct epoll_event event;
+    memset( &event, 0, sizeof(event) );
+    event.events = EPOLLIN;
+    event.data.fd = listener;
+    epoll_ctl( poller, EPOLL_CTL_ADD, listener, &event );
+}
+
+/**
+ */
+void
+SocketTransport::accept_clients() {
+    for (;;) {
+        int fd = accept4( listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK );
+        if ( fd < 0 )  return;
+        if ( fd >= max_connections ) {
+            syslog( LOG_ERR, "too many channel connections" );
+            close( fd );
+            continue;
+        }
+
+        struct ucred peer;
+        socklen_t length = sizeof(peer);
+        memset( &peer, 0, sizeof(peer) );
+        getsockopt( fd, SOL_SOCKET, SO_PEERCRED, &peer, &length );
+        size_buffers( fd );
+
+        Connection& c = connections[fd];
+        pthread_mutex_lock( &c.lock );
+        c.generation++;
+        c.open = true;
+        c.pid = peer.pid;
+        c.uid = peer.uid;
+        pthread_mutex_unlock( &c.lock );
+
+        struct epoll_event event;
+        memset( &event, 0, sizeof(event) );
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = fd;
+        epoll_ctl( poller, EPOLL_CTL_ADD, fd, &event );
+    }
+}
+
+/**
+ */
+void
+SocketTransport::close_connection( int fd ) {
+    Connection& c = connections[fd];
+    pthread_mutex_lock( &c.lock );
+    if ( c.open ) {
+        epoll_ctl( poller, EPOLL_CTL_DEL, fd, NULL );
+        close( fd );
+        c.open = false;
+        c.generation++;
+    }
+    pthread_mutex_unlock( &c.lock );
+}
+
+/**
+ * Hand out the events from one epoll_wait() before waiting again.  A
+ * connection with data waiting stays ready, so each ready connection
+ * gives up one message per round and none can starve the rest.  A
+ * request there is no memory for fails at once with an error result, as
+ * a script that raised an error would.
+ */
+long
+SocketTransport::receive( ChannelMessage& message, uint32_t *id, int *kind ) {
+    for (;;) {
+        while ( cursor < ready ) {
+            struct epoll_event& event = events[cursor++];
+            int fd = event.data.fd;
+            if ( fd == listener ) {
+                accept_clients();
+                continue;
+            }
+            if ( connections[fd].open == false )  continue;
+
+            ssize_t bytes = receive_request( fd, message, id, kind, MSG_DONTWAIT );
+            long sender = ((long)connections[fd].generation << 32) | fd;
+            if ( bytes > 0 )  return sender;
+            if ( bytes < 0 && errno == EMSGSIZE ) {
+                syslog( LOG_WARNING, "no room for a request from pid %d, refused", connections[fd].pid );
+                static const char refusal[] = "request too long";
+                send( sender, *id, MESSAGE_ERROR, refusal, sizeof(refusal) - 1 );
+                continue;
+            }
+            if ( bytes < 0 && (errno == EAGAIN || errno == EINTR) )  continue;
+            close_connection( fd );
+        }
+
+        cursor = 0;
+        ready = epoll_wait( poller, events, batch, -1 );
+        if ( ready < 0 ) {
+            if ( errno != EINTR )  syslog( LOG_ERR, "channel epoll_wait failed: %s", strerror(errno) );
+            ready = 0;
+        }
+    }
+}
+
+/**
+ * A client that leaves a response unread for longer than
+ * response_patience, or whose socket has failed, is cut off, so that it
+ * cannot hold up the thread sending to it.  The connection is only shut
+ * down here; the service thread sees the hangup and closes it.
+ */
+void
+SocketTransport::send( long dst, uint32_t id, int result, const char *message, size_t length ) {
+    int fd = dst & 0xffffffff;
+    if ( fd < 0 || fd >= max_connections )  return;
+
+    Connection& c = connections[fd];
+    pthread_mutex_lock( &c.lock );
+    if ( c.open && c.generation == (uint32_t)(dst >> 32) ) {
+        if ( send_response(fd, id, result, message, length) == false ) {
+            if ( errno == EAGAIN ) {
+                syslog( LOG_WARNING, "pid %d is not reading its responses, dropping it", c.pid );
+            } else {
+                syslog( LOG_ERR, "failed to send to pid %d: %s", c.pid, strerror(errno) );
+            }
+            shutdown( fd, SHUT_RDWR );
+        }
+    }
+    pthread_mutex_unlock( &c.lock );
+}
+
+/**
+ * A client is alive for as long as its connection is open.  The service
+ * thread may not have seen a hangup yet, so ask the socket as well.
+ */
+bool
+SocketTransport::alive( long sender ) {
+    int fd = sender & 0xffffffff;
+    if ( fd < 0 || fd >= max_connections )  return false;
+
+    Connection& c = connections[fd];
+    pthread_mutex_lock( &c.lock );
+    bool result = c.open && c.generation == (uint32_t)(sender >> 32);
+    if ( result ) {
+        struct pollfd p;
+        p.fd = fd;
+        p.events = POLLRDHUP;
+        p.revents = 0;
+        if ( poll(&p, 1, 0) > 0 && (p.revents & (POLLRDHUP | POLLHUP | POLLERR)) )  result = false;
+    }
+    pthread_mutex_unlock( &c.lock );
+    return result;
+}
+
+/**
+ */
+ChannelTransport *
+socket_channel( const char *service_name ) {
+    struct sockaddr_un address;
+    socket_path( &address, service_name );
+    unlink( address.sun_path );
+
+    int fd = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0 );
+    if ( fd < 0 ) {
+        syslog( LOG_ERR, "could not create channel socket: %s", strerror(errno) );
+        return NULL;
+    }
+    if ( bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, 128) < 0 ) {
+        syslog( LOG_ERR, "could not listen on '%s': %s", address.sun_path, strerror(errno) );
+        close( fd );
+        return NULL;
+    }
+    chmod( address.sun_path, 0777 );
+
+    syslog( LOG_NOTICE, "channel socket '%s'", address.sun_path );
+    return new SocketTransport( fd );
+}
+
+/**
+ * A child made by fork() shares the parent's connection, so it makes
+ * its own the first time it sends.  If the service has restarted the
+ * client reconnects and sends again.
+ */
+class SocketClientTransport : public ChannelClientTransport {
+    char service[80];
+    int fd;
+    pid_t pid;
+    char *scratch;
+    ChannelMessage partial;
+    bool map_payload( ChannelMessage&, int, size_t );
+public:
+    SocketClientTransport( const char *service_name ) : fd(-1), pid(0), scratch(NULL) {
+        snprintf( service, sizeof(service), "%s", service_name );
+    }
+    virtual ~SocketClientTransport() {
+        if ( fd >= 0 )  close( fd );
+        delete [] scratch;
+    }
+    bool connect();
+    virtual bool send( uint32_t, int, const char *, size_t );
+    virtual int receive( ChannelMessage&, uint32_t *, int );
+};
+
+/**
+ */
+bool
+SocketClientTransport::connect() {
+    if ( fd >= 0 )  close( fd );
+    pid = getpid();
+    partial.clear();
+
+    struct sockaddr_un address;
+    socket_path( &address, service );
+    fd = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0 );
+    if ( fd < 0 )  return false;
+    size_buffers( fd );
+    if ( ::connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ) {
+        close( fd );
+        fd = -1;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * If the socket stays full for a few milliseconds, give the caller the
+ * chance to read responses.
+ */
+bool
+SocketClientTransport::send( uint32_t id, int kind, const char *message, size_t length ) {
+    if ( pid != getpid() )  connect();
+    if ( fd >= 0 ) {
+        if ( send_request(fd, id, kind, message, length, 10) )  return true;
+        if ( errno == EAGAIN )  return false;
+    }
+
+    if ( connect() == false || send_request(fd, id, kind, message, length, 10) == false ) {
+        if ( errno == EAGAIN )  return false;
+        syslog( LOG_ERR, "failed to send to '%s': %s", service, strerror(errno) );
+    }
+    return true;
+}
+
+/**
+ * Map a payload handed over as a descriptor.  The service sealed it, so
+ * it cannot change under the mapping.
+ */
+bool
+SocketClientTransport::map_payload( ChannelMessage& message, int payload, size_t length ) {
+    struct stat s;
+    if ( fstat(payload, &s) < 0 || (size_t)s.st_size < length + 1 ) {
+        close( payload );
+        return false;
+    }
+    void *map = mmap( NULL, length + 1, PROT_READ, MAP_PRIVATE, payload, 0 );
+    close( payload );
+    if ( map == MAP_FAILED )  return false;
+    message.adopt( map, length + 1, length );
+    return true;
+}
+
+/**
+ */
+int
+SocketClientTransport::receive( ChannelMessage& message, uint32_t *id, int milliseconds ) {
+    if ( fd < 0 )  return MESSAGE_EXCEPTION;
+    if ( scratch == NULL )  scratch = new char[fragment];
+
+    struct timespec start;
+    clock_gettime( CLOCK_MONOTONIC, &start );
+
+    for (;;) {
+        int wait = milliseconds;
+        if ( milliseconds >= 0 ) {
+            struct timespec now;
+            clock_gettime( CLOCK_MONOTONIC, &now );
+            long elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+            wait = (elapsed < milliseconds) ? milliseconds - elapsed : 0;
+        }
+
+        struct pollfd p;
+        p.fd = fd;
+        p.events = POLLIN;
+        p.revents = 0;
+        int count = poll( &p, 1, wait );
+        if ( count < 0 && errno == EINTR )  continue;
+        if ( count == 0 )  return MESSAGE_EXCEPTION;
+
+        Header header;
+        int passed;
+        ssize_t bytes = receive_packet( fd, &header, scratch, fragment, &passed, 0 );
+        if ( bytes < 0 && errno == EINTR )  continue;
+        if ( bytes <= 0 )  return MESSAGE_EXCEPTION;
+
+        if ( header.flags & descriptor ) {
+            if ( passed < 0 || map_payload(message, passed, header.length) == false ) {
+                syslog( LOG_ERR, "could not map a response from '%s'", service );
+                return MESSAGE_EXCEPTION;
+            }
+            *id = header.id;
+            return header.error;
+        }
+        if ( passed >= 0 )  close( passed );
+
+        size_t body = bytes - sizeof(header);
+        if ( body > fragment )  body = fragment;
+        partial.append( scratch, body );
+        if ( header.flags & more )  continue;
+        message.swap( partial );
+        partial.clear();
+        *id = header.id;
+        return header.error;
+    }
+}
+
+/**
+ */
+ChannelClientTransport *
+socket_client( const char *service_name ) {
+    SocketClientTransport *transport = new SocketClientTransport( service_name );
+    if ( transport->connect() )  return transport;
+    delete transport;
+    return NULL;
+}
+
+/* vim: set autoindent expandtab sw=4 : */
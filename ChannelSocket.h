@@ -0,0 +1,47 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file ChannelSocket.h
+ * \brief Channel transport over a unix domain socket
+ */
+
+#ifndef _CHANNEL_SOCKET_H_
+#define _CHANNEL_SOCKET_H_
+
+#include "Channel.h"
+
+/**
+ * Listen on /var/run/<service>/channel.  Returns NULL if the socket
+ * cannot be created.
+ */
+ChannelTransport *socket_channel( const char * );
+
+/**
+ * Connect to the named service's socket.  Returns NULL if nothing is
+ * listening on it.
+ */
+ChannelClientTransport *socket_client( const char * );
+
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
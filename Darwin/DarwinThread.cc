@@ -28,6 +28,7 @@
 #include <stdio.h>
 
 #include "Thread.h"
+#include "PlatformThread.h"
 
 /**
  */
@@ -41,4 +42,25 @@ void
 set_thread_name( const char *newname ) {
 }
 
+/**
+ */
+bool
+set_thread_affinity( pthread_t thread, const uint64_t *mask ) {
+    return false;
+}
+
+/**
+ */
+bool
+get_thread_affinity( pthread_t thread, uint64_t *mask ) {
+    return false;
+}
+
+/**
+ */
+bool
+set_thread_memory_node( int node ) {
+    return node < 0;
+}
+
 /* vim: set autoindent expandtab sw=4 : */
@@ -2,152 +2,328 @@
 /** \file Fiber.cc
  * \brief C++ class implementing a fiber abstraction.
  *
- * This is a wrapper around a pthread library implementation that also
- * connects to a TCL library for debugging/configuration, etc.
+ * Each fiber has its own stack and context.  A fiber gives up the CPU
+ * by switching back to its scheduler's dispatcher context, which picks
+ * the next runnable fiber, and when none is runnable waits in
+ * epoll_wait() for a parked descriptor, the next sleeper's deadline or
+ * a fiber started from another thread.
  */
 
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <syslog.h>
 #include <pthread.h>
-#include <tcl.h>
-#include "TCL_Fixup.h"
 #include "Fiber.h"
 
-static void
-noop() {
-    // do nothing - yield ??
+namespace {
+
+    pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_key_t CurrentScheduler;
+
+    /**
+     * Every fiber and scheduler is on one of these lists, so they can
+     * be listed from Tcl.
+     */
+    pthread_mutex_t registry = PTHREAD_MUTEX_INITIALIZER;
+    Fiber *fibers;
+    Scheduler *schedulers;
+    uint64_t fiber_count;
+    int key_count;
+
+    /**
+     * Free stacks of each size, most recently used first.
+     */
+    struct StackClass {
+        size_t size;
+        FiberStack *free;
+        int mapped;
+        int cached;
+        size_t deepest;
+        uint64_t reused;
+        StackClass *next;
+    };
+    pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+    StackClass *stack_classes;
+
+    /**
+     * Fiber local storage for code not running on a fiber.
+     */
+    __thread void *thread_locals[Fiber::local_count];
+
+    void
+    create_key() {
+        pthread_key_create( &CurrentScheduler, NULL );
+    }
+
+    uint64_t
+    nanoseconds() {
+        struct timespec now;
+        clock_gettime( CLOCK_MONOTONIC, &now );
+        return (now.tv_sec * 1000000000ULL) + now.tv_nsec;
+    }
+
+    /**
+     * A fiber whose run() calls a plain function.
+     */
+    class CoroutineFiber : public Fiber {
+        coroutine f;
+    public:
+        CoroutineFiber( coroutine f ) : Fiber("coroutine"), f(f) {}
+        virtual ~CoroutineFiber() {}
+        virtual void run() { f(); }
+    };
+
+}
+
+#ifdef FIBER_STACK_SWITCH
+
+/*
+ * context_switch() saves the callee-saved registers on the current
+ * stack, stores the stack pointer in *from, loads to's and pops its
+ * registers.  Everything else is already saved by the caller under the
+ * C calling convention.  A new fiber's stack is made to look as if it
+ * had switched away at the start of context_trampoline, which calls
+ * the function kept in a callee-saved register with the fiber kept in
+ * another.
+ */
+extern "C" {
+    void context_switch( void **from, void *to ) __attribute__((visibility("hidden")));
+    void context_trampoline() __attribute__((visibility("hidden")));
 }
 
-/* I don't think I want this */
-class MainFiber : public Fiber {
-public:
-    MainFiber() : Fiber(noop) {
+#if defined(__x86_64__)
+
+/*
+ * The MXCSR and x87 control words are callee-saved too.  A new fiber
+ * starts with their default values, r12 holding the fiber and r13
+ * fiber_entry.
+ */
+__asm__ (
+    ".text\n"
+    ".globl context_switch\n"
+    ".hidden context_switch\n"
+    ".type context_switch, @function\n"
+    ".p2align 4\n"
+"context_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size context_switch, .-context_switch\n"
+    ".globl context_trampoline\n"
+    ".hidden context_trampoline\n"
+    ".type context_trampoline, @function\n"
+    ".p2align 4\n"
+"context_trampoline:\n"
+    "    movq %r12, %rdi\n"
+    "    callq *%r13\n"
+    "    ud2\n"
+    ".size context_trampoline, .-context_trampoline\n"
+);
+
+namespace {
+
+    enum { FRAME_WORDS = 8, FRAME_CONTROL = 0, FRAME_R13 = 3, FRAME_R12 = 4, FRAME_RETURN = 7 };
+
+    void
+    context_frame( uintptr_t *frame, Fiber *fiber ) {
+        frame[FRAME_CONTROL] = 0x1f80 | ((uintptr_t)0x037f << 32);
+        frame[FRAME_R12] = (uintptr_t)fiber;
+        frame[FRAME_R13] = (uintptr_t)fiber_entry;
+        frame[FRAME_RETURN] = (uintptr_t)context_trampoline;
     }
-    virtual ~MainFiber() {}
-    virtual void run() {}
-    virtual bool start() { return false; }
-};
 
-void
-finish_fiber() {
-    // get scheduler for this thread?
-    // get current context from scheduler
-    // call destructor
 }
 
-// namespace { Tcl_Interp *interpreter = NULL; }
-// Tcl_Interp *Fiber::global_interp() { return interpreter; }
+#elif defined(__aarch64__)
 
-int
-fiber_cmd( ClientData data, Tcl_Interp *interp,
-            int objc, Tcl_Obj * CONST *objv )
-{
-    Fiber *fiber = (Fiber *)data;
-    if ( objc < 2 ) {
-        Tcl_ResetResult( interp );
-        Tcl_WrongNumArgs( interp, 1, objv, "command ..." );
-        return TCL_ERROR;
-    }
-    char *command = Tcl_GetStringFromObj( objv[1], NULL );
-#if 0
-    if ( Tcl_StringMatch(command, "pid") ) {
-        Tcl_Obj *result = Tcl_NewIntObj( fiber->getpid() );
-        Tcl_SetObjResult( interp, result );
-        return TCL_OK;
+/*
+ * x19-x28, the frame pointer, the link register and d8-d15.  A new
+ * fiber starts with x19 holding the fiber, x20 fiber_entry and the
+ * link register pointing at the trampoline.
+ */
+__asm__ (
+    ".text\n"
+    ".globl context_switch\n"
+    ".hidden context_switch\n"
+    ".type context_switch, %function\n"
+    ".p2align 4\n"
+"context_switch:\n"
+    "    sub sp, sp, #160\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x2, sp\n"
+    "    str x2, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    ret\n"
+    ".size context_switch, .-context_switch\n"
+    ".globl context_trampoline\n"
+    ".hidden context_trampoline\n"
+    ".type context_trampoline, %function\n"
+    ".p2align 4\n"
+"context_trampoline:\n"
+    "    mov x0, x19\n"
+    "    blr x20\n"
+    "    brk #0\n"
+    ".size context_trampoline, .-context_trampoline\n"
+);
+
+namespace {
+
+    enum { FRAME_WORDS = 20, FRAME_X19 = 0, FRAME_X20 = 1, FRAME_X29 = 10, FRAME_X30 = 11 };
+
+    void
+    context_frame( uintptr_t *frame, Fiber *fiber ) {
+        frame[FRAME_X19] = (uintptr_t)fiber;
+        frame[FRAME_X20] = (uintptr_t)fiber_entry;
+        frame[FRAME_X29] = 0;
+        frame[FRAME_X30] = (uintptr_t)context_trampoline;
     }
+
+}
+
 #endif
-    if ( Tcl_StringMatch(command, "state") ) {
-        const char *s = "UNKNOWN";
-        switch ( fiber->state ) {
-            case Fiber::STOPPED:  s = "STOPPED";
-            case Fiber::RUNNABLE: s = "RUNNABLE";
-            case Fiber::RUNNING:  s = "RUNNING";
-            case Fiber::BLOCKED:  s = "BLOCKED";
-        }
-        Tcl_Obj *result = Tcl_NewStringObj( s, -1 );
-        Tcl_SetObjResult( interp, result );
-        return TCL_OK;
-    }
-    
-    Svc_SetResult( interp, "Unknown command for fiber object", TCL_STATIC );
-    return TCL_ERROR;
-    
-}
-
-void register_fiber( Fiber *fiber ) {
-    if ( fiber->fiber_name() == NULL )  return;
-    char buffer[80];
-    snprintf( buffer, sizeof(buffer), "Fiber::%s", fiber->fiber_name() );
-    // Tcl_EvalEx( interpreter, "namespace eval Fiber {}", -1, TCL_EVAL_GLOBAL );
-    // Tcl_CreateObjCommand( interpreter, buffer, fiber_cmd, (ClientData)fiber, NULL );
-}
-
-class FiberList {
-    Fiber *fiber;
-    FiberList *next;
-public:
-    FiberList() {
-        fiber = new MainFiber();
-        next = 0;
-        register_fiber( fiber );
-    }
-    ~FiberList() {
-        delete next;
-        delete fiber;
+
+namespace {
+
+    /**
+     * Lay out a frame at the 16 byte aligned top of the stack for the
+     * first context_switch() into the fiber to pop.
+     */
+    void
+    context_init( FiberContext *context, void *stack, size_t size, Fiber *fiber ) {
+        uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+        uintptr_t *frame = (uintptr_t *)top - FRAME_WORDS;
+        memset( frame, 0, FRAME_WORDS * sizeof(uintptr_t) );
+        context_frame( frame, fiber );
+        context->sp = frame;
     }
-    FiberList( Fiber *fiber, FiberList *next )
-    : fiber(fiber), next(next) {
-        register_fiber( fiber );
+
+    inline void
+    context_swap( FiberContext *from, FiberContext *to ) {
+        context_switch( &from->sp, to->sp );
     }
-    void add( Fiber *that ) {
-        FiberList *entry = new FiberList( that, next );
-        next = entry;
+
+}
+
+#else
+
+namespace {
+
+    /**
+     * makecontext() only passes ints, so the fiber's address comes in
+     * two halves.
+     */
+    void
+    context_entry( unsigned int high, unsigned int low ) {
+        fiber_entry( (Fiber *)(((uintptr_t)high << 32) | low) );
+    }
+
+    void
+    context_init( FiberContext *context, void *stack, size_t size, Fiber *fiber ) {
+        getcontext( &context->uc );
+        context->uc.uc_stack.ss_sp = stack;
+        context->uc.uc_stack.ss_size = size;
+        context->uc.uc_link = NULL;
+        uintptr_t self = (uintptr_t)fiber;
+        makecontext( &context->uc, (void (*)())context_entry, 2,
+                     (unsigned int)((uint64_t)self >> 32), (unsigned int)(self & 0xffffffff) );
+    }
+
+    inline void
+    context_swap( FiberContext *from, FiberContext *to ) {
+        swapcontext( &from->uc, &to->uc );
     }
-};
-FiberList fibers;
 
-#if 0
-union SIGNAL *
-receive( const SIGSELECT *segsel ) {
-    Fiber *self = (Fiber *)pthread_getspecific(CurrentFiber);
-    // cycle through SignalQueue looking for the first
-    // that matches the SIGSELECTLIST
 }
+
 #endif
 
-static void *boot( void *data ) {
-    Fiber *fiber = (Fiber *)data;
-    pthread_setspecific( CurrentFiber, fiber );
-    pthread_setcancelstate( PTHREAD_CANCEL_ENABLE, NULL );
+/**
+ * The first code run on a fiber's stack.  Once run() returns, the
+ * fiber switches back to its scheduler for the last time and the
+ * scheduler deletes it.
+ */
+void
+fiber_entry( Fiber *fiber ) {
     fiber->running();
     fiber->run();
-    return NULL;
+    fiber->state = Fiber::STOPPED;
+    fiber->scheduler->suspend();
 }
 
-bool Fiber::start() {
-#if 0
-    if ( pthread_create(&id, NULL, boot, this) ) {
-        return false;
-    }
-#endif
-    return true;
-}
+/**
+ */
+Fiber::Fiber( const char *name, size_t size )
+: _fiber_name(NULL), scheduler(NULL), stack(NULL), _stack_size(size), next(NULL),
+  older(NULL), newer(NULL), parked_fd(-1), ready_events(0), wait_serial(0), switches(0),
+  state(STOPPED) {
+    memset( locals, 0, sizeof(locals) );
+    fiber_name( (name == NULL) ? "fiber" : name );
 
-bool Fiber::stop() {
-#if 0
-    if ( pthread_cancel(id) != 0 ) {
-        return false;
-    }
-#endif
-    return true;
+    pthread_mutex_lock( &registry );
+    _id = ++fiber_count;
+    older = fibers;
+    if ( fibers != NULL )  fibers->newer = this;
+    fibers = this;
+    pthread_mutex_unlock( &registry );
 }
 
-Fiber::Fiber( coroutine f ) {
-    fiber_name( "foo" );
-    fibers.add( this );
-    getcontext( &context );
-    context.uc_link = X;
-    makecontext( &context, f );
+/**
+ */
+Fiber::~Fiber() {
+    pthread_mutex_lock( &registry );
+    if ( newer != NULL )  newer->older = older;
+    else                  fibers = older;
+    if ( older != NULL )  older->newer = newer;
+    pthread_mutex_unlock( &registry );
+
+    if ( stack != NULL )  StackPool::release( stack );
+    free( _fiber_name );
 }
 
 /**
@@ -161,71 +337,690 @@ void Fiber::fiber_name( const char *_name ) {
     _fiber_name = strdup(_name);
 }
 
-#if 0
+/**
+ * Give the fiber a stack and hand it to a scheduler, the one running
+ * on this thread if none is given.
+ */
+bool
+Fiber::start( Scheduler *where ) {
+    if ( where == NULL )  where = Scheduler::current();
+    if ( where == NULL || stack != NULL )  return false;
+
+    stack = StackPool::acquire( _stack_size );
+    if ( stack == NULL ) {
+        syslog( LOG_ERR, "could not map a stack for fiber '%s'", _fiber_name );
+        return false;
+    }
+    _stack_size = stack->size;
+
+    context_init( &context, stack->base, stack->size, this );
+
+    where->start( this );
+    return true;
+}
+
+/**
+ * How deep the fiber's stack has been, or zero before it has one.
+ */
+size_t
+Fiber::stack_used() const {
+    if ( stack == NULL )  return 0;
+    return StackPool::high_water( stack );
+}
+
+/**
+ * The fiber running on this thread, or NULL when the thread is not
+ * running one.
+ */
+Fiber *
+Fiber::current() {
+    Scheduler *scheduler = Scheduler::current();
+    if ( scheduler == NULL )  return NULL;
+    return scheduler->running;
+}
+
+/**
+ * Let every other runnable fiber run before this one runs again.
+ */
+void
+Fiber::yield() {
+    Fiber *self = current();
+    if ( self == NULL ) {
+        sched_yield();
+        return;
+    }
+    self->state = RUNNABLE;
+    self->scheduler->enqueue( self );
+    self->scheduler->suspend();
+}
+
+/**
+ * The deadline is on CLOCK_MONOTONIC.
+ */
+void
+Fiber::sleep_until( const struct timespec *deadline ) {
+    Fiber *self = current();
+    if ( self == NULL ) {
+        while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) == EINTR ) ;
+        return;
+    }
+    self->scheduler->sleep( self, (deadline->tv_sec * 1000000000ULL) + deadline->tv_nsec );
+    self->state = BLOCKED;
+    self->scheduler->suspend();
+}
+
+/**
+ */
+void
+Fiber::sleep_for( int milliseconds ) {
+    uint64_t deadline = nanoseconds() + (milliseconds * 1000000ULL);
+    struct timespec when;
+    when.tv_sec = deadline / 1000000000ULL;
+    when.tv_nsec = deadline % 1000000000ULL;
+    sleep_until( &when );
+}
+
+/**
+ * Park until the descriptor has one of the events, as for poll(), or
+ * until the milliseconds have passed if that is not negative.  Returns
+ * the events that happened, 0 on timeout or -1 if the descriptor cannot
+ * be watched.  Only one fiber of a scheduler may wait on a descriptor
+ * at a time.
+ */
 int
-Fiber::TclCommand( ClientData data, Tcl_Interp *interp,
-                    int objc, Tcl_Obj * CONST *objv )
-{
-    Fiber *fiber = (Fiber *)data;
-    if ( objc < 2 ) {
-        Tcl_ResetResult( interp );
-        Tcl_WrongNumArgs( interp, 1, objv, "command ..." );
-        return TCL_ERROR;
-    }
-    char *command = Tcl_GetStringFromObj( objv[1], NULL );
-    if ( Tcl_StringMatch(command, "start") ) {
-        fiber->start();
-        Tcl_ResetResult( interp );
-        return TCL_OK;
-    }
-    if ( Tcl_StringMatch(command, "pid") ) {
-        Tcl_Obj *result = Tcl_NewIntObj( fiber->getpid() );
-        Tcl_SetObjResult( interp, result );
-        return TCL_OK;
-    }
-    if ( Tcl_StringMatch(command, "status") ) {
-        Tcl_Obj *result = Tcl_NewStringObj( fiber->status, -1 );
-        Tcl_SetObjResult( interp, result );
-        return TCL_OK;
-    }
-    
-    Svc_SetResult( interp, "Unknown command for fiber object", TCL_STATIC );
-    return TCL_ERROR;
-    
+Fiber::wait_fd( int fd, int events, int milliseconds ) {
+    Fiber *self = current();
+    if ( self == NULL ) {
+        struct pollfd p = { fd, (short)events, 0 };
+        int ready = ::poll( &p, 1, milliseconds );
+        if ( ready < 0 )  return -1;
+        return (ready == 0) ? 0 : p.revents;
+    }
+
+    Scheduler *scheduler = self->scheduler;
+    struct epoll_event event;
+    memset( &event, 0, sizeof(event) );
+    event.events = events | EPOLLONESHOT;
+    event.data.ptr = self;
+    if ( epoll_ctl(scheduler->poller, EPOLL_CTL_ADD, fd, &event) < 0 )  return -1;
+    self->parked_fd = fd;
+    scheduler->parked++;
+    if ( milliseconds >= 0 ) {
+        scheduler->sleep( self, nanoseconds() + (milliseconds * 1000000ULL) );
+    }
+    self->ready_events = 0;
+    self->state = BLOCKED;
+    scheduler->suspend();
+    return self->ready_events;
 }
-#endif
 
-Scheduler::Scheduler() {
+/**
+ * Reserve a slot of fiber local storage.  Returns -1 once all
+ * local_count slots are taken.
+ */
+int
+Fiber::local_key() {
+    int key = __atomic_fetch_add( &key_count, 1, __ATOMIC_RELAXED );
+    return (key < local_count) ? key : -1;
+}
+
+/**
+ * Off a fiber, these use storage local to the thread.
+ */
+void *
+Fiber::local( int key ) {
+    if ( key < 0 || key >= local_count )  return NULL;
+    Fiber *self = current();
+    return (self == NULL) ? thread_locals[key] : self->locals[key];
+}
+
+/**
+ */
+void
+Fiber::local( int key, void *value ) {
+    if ( key < 0 || key >= local_count )  return;
+    Fiber *self = current();
+    if ( self == NULL )  thread_locals[key] = value;
+    else                 self->locals[key] = value;
+}
+
+namespace {
+
+    /**
+     * A full eventfd counter means the doorbell is already ringing, so
+     * EAGAIN is not a failure.
+     */
+    void
+    ring( int doorbell, const char *name ) {
+        uint64_t one = 1;
+        if ( write(doorbell, &one, sizeof(one)) < 0 && errno != EAGAIN ) {
+            syslog( LOG_ERR, "scheduler '%s' cannot ring its doorbell: %s", name, strerror(errno) );
+        }
+    }
+
+}
+
+/**
+ * The doorbell is an eventfd in the epoll set, rung when a fiber is
+ * started from another thread or stop() is called.
+ */
+Scheduler::Scheduler( const char *_name )
+: running(NULL), head(NULL), tail(NULL), sleepers(NULL), sleeper_count(0), sleeper_capacity(0),
+  inbox(NULL), stopping(false), live(0), runnable(0), parked(0), switches(0),
+  older(NULL), newer(NULL) {
+    pthread_once( &once, create_key );
+    pthread_mutex_init( &lock, NULL );
+    name = strdup( _name );
+
+    poller = epoll_create1( EPOLL_CLOEXEC );
+    doorbell = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if ( poller < 0 || doorbell < 0 ) {
+        syslog( LOG_ERR, "scheduler '%s' has no epoll: %s", name, strerror(errno) );
+    } else {
+        struct epoll_event event;
+        memset( &event, 0, sizeof(event) );
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        epoll_ctl( poller, EPOLL_CTL_ADD, doorbell, &event );
+    }
+
+    pthread_mutex_lock( &registry );
+    older = schedulers;
+    if ( schedulers != NULL )  schedulers->newer = this;
+    schedulers = this;
+    pthread_mutex_unlock( &registry );
 }
 
+/**
+ * A scheduler should only be deleted once its fibers are done.
+ */
 Scheduler::~Scheduler() {
+    pthread_mutex_lock( &registry );
+    if ( newer != NULL )  newer->older = older;
+    else                  schedulers = older;
+    if ( older != NULL )  older->newer = newer;
+    pthread_mutex_unlock( &registry );
+
+    if ( poller >= 0 )  close( poller );
+    if ( doorbell >= 0 )  close( doorbell );
+    free( sleepers );
+    free( name );
+}
+
+/**
+ * The scheduler running on this thread.
+ */
+Scheduler *
+Scheduler::current() {
+    pthread_once( &once, create_key );
+    return (Scheduler *)pthread_getspecific( CurrentScheduler );
 }
 
 /**
- * What about yield() - how will execution flow back through the scheduler?
  */
 void
-Scheduler::yield() {
-    // find another context
-    ucontext_t *context;
-    context->uc_link = &dispatcher;
-    swapcontext( &dispatcher, context );
+Scheduler::enqueue( Fiber *fiber ) {
+    fiber->next = NULL;
+    if ( tail == NULL )  head = fiber;
+    else                 tail->next = fiber;
+    tail = fiber;
+    runnable++;
 }
 
 /**
- * Maybe scheduler is a thread - and run is the schedule loop
+ * Fibers started from this thread go straight on the run queue; those
+ * started from any other go through the inbox.
  */
 void
-Scheduler::schedule() {
-    while ( true ) {
-        yield();
+Scheduler::start( Fiber *fiber ) {
+    fiber->scheduler = this;
+    fiber->state = Fiber::RUNNABLE;
+    if ( current() == this ) {
+        live++;
+        enqueue( fiber );
+        return;
     }
+
+    pthread_mutex_lock( &lock );
+    fiber->next = inbox;
+    inbox = fiber;
+    pthread_mutex_unlock( &lock );
+    ring( doorbell, name );
 }
 
+/**
+ */
 bool
 Scheduler::start( coroutine f ) {
-    Fiber *fiber = new Fiber( f );
-    return false;
+    return (new CoroutineFiber(f))->start( this );
+}
+
+/**
+ * The inbox is a stack, so it is reversed to run its fibers in the
+ * order they were started.
+ */
+void
+Scheduler::take_inbox() {
+    pthread_mutex_lock( &lock );
+    Fiber *list = inbox;
+    inbox = NULL;
+    pthread_mutex_unlock( &lock );
+
+    Fiber *reversed = NULL;
+    while ( list != NULL ) {
+        Fiber *fiber = list;
+        list = fiber->next;
+        fiber->next = reversed;
+        reversed = fiber;
+    }
+    while ( reversed != NULL ) {
+        Fiber *fiber = reversed;
+        reversed = fiber->next;
+        live++;
+        enqueue( fiber );
+    }
+}
+
+/**
+ * Sleepers are kept in a binary heap on their deadlines.  An entry is
+ * stale once its fiber has been woken some other way, which bumps the
+ * fiber's wait_serial.
+ */
+void
+Scheduler::sleep( Fiber *fiber, uint64_t deadline ) {
+    if ( sleeper_count == sleeper_capacity ) {
+        int capacity = (sleeper_capacity == 0) ? 64 : sleeper_capacity * 2;
+        Sleeper *grown = (Sleeper *)realloc( sleepers, capacity * sizeof(Sleeper) );
+        if ( grown == NULL ) {
+            syslog( LOG_ERR, "scheduler '%s' cannot grow its sleepers", name );
+            return;
+        }
+        sleepers = grown;
+        sleeper_capacity = capacity;
+    }
+    int i = sleeper_count++;
+    while ( i > 0 ) {
+        int parent = (i - 1) / 2;
+        if ( sleepers[parent].deadline <= deadline )  break;
+        sleepers[i] = sleepers[parent];
+        i = parent;
+    }
+    sleepers[i].deadline = deadline;
+    sleepers[i].fiber = fiber;
+    sleepers[i].serial = fiber->wait_serial;
+}
+
+/**
+ */
+void
+Scheduler::wake_sleepers( uint64_t now ) {
+    while ( sleeper_count > 0 && sleepers[0].deadline <= now ) {
+        Sleeper top = sleepers[0];
+        Sleeper last = sleepers[--sleeper_count];
+        int i = 0;
+        for (;;) {
+            int child = (2 * i) + 1;
+            if ( child >= sleeper_count )  break;
+            if ( child + 1 < sleeper_count && sleepers[child + 1].deadline < sleepers[child].deadline )  child++;
+            if ( last.deadline <= sleepers[child].deadline )  break;
+            sleepers[i] = sleepers[child];
+            i = child;
+        }
+        if ( sleeper_count > 0 )  sleepers[i] = last;
+
+        Fiber *fiber = top.fiber;
+        if ( fiber->state == Fiber::BLOCKED && fiber->wait_serial == top.serial )  wake( fiber, 0 );
+    }
+}
+
+/**
+ * Make a blocked fiber runnable, taking its descriptor out of the
+ * epoll set and leaving any deadline it had stale.
+ */
+void
+Scheduler::wake( Fiber *fiber, int events ) {
+    if ( fiber->parked_fd >= 0 ) {
+        epoll_ctl( poller, EPOLL_CTL_DEL, fiber->parked_fd, NULL );
+        fiber->parked_fd = -1;
+        parked--;
+    }
+    fiber->wait_serial++;
+    fiber->ready_events = events;
+    fiber->state = Fiber::RUNNABLE;
+    enqueue( fiber );
+}
+
+/**
+ */
+void
+Scheduler::poll( int timeout ) {
+    struct epoll_event events[64];
+    int ready = epoll_wait( poller, events, 64, timeout );
+    for ( int i = 0 ; i < ready ; i++ ) {
+        Fiber *fiber = (Fiber *)events[i].data.ptr;
+        if ( fiber == NULL ) {
+            uint64_t count;
+            if ( read(doorbell, &count, sizeof(count)) < 0 && errno != EAGAIN ) {
+                syslog( LOG_ERR, "scheduler '%s' cannot read its doorbell: %s", name, strerror(errno) );
+            }
+            continue;
+        }
+        if ( fiber->state == Fiber::BLOCKED && fiber->parked_fd >= 0 )  wake( fiber, events[i].events );
+    }
+}
+
+/**
+ * Called on a fiber's stack to switch back to the dispatcher.  Returns
+ * when the scheduler next runs this fiber.
+ */
+void
+Scheduler::suspend() {
+    Fiber *self = running;
+    context_swap( &self->context, &dispatcher );
+}
+
+/**
+ */
+void
+Scheduler::dispatch( Fiber *fiber ) {
+    running = fiber;
+    fiber->state = Fiber::RUNNING;
+    fiber->switches++;
+    switches++;
+    context_swap( &dispatcher, &fiber->context );
+    running = NULL;
+    if ( fiber->state == Fiber::STOPPED ) {
+        live--;
+        delete fiber;
+    }
+}
+
+/**
+ * Each round runs the fibers that were runnable when it began, then
+ * checks the descriptors without waiting, so busy fibers cannot starve
+ * parked ones.  Only when nothing is runnable does it block, until the
+ * next deadline.
+ */
+void
+Scheduler::loop( bool forever ) {
+    void *outer = pthread_getspecific( CurrentScheduler );
+    pthread_setspecific( CurrentScheduler, this );
+
+    for (;;) {
+        take_inbox();
+        wake_sleepers( nanoseconds() );
+
+        for ( int round = runnable ; round > 0 && head != NULL ; round-- ) {
+            Fiber *fiber = head;
+            head = fiber->next;
+            if ( head == NULL )  tail = NULL;
+            runnable--;
+            dispatch( fiber );
+        }
+
+        if ( __atomic_load_n(&stopping, __ATOMIC_ACQUIRE) )  break;
+        if ( forever == false && live == 0 ) {
+            pthread_mutex_lock( &lock );
+            bool idle = inbox == NULL;
+            pthread_mutex_unlock( &lock );
+            if ( idle )  break;
+        }
+
+        int timeout = -1;
+        if ( head != NULL ) {
+            timeout = 0;
+        } else if ( sleeper_count > 0 ) {
+            uint64_t now = nanoseconds();
+            uint64_t deadline = sleepers[0].deadline;
+            timeout = (deadline <= now) ? 0 : (int)((deadline - now + 999999) / 1000000);
+        }
+        poll( timeout );
+    }
+
+    __atomic_store_n( &stopping, false, __ATOMIC_RELAXED );
+    pthread_setspecific( CurrentScheduler, outer );
+}
+
+/**
+ * Run fibers on this thread until all of them have finished.
+ */
+void
+Scheduler::schedule() {
+    loop( false );
+}
+
+/**
+ * Run fibers on this thread, waiting for more when there are none,
+ * until stop() is called.
+ */
+void
+Scheduler::serve() {
+    loop( true );
+}
+
+/**
+ * May be called from any thread.  The scheduler returns once the round
+ * it is in has finished.
+ */
+void
+Scheduler::stop() {
+    __atomic_store_n( &stopping, true, __ATOMIC_RELEASE );
+    ring( doorbell, name );
+}
+
+/**
+ */
+void
+Scheduler::report( FiberInjector *injector ) {
+    FiberInjector& f = *injector;
+    pthread_mutex_lock( &registry );
+    for ( Fiber *fiber = fibers ; fiber != NULL ; fiber = fiber->older ) {
+        const char *where = (fiber->scheduler == NULL) ? "" : fiber->scheduler->name;
+        f( fiber, where, fiber->switches );
+    }
+    pthread_mutex_unlock( &registry );
+}
+
+/**
+ * The counts are read without the schedulers' locks, so they may be a
+ * moment out of date.  Sleeping counts deadlines not yet reached, some
+ * of which belong to fibers already woken another way.
+ */
+void
+Scheduler::report( SchedulerInjector *injector ) {
+    SchedulerInjector& f = *injector;
+    pthread_mutex_lock( &registry );
+    for ( Scheduler *s = schedulers ; s != NULL ; s = s->older ) {
+        f( s->name, s->live, s->runnable, s->sleeper_count, s->parked, s->switches );
+    }
+    pthread_mutex_unlock( &registry );
+}
+
+int StackPool::cache_limit = 4096;
+
+/**
+ * A recycled stack if there is one of this size, otherwise a new
+ * mapping with its lowest page made a guard.
+ */
+FiberStack *
+StackPool::acquire( size_t size ) {
+    size_t page = sysconf( _SC_PAGESIZE );
+    size = (size + page - 1) & ~(page - 1);
+
+    pthread_mutex_lock( &pool_lock );
+    StackClass *c = stack_classes;
+    while ( c != NULL && c->size != size )  c = c->next;
+    if ( c == NULL ) {
+        c = (StackClass *)calloc( 1, sizeof(StackClass) );
+        if ( c == NULL ) {
+            pthread_mutex_unlock( &pool_lock );
+            return NULL;
+        }
+        c->size = size;
+        c->next = stack_classes;
+        stack_classes = c;
+    }
+    FiberStack *stack = c->free;
+    if ( stack != NULL ) {
+        c->free = stack->next;
+        c->cached--;
+        c->reused++;
+        pthread_mutex_unlock( &pool_lock );
+        stack->next = NULL;
+        return stack;
+    }
+    c->mapped++;
+    pthread_mutex_unlock( &pool_lock );
+
+    stack = (FiberStack *)malloc( sizeof(FiberStack) );
+    void *map = MAP_FAILED;
+    if ( stack != NULL ) {
+        map = mmap( 0, size + page, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0 );
+    }
+    if ( map != MAP_FAILED && mprotect(map, page, PROT_NONE) < 0 ) {
+        munmap( map, size + page );
+        map = MAP_FAILED;
+    }
+    if ( map == MAP_FAILED ) {
+        if ( errno == ENOMEM ) {
+            syslog( LOG_ERR, "out of mappings for fiber stacks, check vm.max_map_count" );
+        }
+        free( stack );
+        pthread_mutex_lock( &pool_lock );
+        c->mapped--;
+        pthread_mutex_unlock( &pool_lock );
+        return NULL;
+    }
+    stack->base = (char *)map + page;
+    stack->size = size;
+    stack->resident = 0;
+    stack->next = NULL;
+    return stack;
+}
+
+/**
+ * Zero the part of the stack the fiber used and keep it, or unmap it
+ * when enough of its size are already kept.
+ */
+void
+StackPool::release( FiberStack *stack ) {
+    size_t used = high_water( stack );
+    memset( stack->base + stack->size - used, 0, used );
+    size_t page = sysconf( _SC_PAGESIZE );
+    size_t resident = (used + page - 1) & ~(page - 1);
+    if ( resident > stack->resident )  stack->resident = resident;
+
+    pthread_mutex_lock( &pool_lock );
+    StackClass *c = stack_classes;
+    while ( c != NULL && c->size != stack->size )  c = c->next;
+    if ( used > c->deepest )  c->deepest = used;
+    if ( c->cached < cache_limit ) {
+        stack->next = c->free;
+        c->free = stack;
+        c->cached++;
+        pthread_mutex_unlock( &pool_lock );
+        return;
+    }
+    c->mapped--;
+    pthread_mutex_unlock( &pool_lock );
+
+    munmap( stack->base - page, stack->size + page );
+    free( stack );
+}
+
+/**
+ * The stack grows down from base + size, and anything below the
+ * lowest page the kernel has committed was never touched.  Within the
+ * committed pages, the first non-zero word from the bottom marks the
+ * deepest the stack has been, give or take a frame of zeroes.
+ */
+size_t
+StackPool::high_water( const FiberStack *stack ) {
+    size_t page = sysconf( _SC_PAGESIZE );
+    size_t pages = stack->size / page;
+    unsigned char present[256];
+    size_t first = pages;
+
+    for ( size_t i = 0 ; i < pages && first == pages ; i += sizeof(present) ) {
+        size_t count = pages - i;
+        if ( count > sizeof(present) )  count = sizeof(present);
+        if ( mincore(stack->base + (i * page), count * page, present) < 0 )  return stack->size;
+        for ( size_t j = 0 ; j < count ; j++ ) {
+            if ( present[j] & 1 ) {
+                first = i + j;
+                break;
+            }
+        }
+    }
+    if ( first == pages )  return 0;
+
+    const uintptr_t *word = (const uintptr_t *)(stack->base + (first * page));
+    const uintptr_t *top = (const uintptr_t *)(stack->base + stack->size);
+    while ( word < top && *word == 0 )  word++;
+    return (const char *)top - (const char *)word;
+}
+
+/**
+ * Hand the pages of idle stacks back to the kernel, all but the keep
+ * most recently used of each size, and unmap any stacks kept beyond
+ * cache_limit.  Returns how many were trimmed or unmapped.
+ */
+int
+StackPool::trim( int keep ) {
+    size_t page = sysconf( _SC_PAGESIZE );
+    FiberStack *excess = NULL;
+    int trimmed = 0;
+
+    pthread_mutex_lock( &pool_lock );
+    for ( StackClass *c = stack_classes ; c != NULL ; c = c->next ) {
+        int n = 0;
+        FiberStack **link = &c->free;
+        while ( *link != NULL ) {
+            FiberStack *stack = *link;
+            if ( n >= cache_limit ) {
+                *link = stack->next;
+                stack->next = excess;
+                excess = stack;
+                c->cached--;
+                c->mapped--;
+                trimmed++;
+                continue;
+            }
+            if ( n >= keep && stack->resident > 0 ) {
+                madvise( stack->base, stack->size, MADV_DONTNEED );
+                stack->resident = 0;
+                trimmed++;
+            }
+            link = &stack->next;
+            n++;
+        }
+    }
+    pthread_mutex_unlock( &pool_lock );
+
+    while ( excess != NULL ) {
+        FiberStack *stack = excess;
+        excess = stack->next;
+        munmap( stack->base - page, stack->size + page );
+        free( stack );
+    }
+    return trimmed;
+}
+
+/**
+ */
+void
+StackPool::report( StackPoolInjector *injector ) {
+    StackPoolInjector& f = *injector;
+    pthread_mutex_lock( &pool_lock );
+    for ( StackClass *c = stack_classes ; c != NULL ; c = c->next ) {
+        int resident = 0;
+        for ( FiberStack *stack = c->free ; stack != NULL ; stack = stack->next ) {
+            if ( stack->resident > 0 )  resident++;
+        }
+        f( c->size, c->mapped, c->cached, resident, c->deepest, c->reused );
+    }
+    pthread_mutex_unlock( &pool_lock );
 }
 
 /* vim: set autoindent expandtab sw=4 : */
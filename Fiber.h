@@ -2,54 +2,223 @@
 /** \file Fiber.h
  * \brief C++ class defining a fiber abstraction.
  *
- * This is a wrapper around the POSIX ucontext implementation that also
+ * Fibers switch with a few instructions of assembly where the platform
+ * has them, and with POSIX ucontext elsewhere.  The module also
  * connects to a TCL library for debugging/configuration, etc.
+ *
+ * A Scheduler runs fibers on whichever thread calls its schedule()
+ * method, so a handful of threads can each run thousands of fibers.
+ * A fiber runs until it yields, sleeps, waits for a file descriptor or
+ * returns from run(); nothing preempts it.
  */
 
-#ifndef _THREAD_H_
-#define _THREAD_H_
-
-#define _XOPEN_SOURCE
+#ifndef _FIBER_H_
+#define _FIBER_H_
 
 #include <sys/types.h>
-#include <unistd.h>
-// #include <ucontext.h>
-#include <sys/ucontext.h>
-#include "Queue.h"
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+/**
+ * Where a switched-out fiber's registers are kept.  On x86-64 and
+ * aarch64 that is only its stack pointer: the switch pushes the
+ * callee-saved registers on the fiber's own stack and never touches
+ * the signal mask.  Elsewhere, or when built with FIBER_UCONTEXT
+ * defined, it is a ucontext and every switch costs a sigprocmask().
+ */
+#if (defined(__x86_64__) || defined(__aarch64__)) && !defined(FIBER_UCONTEXT)
+#define FIBER_STACK_SWITCH 1
+struct FiberContext {
+    void *sp;
+};
+#else
+#include <ucontext.h>
+struct FiberContext {
+    ucontext_t uc;
+};
+#endif
+
+class Scheduler;
+class Fiber;
+
+/**
+ * A fiber stack.  The page below base is mapped PROT_NONE, so running
+ * off the end faults instead of scribbling on a neighbour.
+ */
+struct FiberStack {
+    char *base;
+    size_t size;
+    size_t resident;
+    FiberStack *next;
+};
+
+/**
+ * Called once for each stack size in the pool.
+ */
+class StackPoolInjector {
+public:
+    StackPoolInjector() {}
+    virtual ~StackPoolInjector() {}
+    virtual void operator () ( size_t size, int mapped, int cached, int resident,
+                               size_t deepest, uint64_t reused ) = 0;
+};
+
+/**
+ * Stacks are mapped without reserving memory, so the kernel only
+ * commits the pages a fiber touches, and are kept for the next fiber
+ * of the same size when a fiber ends.  A stack is zeroed down to its
+ * high-water mark before it goes back to the pool, so every free stack
+ * reads as zero and a fiber's high-water mark is the lowest non-zero
+ * word on its stack.
+ *
+ * Each stack takes two kernel mappings, so running more than about
+ * 30000 fibers needs vm.max_map_count raised.
+ */
+class StackPool {
+public:
+    static int cache_limit;
+    static FiberStack *acquire( size_t );
+    static void release( FiberStack * );
+    static size_t high_water( const FiberStack * );
+    static int trim( int = 0 );
+    static void report( StackPoolInjector * );
+};
+
+void fiber_entry( Fiber * );
 
 typedef void (*coroutine)();
 
 /**
- * A class to wrap fiber management.  It also connects the TCL interpreter
- * to an instance of the class for managing its state.
+ * A class to wrap fiber management.  Fibers are created with new and
+ * deleted by their scheduler once run() returns.
+ *
+ * The blocking calls may be made from a plain thread too, where they
+ * block the thread instead.
  */
 class Fiber {
+    friend class Scheduler;
+    friend void fiber_entry( Fiber * );
+public:
+    static const size_t default_stack_size = 64 * 1024;
+    static const int local_count = 16;
 private:
-    Fiber() {}
+    Fiber( const Fiber& );
+    Fiber& operator = ( const Fiber& );
 protected:
-    ucontext_t context;
+    FiberContext context;
     char *_fiber_name;
+    uint64_t _id;
+    Scheduler *scheduler;
+    FiberStack *stack;
+    size_t _stack_size;
+    Fiber *next;
+    Fiber *older, *newer;
+    int parked_fd;
+    int ready_events;
+    uint32_t wait_serial;
+    uint64_t switches;
+    void *locals[local_count];
 public:
-    enum { STOPPED, RUNNABLE, RUNNING, BLOCKED } state;
-    Fiber( coroutine );
-    virtual ~Fiber() {} // TODO clean up name
+    enum State { STOPPED, RUNNABLE, RUNNING, BLOCKED } state;
+
+    Fiber( const char * = NULL, size_t = default_stack_size );
+    virtual ~Fiber();
     void running() { state = RUNNING; }
     virtual void run() = 0;
-    virtual bool start();
-    virtual bool stop();
+    virtual bool start( Scheduler * = NULL );
+    uint64_t id() const { return _id; }
+    size_t stack_size() const { return _stack_size; }
+    size_t stack_used() const;
     const char *fiber_name() const { return _fiber_name; }
     void fiber_name( const char * );
+
+    static Fiber *current();
+    static void yield();
+    static void sleep_until( const struct timespec * );
+    static void sleep_for( int );
+    static int wait_fd( int, int, int = -1 );
+    static int local_key();
+    static void *local( int );
+    static void local( int, void * );
 };
 
+/**
+ * Called once for each fiber, with its scheduler's name.
+ */
+class FiberInjector {
+public:
+    FiberInjector() {}
+    virtual ~FiberInjector() {}
+    virtual void operator () ( Fiber *, const char *scheduler, uint64_t switches ) = 0;
+};
+
+/**
+ * Called once for each scheduler.
+ */
+class SchedulerInjector {
+public:
+    SchedulerInjector() {}
+    virtual ~SchedulerInjector() {}
+    virtual void operator () ( const char *name, int fibers, int runnable, int sleeping,
+                               int parked, uint64_t switches ) = 0;
+};
+
+/**
+ * Keeps the fibers of one thread: a queue of those ready to run, a
+ * heap of those sleeping until a deadline, and an epoll set for those
+ * parked on a file descriptor.  start() may be called from any thread;
+ * everything else happens on the thread running schedule().
+ */
 class Scheduler {
+    friend class Fiber;
+    friend void fiber_entry( Fiber * );
 private:
-    ucontext_t dispatcher;
-    ucontext_t *current;
+    struct Sleeper {
+        uint64_t deadline;
+        Fiber *fiber;
+        uint32_t serial;
+    };
+    char *name;
+    FiberContext dispatcher;
+    Fiber *running;
+    Fiber *head, *tail;
+    Sleeper *sleepers;
+    int sleeper_count, sleeper_capacity;
+    int poller;
+    int doorbell;
+    pthread_mutex_t lock;
+    Fiber *inbox;
+    bool stopping;
+    int live;
+    int runnable;
+    int parked;
+    uint64_t switches;
+    Scheduler *older, *newer;
+
+    Scheduler( const Scheduler& );
+    Scheduler& operator = ( const Scheduler& );
+    void enqueue( Fiber * );
+    void take_inbox();
+    void sleep( Fiber *, uint64_t );
+    void wake_sleepers( uint64_t );
+    void poll( int );
+    void wake( Fiber *, int );
+    void suspend();
+    void dispatch( Fiber * );
+    void loop( bool );
 public:
-    Scheduler();
+    Scheduler( const char * = "scheduler" );
     ~Scheduler();
     void schedule();
+    void serve();
+    void stop();
     bool start( coroutine );
+    void start( Fiber * );
+    const char *scheduler_name() const { return name; }
+    static Scheduler *current();
+    static void report( FiberInjector * );
+    static void report( SchedulerInjector * );
 };
 
 #endif
@@ -0,0 +1,125 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file Futex.h
+ * \brief Sleep and wake on a futex when a lock-free structure changes
+ */
+
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Threads waiting for one kind of change to a lock-free structure, such
+ * as a queue becoming non-empty.
+ *
+ * A waiter is counted and reads the signal before it checks the
+ * structure again, so a wake that lands between the check and the sleep
+ * changes the signal and the sleep returns at once.  The side making
+ * the change only makes a system call when the count is non-zero.
+ *
+ * Waiters placed in memory shared between processes must be built with
+ * shared set.
+ */
+class Waiters {
+    int signal;
+    int waiting;
+    int wait_op, wake_op;
+
+    /**
+     * Sleep for at most milliseconds, or for ever if it is negative.
+     */
+    void sleep( int seen, int milliseconds ) {
+        if ( milliseconds < 0 ) {
+            syscall( SYS_futex, &signal, wait_op, seen, NULL, NULL, 0 );
+            return;
+        }
+        struct timespec timeout;
+        timeout.tv_sec = milliseconds / 1000;
+        timeout.tv_nsec = (milliseconds % 1000) * 1000000L;
+        syscall( SYS_futex, &signal, wait_op, seen, &timeout, NULL, 0 );
+    }
+public:
+    Waiters( bool shared = false ) : signal(0), waiting(0) {
+        wait_op = shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE;
+        wake_op = shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE;
+    }
+
+    /**
+     * Called after the change has been published.  The fence orders the
+     * publish before the read of the count, against a waiter counting
+     * itself before it checks again.
+     */
+    void wake() {
+        __atomic_thread_fence( __ATOMIC_SEQ_CST );
+        if ( __atomic_load_n(&waiting, __ATOMIC_RELAXED) == 0 )  return;
+        __atomic_add_fetch( &signal, 1, __ATOMIC_SEQ_CST );
+        syscall( SYS_futex, &signal, wake_op, INT_MAX, NULL, NULL, 0 );
+    }
+
+    /**
+     * Sleep until (object->*test)() returns until.
+     */
+    template <class Object>
+    void block( Object *object, bool (Object::*test)(), bool until ) {
+        while ( (object->*test)() != until ) {
+            __atomic_add_fetch( &waiting, 1, __ATOMIC_SEQ_CST );
+            int seen = __atomic_load_n( &signal, __ATOMIC_SEQ_CST );
+            if ( (object->*test)() != until )  sleep( seen, -1 );
+            __atomic_sub_fetch( &waiting, 1, __ATOMIC_SEQ_CST );
+        }
+    }
+
+    /**
+     * As block(), but give up after milliseconds.  Returns false if the
+     * test still fails.
+     */
+    template <class Object>
+    bool block( Object *object, bool (Object::*test)(), bool until, int milliseconds ) {
+        struct timespec now;
+        clock_gettime( CLOCK_MONOTONIC, &now );
+        int64_t deadline = (now.tv_sec * 1000LL) + (now.tv_nsec / 1000000) + milliseconds;
+
+        while ( (object->*test)() != until ) {
+            clock_gettime( CLOCK_MONOTONIC, &now );
+            int64_t remaining = deadline - ((now.tv_sec * 1000LL) + (now.tv_nsec / 1000000));
+            if ( remaining <= 0 )  return false;
+
+            __atomic_add_fetch( &waiting, 1, __ATOMIC_SEQ_CST );
+            int seen = __atomic_load_n( &signal, __ATOMIC_SEQ_CST );
+            if ( (object->*test)() != until )  sleep( seen, remaining );
+            __atomic_sub_fetch( &waiting, 1, __ATOMIC_SEQ_CST );
+        }
+        return true;
+    }
+};
+
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
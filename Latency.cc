@@ -0,0 +1,293 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file Latency.cc
+ * \brief Latency histograms kept per command
+ */
+
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "Latency.h"
+
+/**
+ * Bucket 4n+k holds durations from 2^n to 2^(n+1), split in quarters
+ * by the two bits below the top one.
+ */
+int
+LatencyHistogram::bucket( uint64_t ns ) {
+    if ( ns < 4 )  return ns;
+    int top = 63 - __builtin_clzll( ns );
+    int index = (top << 2) | ((ns >> (top - 2)) & 3);
+    if ( index >= bucket_count )  index = bucket_count - 1;
+    return index;
+}
+
+/**
+ * The largest duration counted in a bucket.
+ */
+uint64_t
+LatencyHistogram::bound( int index ) {
+    if ( index < 4 )  return index;
+    int top = index >> 2;
+    uint64_t quarter = 1ULL << (top - 2);
+    return (1ULL << top) + ((index & 3) + 1) * quarter - 1;
+}
+
+/**
+ */
+void
+LatencyHistogram::record( uint64_t ns ) {
+    __atomic_add_fetch( &buckets[bucket(ns)], 1, __ATOMIC_RELAXED );
+    __atomic_add_fetch( &count, 1, __ATOMIC_RELAXED );
+    __atomic_add_fetch( &sum, ns, __ATOMIC_RELAXED );
+    uint64_t seen = __atomic_load_n( &max, __ATOMIC_RELAXED );
+    while ( ns > seen ) {
+        if ( __atomic_compare_exchange_n(&max, &seen, ns, true,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED) )  break;
+    }
+}
+
+/**
+ * The upper bound of the bucket holding the given fraction of the
+ * durations, but never more than the longest one seen.
+ */
+uint64_t
+LatencyHistogram::percentile( double fraction ) const {
+    uint64_t total = __atomic_load_n( &count, __ATOMIC_RELAXED );
+    if ( total == 0 )  return 0;
+    uint64_t wanted = (uint64_t)(fraction * total + 0.5);
+    if ( wanted < 1 )  wanted = 1;
+    uint64_t seen = 0;
+    uint64_t longest = __atomic_load_n( &max, __ATOMIC_RELAXED );
+    for ( int i = 0 ; i < bucket_count ; i++ ) {
+        seen += __atomic_load_n( &buckets[i], __ATOMIC_RELAXED );
+        if ( seen >= wanted ) {
+            uint64_t result = bound( i );
+            return (result < longest) ? result : longest;
+        }
+    }
+    return longest;
+}
+
+namespace {
+
+    unsigned int
+    hash( const char *name, int length ) {
+        unsigned int result = 2166136261u;
+        for ( int i = 0 ; i < length ; i++ ) {
+            result ^= (unsigned char)name[i];
+            result *= 16777619u;
+        }
+        return result;
+    }
+
+    /**
+     * The first word of a request, braces and all.
+     */
+    int
+    first_word( const char *request, const char **word ) {
+        while ( *request == ' ' || *request == '\t' || *request == '\n' )  request++;
+        const char *end = request;
+        while ( *end != '\0' && *end != ' ' && *end != '\t' && *end != '\n' && *end != ';' )  end++;
+        *word = request;
+        return end - request;
+    }
+
+}
+
+/**
+ * The table is mapped rather than allocated, so it starts zeroed and
+ * costs nothing until commands are recorded.
+ */
+LatencyTable::LatencyTable() : count(0) {
+    pthread_mutex_init( &lock, NULL );
+    void *map = mmap( 0, sizeof(Entry) * capacity, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if ( map == MAP_FAILED ) {
+        syslog( LOG_ERR, "could not map latency table: %s", strerror(errno) );
+        entries = NULL;
+        return;
+    }
+    entries = (Entry *)map;
+}
+
+/**
+ */
+LatencyTable::~LatencyTable() {
+    if ( entries != NULL )  munmap( entries, sizeof(Entry) * capacity );
+}
+
+/**
+ * The last entry is kept for "(other)".
+ */
+LatencyTable::Entry *
+LatencyTable::lookup( const char *name, int length ) {
+    if ( length >= name_length )  length = name_length - 1;
+    unsigned int start = hash( name, length ) % (capacity - 1);
+
+    for ( int pass = 0 ; pass < 2 ; pass++ ) {
+        for ( int i = 0 ; i < capacity - 1 ; i++ ) {
+            Entry *entry = &entries[ (start + i) % (capacity - 1) ];
+            if ( __atomic_load_n(&entry->used, __ATOMIC_ACQUIRE) == 0 )  break;
+            if ( strncmp(entry->name, name, length) == 0 && entry->name[length] == '\0' )  return entry;
+        }
+        if ( pass > 0 )  break;
+
+        pthread_mutex_lock( &lock );
+        if ( count < capacity - 1 ) {
+            for ( int i = 0 ; i < capacity - 1 ; i++ ) {
+                Entry *entry = &entries[ (start + i) % (capacity - 1) ];
+                if ( entry->used != 0 ) {
+                    if ( strncmp(entry->name, name, length) == 0 && entry->name[length] == '\0' )  break;
+                    continue;
+                }
+                memcpy( entry->name, name, length );
+                entry->name[length] = '\0';
+                count++;
+                __atomic_store_n( &entry->used, 1, __ATOMIC_RELEASE );
+                break;
+            }
+        }
+        pthread_mutex_unlock( &lock );
+    }
+
+    Entry *other = &entries[capacity - 1];
+    if ( __atomic_load_n(&other->used, __ATOMIC_ACQUIRE) == 0 ) {
+        pthread_mutex_lock( &lock );
+        strcpy( other->name, "(other)" );
+        __atomic_store_n( &other->used, 1, __ATOMIC_RELEASE );
+        pthread_mutex_unlock( &lock );
+    }
+    return other;
+}
+
+/**
+ * Record one request's time in each phase, in nanoseconds.
+ */
+void
+LatencyTable::record( const char *request, int result, const uint64_t *phases ) {
+    if ( entries == NULL )  return;
+    const char *word;
+    int length = first_word( request, &word );
+    Entry *entry = lookup( word, length );
+    if ( result != 0 )  __atomic_add_fetch( &entry->errors, 1, __ATOMIC_RELAXED );
+    for ( int i = 0 ; i < phase_count ; i++ ) {
+        entry->phases[i].record( phases[i] );
+    }
+}
+
+/**
+ */
+void
+LatencyTable::report( LatencyInjector *injector ) {
+    if ( entries == NULL )  return;
+    LatencyInjector& f = *injector;
+    for ( int i = 0 ; i < capacity ; i++ ) {
+        Entry *entry = &entries[i];
+        if ( __atomic_load_n(&entry->used, __ATOMIC_ACQUIRE) == 0 )  continue;
+        f( entry->name, __atomic_load_n(&entry->errors, __ATOMIC_RELAXED), entry->phases );
+    }
+}
+
+/**
+ * Commands stay in the table; only their counts are cleared.  Requests
+ * finishing while this runs may be half counted.
+ */
+void
+LatencyTable::reset() {
+    if ( entries == NULL )  return;
+    for ( int i = 0 ; i < capacity ; i++ ) {
+        Entry *entry = &entries[i];
+        __atomic_store_n( &entry->errors, 0, __ATOMIC_RELAXED );
+        for ( int phase = 0 ; phase < phase_count ; phase++ ) {
+            LatencyHistogram& h = entry->phases[phase];
+            for ( int b = 0 ; b < LatencyHistogram::bucket_count ; b++ ) {
+                __atomic_store_n( &h.buckets[b], 0, __ATOMIC_RELAXED );
+            }
+            __atomic_store_n( &h.count, 0, __ATOMIC_RELAXED );
+            __atomic_store_n( &h.sum, 0, __ATOMIC_RELAXED );
+            __atomic_store_n( &h.max, 0, __ATOMIC_RELAXED );
+        }
+    }
+}
+
+namespace {
+
+    const char *phase_names[LatencyTable::phase_count] = { "queue", "eval", "send" };
+
+    /**
+     * One line per command and phase.
+     */
+    class LatencyWriter : public LatencyInjector {
+        FILE *f;
+    public:
+        LatencyWriter( FILE *f ) : f(f) {}
+        virtual ~LatencyWriter() {}
+        virtual void operator () ( const char *command, uint64_t errors, const LatencyHistogram *phases ) {
+            for ( int i = 0 ; i < LatencyTable::phase_count ; i++ ) {
+                const LatencyHistogram& h = phases[i];
+                uint64_t count = h.count;
+                fprintf( f, "%-24s %-5s %10llu %8llu %12llu %12llu %12llu %12llu %12llu\n",
+                         command, phase_names[i],
+                         (unsigned long long)count, (unsigned long long)errors,
+                         (unsigned long long)(count ? h.sum / count : 0),
+                         (unsigned long long)h.percentile(0.50),
+                         (unsigned long long)h.percentile(0.90),
+                         (unsigned long long)h.percentile(0.99),
+                         (unsigned long long)h.max );
+            }
+        }
+    };
+
+}
+
+/**
+ * Write the table as text, replacing the file in one step so readers
+ * never see half of it.  Times are in nanoseconds.
+ */
+bool
+LatencyTable::dump( const char *path ) {
+    char temporary[256];
+    snprintf( temporary, sizeof(temporary), "%s.tmp", path );
+    FILE *f = fopen( temporary, "w" );
+    if ( f == NULL ) {
+        syslog( LOG_WARNING, "could not write '%s': %s", temporary, strerror(errno) );
+        return false;
+    }
+    fprintf( f, "%-24s %-5s %10s %8s %12s %12s %12s %12s %12s\n",
+             "command", "phase", "count", "errors", "mean", "p50", "p90", "p99", "max" );
+    LatencyWriter writer( f );
+    report( &writer );
+    fclose( f );
+    if ( rename(temporary, path) < 0 ) {
+        syslog( LOG_WARNING, "could not rename '%s': %s", temporary, strerror(errno) );
+        return false;
+    }
+    return true;
+}
+
+/* vim: set autoindent expandtab sw=4 : */
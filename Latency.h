@@ -0,0 +1,100 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file Latency.h
+ * \brief Latency histograms kept per command
+ */
+
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * Counts of durations in buckets four to each power of two, so a
+ * bucket is within a fifth of the durations in it.  Recording is a few
+ * atomic adds and may happen from any thread.
+ */
+class LatencyHistogram {
+public:
+    static const int bucket_count = 4 * 40;
+    uint64_t buckets[bucket_count];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+
+    void record( uint64_t );
+    uint64_t percentile( double ) const;
+    static int bucket( uint64_t );
+    static uint64_t bound( int );
+};
+
+/**
+ * Called once for each command a LatencyTable has seen.
+ */
+class LatencyInjector {
+public:
+    LatencyInjector() {}
+    virtual ~LatencyInjector() {}
+    virtual void operator () ( const char *command, uint64_t errors, const LatencyHistogram *phases ) = 0;
+};
+
+/**
+ * How long requests spent waiting for a worker, being evaluated and
+ * being sent back, kept separately for each command.  A request's
+ * command is its first word.
+ *
+ * Commands are added to a fixed table under a lock and found again
+ * without one.  Once the table is full, new commands share an entry
+ * named "(other)".
+ */
+class LatencyTable {
+public:
+    enum Phase { queue, eval, send, phase_count };
+private:
+    static const int capacity = 256;
+    static const int name_length = 48;
+    struct Entry {
+        uint32_t used;
+        char name[name_length];
+        uint64_t errors;
+        LatencyHistogram phases[phase_count];
+    };
+    Entry *entries;
+    int count;
+    pthread_mutex_t lock;
+
+    Entry *lookup( const char *, int );
+public:
+    LatencyTable();
+    ~LatencyTable();
+    void record( const char *, int, const uint64_t * );
+    void report( LatencyInjector * );
+    void reset();
+    bool dump( const char * );
+};
+
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
@@ -26,8 +26,16 @@
  */
 
 #include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <unistd.h>
+#include <string.h>
 #include <stdio.h>
 
+#include "Thread.h"
+#include "PlatformThread.h"
+
 /**
  */
 void
@@ -46,4 +54,54 @@ set_thread_name( const char *newname ) {
     prctl( PR_SET_NAME, newname );
 }
 
+/**
+ */
+bool
+set_thread_affinity( pthread_t thread, const uint64_t *mask ) {
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    int cpus = Thread::cpu_words * 64;
+    if ( cpus > CPU_SETSIZE )  cpus = CPU_SETSIZE;
+    if ( mask == NULL ) {
+        int configured = sysconf( _SC_NPROCESSORS_CONF );
+        if ( configured > 0 && configured < cpus )  cpus = configured;
+    }
+    for ( int cpu = 0 ; cpu < cpus ; cpu++ ) {
+        if ( mask == NULL || (mask[cpu / 64] & (1ULL << (cpu % 64))) )  CPU_SET( cpu, &set );
+    }
+    return pthread_setaffinity_np( thread, sizeof(set), &set ) == 0;
+}
+
+/**
+ */
+bool
+get_thread_affinity( pthread_t thread, uint64_t *mask ) {
+    cpu_set_t set;
+    if ( pthread_getaffinity_np(thread, sizeof(set), &set) != 0 )  return false;
+    memset( mask, 0, Thread::cpu_words * sizeof(uint64_t) );
+    int cpus = Thread::cpu_words * 64;
+    if ( cpus > CPU_SETSIZE )  cpus = CPU_SETSIZE;
+    for ( int cpu = 0 ; cpu < cpus ; cpu++ ) {
+        if ( CPU_ISSET(cpu, &set) )  mask[cpu / 64] |= 1ULL << (cpu % 64);
+    }
+    return true;
+}
+
+/**
+ * Binds the calling thread's future allocations to one node, without
+ * needing libnuma.  The kernel counts one more node than it reads.
+ */
+bool
+set_thread_memory_node( int node ) {
+    if ( node < 0 ) {
+        return syscall( SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0 ) == 0;
+    }
+    unsigned long nodes[16];
+    int bits = sizeof(unsigned long) * 8;
+    if ( node >= (int)(sizeof(nodes) * 8) )  return false;
+    memset( nodes, 0, sizeof(nodes) );
+    nodes[node / bits] = 1UL << (node % bits);
+    return syscall( SYS_set_mempolicy, MPOL_BIND, nodes, sizeof(nodes) * 8 + 1 ) == 0;
+}
+
 /* vim: set autoindent expandtab sw=4 : */
@@ -0,0 +1,254 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file Liveness.cc
+ * \brief Track whether peer processes are still running
+ *
+ * Peers are kept in an open addressed table keyed by pid, with the
+ * pidfd that watches each one.  Lookups happen on every request, from
+ * the service thread and the workers; inserts and removals are rare, so
+ * one lock covers the table.
+ */
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <stdint.h>
+
+#include "Liveness.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+namespace {
+
+    int
+    pidfd_open( pid_t pid ) {
+        return syscall( SYS_pidfd_open, pid, 0 );
+    }
+
+    unsigned int
+    slot_for( pid_t pid, unsigned int capacity ) {
+        return ((unsigned int)pid * 2654435761u) & (capacity - 1);
+    }
+
+}
+
+/**
+ */
+Liveness::Liveness( const char *name, LivenessReaper *reaper )
+: Thread(name), capacity(1024), count(0), fallback(false), reaper(reaper) {
+    pthread_mutex_init( &lock, NULL );
+    table = (Entry *)calloc( capacity, sizeof(Entry) );
+    poller = epoll_create1( EPOLL_CLOEXEC );
+    if ( poller < 0 ) {
+        syslog( LOG_ERR, "liveness tracker has no epoll: %s", strerror(errno) );
+        fallback = true;
+    }
+}
+
+/**
+ */
+Liveness::~Liveness() {
+    for ( unsigned int i = 0 ; i < capacity ; i++ ) {
+        if ( table[i].pid != 0 )  close( table[i].fd );
+    }
+    free( table );
+    if ( poller >= 0 )  close( poller );
+}
+
+/**
+ * Call with the lock held.
+ */
+Liveness::Entry *
+Liveness::find( pid_t pid ) {
+    for ( unsigned int i = slot_for(pid, capacity) ; ; i = (i + 1) & (capacity - 1) ) {
+        if ( table[i].pid == pid )  return &table[i];
+        if ( table[i].pid == 0 )  return NULL;
+    }
+}
+
+/**
+ * Call with the lock held.  The table is kept at most half full.
+ */
+void
+Liveness::insert( pid_t pid, int fd ) {
+    if ( (count + 1) * 2 > capacity )  grow();
+    unsigned int i = slot_for( pid, capacity );
+    while ( table[i].pid != 0 )  i = (i + 1) & (capacity - 1);
+    table[i].pid = pid;
+    table[i].fd = fd;
+    count++;
+}
+
+/**
+ * Call with the lock held.  Entries after the removed one are shifted
+ * back, so lookups never need tombstones.
+ */
+void
+Liveness::remove( Entry *entry ) {
+    unsigned int hole = entry - table;
+    unsigned int i = hole;
+    for (;;) {
+        i = (i + 1) & (capacity - 1);
+        if ( table[i].pid == 0 )  break;
+        unsigned int home = slot_for( table[i].pid, capacity );
+        if ( ((i - home) & (capacity - 1)) >= ((i - hole) & (capacity - 1)) ) {
+            table[hole] = table[i];
+            hole = i;
+        }
+    }
+    table[hole].pid = 0;
+    table[hole].fd = -1;
+    count--;
+}
+
+/**
+ */
+void
+Liveness::grow() {
+    Entry *old = table;
+    unsigned int old_capacity = capacity;
+    capacity *= 2;
+    table = (Entry *)calloc( capacity, sizeof(Entry) );
+    count = 0;
+    for ( unsigned int i = 0 ; i < old_capacity ; i++ ) {
+        if ( old[i].pid != 0 )  insert( old[i].pid, old[i].fd );
+    }
+    free( old );
+}
+
+/**
+ * A peer not seen before costs a pidfd_open(); after that this is a
+ * table lookup.
+ */
+bool
+Liveness::alive( pid_t pid ) {
+    if ( pid <= 0 )  return false;
+    if ( fallback )  return (::kill(pid, 0) == 0) || (errno == EPERM);
+
+    pthread_mutex_lock( &lock );
+    bool found = find( pid ) != NULL;
+    pthread_mutex_unlock( &lock );
+    if ( found )  return true;
+
+    int fd = pidfd_open( pid );
+    if ( fd < 0 ) {
+        if ( errno == ESRCH )  return false;
+        if ( errno == ENOSYS ) {
+            syslog( LOG_NOTICE, "no pidfd_open, liveness falls back to kill()" );
+            fallback = true;
+        }
+        return (::kill(pid, 0) == 0) || (errno == EPERM);
+    }
+
+    /**
+     * An exited process that has not been waited for still has a pid,
+     * but its pidfd is already readable.
+     */
+    struct pollfd exited = { fd, POLLIN, 0 };
+    if ( poll(&exited, 1, 0) > 0 ) {
+        close( fd );
+        return false;
+    }
+
+    pthread_mutex_lock( &lock );
+    if ( find(pid) != NULL ) {
+        pthread_mutex_unlock( &lock );
+        close( fd );
+        return true;
+    }
+    insert( pid, fd );
+    struct epoll_event event;
+    memset( &event, 0, sizeof(event) );
+    event.events = EPOLLIN;
+    event.data.u64 = ((uint64_t)(uint32_t)fd << 32) | (uint32_t)pid;
+    epoll_ctl( poller, EPOLL_CTL_ADD, fd, &event );
+    pthread_mutex_unlock( &lock );
+    return true;
+}
+
+/**
+ */
+unsigned int
+Liveness::tracked() {
+    pthread_mutex_lock( &lock );
+    unsigned int result = count;
+    pthread_mutex_unlock( &lock );
+    return result;
+}
+
+/**
+ * A pidfd becomes readable when its process exits.  The event carries
+ * the descriptor as well as the pid, so an exit is not confused with a
+ * later process given the same pid.
+ */
+void
+Liveness::run() {
+    if ( fallback )  return;
+
+    struct epoll_event events[64];
+    for (;;) {
+        int ready = epoll_wait( poller, events, 64, -1 );
+        if ( ready < 0 ) {
+            if ( errno == EINTR )  continue;
+            syslog( LOG_ERR, "liveness epoll_wait failed: %s", strerror(errno) );
+            return;
+        }
+        for ( int i = 0 ; i < ready ; i++ ) {
+            pid_t pid = (pid_t)(events[i].data.u64 & 0xffffffff);
+            int fd = (int)(events[i].data.u64 >> 32);
+
+            pthread_mutex_lock( &lock );
+            Entry *entry = find( pid );
+            bool exited = entry != NULL && entry->fd == fd;
+            if ( exited ) {
+                epoll_ctl( poller, EPOLL_CTL_DEL, fd, NULL );
+                close( fd );
+                remove( entry );
+            }
+            pthread_mutex_unlock( &lock );
+
+            if ( exited && reaper != NULL )  (*reaper)( pid );
+        }
+    }
+}
+
+/**
+ */
+void
+Liveness::stats( ThreadStatsInjector *injector ) {
+    ThreadStatsInjector& f = *injector;
+    Thread::stats( injector );
+    f( "tracked", tracked() );
+}
+
+/* vim: set autoindent expandtab sw=4 : */
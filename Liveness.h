@@ -0,0 +1,81 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file Liveness.h
+ * \brief Track whether peer processes are still running
+ */
+
+#ifndef _LIVENESS_H_
+#define _LIVENESS_H_
+
+#include <sys/types.h>
+#include <pthread.h>
+#include "Thread.h"
+
+/**
+ * Called on the tracker's thread once for each peer that exits.
+ */
+class LivenessReaper {
+public:
+    LivenessReaper() {}
+    virtual ~LivenessReaper() {}
+    virtual void operator () ( pid_t ) = 0;
+};
+
+/**
+ * The first time a peer is asked about, the tracker opens a pidfd for
+ * it and adds that to an epoll set.  After that, alive() is a lookup in
+ * a table of running peers, and the thread drops a peer from the table
+ * and calls the reaper as soon as it exits.
+ *
+ * On a kernel without pidfd_open() alive() falls back to kill().
+ */
+class Liveness : public Thread {
+    struct Entry {
+        pid_t pid;
+        int fd;
+    };
+    pthread_mutex_t lock;
+    Entry *table;
+    unsigned int capacity;
+    unsigned int count;
+    int poller;
+    bool fallback;
+    LivenessReaper *reaper;
+
+    Entry *find( pid_t );
+    void insert( pid_t, int );
+    void remove( Entry * );
+    void grow();
+public:
+    Liveness( const char *, LivenessReaper * = NULL );
+    virtual ~Liveness();
+    bool alive( pid_t );
+    unsigned int tracked();
+    virtual void run();
+    virtual void stats( ThreadStatsInjector * );
+};
+
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
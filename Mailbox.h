@@ -0,0 +1,89 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file Mailbox.h
+ * \brief The message queue a Thread reads
+ */
+
+#ifndef _MAILBOX_H_
+#define _MAILBOX_H_
+
+#include "Queue.h"
+#include "Ring.h"
+
+/**
+ * A shared mailbox may be written and read by any number of threads.  A
+ * single mailbox is for one writer and one reader, and is cheaper when
+ * that is all a thread needs.
+ *
+ * Both are bounded: once a mailbox holds 1024 messages, enqueue()
+ * blocks the sender until the reader catches up.
+ */
+class Mailbox {
+public:
+    enum Kind { shared, single };
+
+    Mailbox() {}
+    virtual ~Mailbox() {}
+    virtual void enqueue( void * ) = 0;
+    virtual void *dequeue() = 0;
+    virtual void wait() = 0;
+    virtual int depth() = 0;
+    virtual bool empty() = 0;
+
+    static Mailbox *create( Kind );
+};
+
+/**
+ */
+class SharedMailbox : public Mailbox {
+    Queue queue;
+public:
+    virtual void enqueue( void *message ) { queue.enqueue( message ); }
+    virtual void *dequeue() { return queue.dequeue(); }
+    virtual void wait() { queue.wait(); }
+    virtual int depth() { return queue.depth(); }
+    virtual bool empty() { return queue.empty(); }
+};
+
+/**
+ */
+class SingleMailbox : public Mailbox {
+    Ring<void *> ring;
+public:
+    virtual void enqueue( void *message ) { ring.push( message ); }
+    virtual void *dequeue() { return ring.pop(); }
+    virtual void wait() { ring.wait(); }
+    virtual int depth() { return ring.depth(); }
+    virtual bool empty() { return ring.empty(); }
+};
+
+inline Mailbox *
+Mailbox::create( Kind kind ) {
+    if ( kind == single )  return new SingleMailbox;
+    return new SharedMailbox;
+}
+
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
@@ -25,7 +25,20 @@
  * \brief 
  */
 
+#include <stdint.h>
+#include <pthread.h>
+
 extern void set_main_thread_name();
 extern void set_thread_name( const char * );
 
+/**
+ * The masks are Thread::cpu_words words, one bit per CPU, and a NULL
+ * mask sets every CPU the system has configured.  The memory
+ * node is set for the calling thread; a negative node restores the
+ * default policy.  Each returns false where unsupported.
+ */
+extern bool set_thread_affinity( pthread_t, const uint64_t * );
+extern bool get_thread_affinity( pthread_t, uint64_t * );
+extern bool set_thread_memory_node( int );
+
 /* vim: set autoindent expandtab sw=4 : */
@@ -22,110 +22,220 @@
  */
 
 /** \file Queue.h
- * \brief Simple queue
+ * \brief Bounded lock-free message queue
+ *
+ * A ring of cells, each stamped with a sequence number that says whether
+ * it is free for the producer of a position or ready for its consumer
+ * (Dmitry Vyukov's bounded MPMC queue).  Producers and consumers only
+ * contend on a compare-and-swap of their own position.
+ *
+ * Threads that must block sleep on a futex, see Waiters.
  */
 
 #ifndef _QUEUE_H_
 #define _QUEUE_H_
 
-#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "Futex.h"
 
 class Queue {
-    class Entry {
-    public:
-        Entry *next, *previous;
+    struct Cell {
+        size_t sequence;
         void *message;
-        pthread_mutex_t lock;
-    
-        Entry() : message(0) {
-            pthread_mutex_init( &lock, NULL );
-            next = this;
-            previous = this;
-        }
-    
-        Entry( void *data ) {
-            pthread_mutex_init( &lock, NULL );
-            next = this;
-            previous = this;
-            message = data;
-        }
-    
-        void insert( Entry *entry ) {
-            pthread_mutex_lock( &lock );
-            entry->next = next;
-            entry->previous = this;
-            next->previous = entry;
-            next = entry;
-            pthread_mutex_unlock( &lock );
-        }
-    
-        Entry *remove() {
-            pthread_mutex_lock( &lock );
-            Entry *entry = previous;
-            previous = entry->previous;
-            previous->next = this;
-            pthread_mutex_unlock( &lock );
-            return entry;
+    };
+
+    static const size_t default_capacity = 1024;
+
+    Cell *cells;
+    size_t mask;
+    char pad0[64];
+    size_t enqueue_position;
+    char pad1[64];
+    size_t dequeue_position;
+    char pad2[64];
+    Waiters consumers;
+    Waiters producers;
+
+    Queue( const Queue& );
+    Queue& operator = ( const Queue& );
+
+    /**
+     * Claim up to n consecutive free cells with one compare-and-swap and
+     * fill them.  A free cell cannot be taken by anyone else until the
+     * enqueue position moves past it, so checking the cells and then
+     * moving the position is safe.
+     */
+    int try_enqueue_n( void **messages, int n ) {
+        size_t position = __atomic_load_n( &enqueue_position, __ATOMIC_RELAXED );
+        for (;;) {
+            int count = 0;
+            while ( count < n ) {
+                Cell& cell = cells[ (position + count) & mask ];
+                size_t sequence = __atomic_load_n( &cell.sequence, __ATOMIC_ACQUIRE );
+                if ( sequence != position + count )  break;
+                count++;
+            }
+            if ( count == 0 ) {
+                Cell& cell = cells[ position & mask ];
+                intptr_t lag = __atomic_load_n(&cell.sequence, __ATOMIC_ACQUIRE) - position;
+                if ( lag < 0 )  return 0;
+                position = __atomic_load_n( &enqueue_position, __ATOMIC_RELAXED );
+                continue;
+            }
+            if ( __atomic_compare_exchange_n(&enqueue_position, &position, position + count,
+                                             true, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) {
+                for ( int i = 0 ; i < count ; i++ ) {
+                    Cell& cell = cells[ (position + i) & mask ];
+                    cell.message = messages[i];
+                    __atomic_store_n( &cell.sequence, position + i + 1, __ATOMIC_RELEASE );
+                }
+                consumers.wake();
+                return count;
+            }
         }
-        bool empty() {
-            return (next == this);
+    }
+
+    /**
+     * The same for up to n consecutive ready cells.
+     */
+    int try_dequeue_n( void **messages, int n ) {
+        size_t position = __atomic_load_n( &dequeue_position, __ATOMIC_RELAXED );
+        for (;;) {
+            int count = 0;
+            while ( count < n ) {
+                Cell& cell = cells[ (position + count) & mask ];
+                size_t sequence = __atomic_load_n( &cell.sequence, __ATOMIC_ACQUIRE );
+                if ( sequence != position + count + 1 )  break;
+                count++;
+            }
+            if ( count == 0 ) {
+                Cell& cell = cells[ position & mask ];
+                intptr_t lag = __atomic_load_n(&cell.sequence, __ATOMIC_ACQUIRE) - (position + 1);
+                if ( lag < 0 )  return 0;
+                position = __atomic_load_n( &dequeue_position, __ATOMIC_RELAXED );
+                continue;
+            }
+            if ( __atomic_compare_exchange_n(&dequeue_position, &position, position + count,
+                                             true, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) {
+                for ( int i = 0 ; i < count ; i++ ) {
+                    Cell& cell = cells[ (position + i) & mask ];
+                    messages[i] = cell.message;
+                    __atomic_store_n( &cell.sequence, position + i + mask + 1, __ATOMIC_RELEASE );
+                }
+                producers.wake();
+                return count;
+            }
         }
-    };
-    
-    pthread_cond_t messages;
-    pthread_mutex_t messages_lock;
-    Entry freelist;
-    Entry head;
-    Entry *allocate( void *data ) {
-        if ( freelist.empty() )  return new Entry( data );
-        Entry *entry = freelist.remove();
-        entry->message = data;
-        return entry;
     }
-    
+
 public:
-    Queue() {
-        pthread_cond_init( &messages, NULL );
-        pthread_mutex_init( &messages_lock, NULL );
+    /**
+     * The capacity is rounded up to a power of two.
+     */
+    Queue( size_t capacity = default_capacity )
+    : enqueue_position(0), dequeue_position(0) {
+        size_t size = 2;
+        while ( size < capacity )  size <<= 1;
+        mask = size - 1;
+        cells = new Cell[size];
+        for ( size_t i = 0 ; i < size ; i++ ) {
+            cells[i].sequence = i;
+            cells[i].message = 0;
+        }
+    }
+    ~Queue() {
+        delete [] cells;
     }
+
+    /**
+     * Blocks while the queue is full.
+     */
     void enqueue( void *data ) {
-        Entry *entry = allocate( data );
-        head.insert( entry );
-        pthread_mutex_lock( &messages_lock );
-        pthread_cond_signal( &messages );
-        pthread_mutex_unlock( &messages_lock );
+        while ( try_enqueue_n(&data, 1) == 0 ) {
+            producers.block( this, &Queue::full, false );
+        }
+    }
+
+    /**
+     * Enqueue all n messages in order, in as few batches as the free
+     * space allows.
+     */
+    void enqueue_n( void **messages, int n ) {
+        while ( n > 0 ) {
+            int count = try_enqueue_n( messages, n );
+            if ( count == 0 ) {
+                producers.block( this, &Queue::full, false );
+                continue;
+            }
+            messages += count;
+            n -= count;
+        }
+    }
+
+    bool try_enqueue( void *data ) {
+        return try_enqueue_n( &data, 1 ) == 1;
     }
-    
+
+    /**
+     * Blocks while the queue is empty.
+     */
     void *dequeue() {
-        Entry *entry = head.remove();
-        void *data = entry->message;
-        freelist.insert( entry );
+        void *data;
+        while ( try_dequeue_n(&data, 1) == 0 ) {
+            consumers.block( this, &Queue::empty, false );
+        }
         return data;
     }
-    
-    void wait() {
-        pthread_mutex_lock( &messages_lock );
-        while ( empty() ) {
-            pthread_cond_wait( &messages, &messages_lock );
+
+    /**
+     * Wait for at least one message and take up to n.  Returns the
+     * number taken.
+     */
+    int dequeue_n( void **messages, int n ) {
+        if ( n <= 0 )  return 0;
+        int count;
+        while ( (count = try_dequeue_n(messages, n)) == 0 ) {
+            consumers.block( this, &Queue::empty, false );
         }
-        pthread_mutex_unlock( &messages_lock );
+        return count;
+    }
+
+    bool try_dequeue( void **data ) {
+        return try_dequeue_n( data, 1 ) == 1;
     }
-    
+
+    void wait() {
+        consumers.block( this, &Queue::empty, false );
+    }
+
+    /**
+     * Messages enqueued and not yet dequeued.  A message still being
+     * written by its producer is counted.
+     */
     int depth() {
-        int depth = 0;
-        pthread_mutex_lock( &messages_lock );
-        Entry *dot = head.next;
-        while ( dot != &head ) {
-            depth++;
-            dot = dot->next;
-        }
-        pthread_mutex_unlock( &messages_lock );
-        return depth;
+        size_t tail = __atomic_load_n( &dequeue_position, __ATOMIC_RELAXED );
+        size_t head = __atomic_load_n( &enqueue_position, __ATOMIC_RELAXED );
+        intptr_t depth = head - tail;
+        return (depth < 0) ? 0 : depth;
     }
-    
+
+    /**
+     * True when the next message has not been published.
+     */
     bool empty() {
-        return head.empty();
+        size_t position = __atomic_load_n( &dequeue_position, __ATOMIC_RELAXED );
+        Cell& cell = cells[ position & mask ];
+        return __atomic_load_n( &cell.sequence, __ATOMIC_ACQUIRE ) != position + 1;
+    }
+
+    bool full() {
+        size_t position = __atomic_load_n( &enqueue_position, __ATOMIC_RELAXED );
+        Cell& cell = cells[ position & mask ];
+        return __atomic_load_n( &cell.sequence, __ATOMIC_ACQUIRE ) != position;
     }
+
+    size_t capacity() const { return mask + 1; }
 };
 #endif
 
@@ -0,0 +1,143 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file Ring.h
+ * \brief Single producer, single consumer ring
+ *
+ * For a queue with exactly one thread writing and one thread reading.
+ * Each side owns its index and only publishes it with a release store,
+ * so there is no compare-and-swap, and each keeps a cached copy of the
+ * other side's index so it only reads the shared cache line when the
+ * ring looks full or empty.
+ */
+
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stddef.h>
+#include "Futex.h"
+
+template <class T>
+class Ring {
+    static const size_t default_capacity = 1024;
+
+    T *slots;
+    size_t mask;
+    char pad0[64];
+    size_t head;
+    size_t tail_cache;
+    char pad1[64];
+    size_t tail;
+    size_t head_cache;
+    char pad2[64];
+    Waiters consumer;
+    char pad3[64];
+    Waiters producer;
+    char pad4[64];
+
+    Ring( const Ring& );
+    Ring& operator = ( const Ring& );
+
+public:
+    /**
+     * The capacity is rounded up to a power of two.
+     */
+    Ring( size_t capacity = default_capacity )
+    : head(0), tail_cache(0), tail(0), head_cache(0) {
+        size_t size = 2;
+        while ( size < capacity )  size <<= 1;
+        mask = size - 1;
+        slots = new T[size];
+    }
+    ~Ring() {
+        delete [] slots;
+    }
+
+    /**
+     * Producer side only.
+     */
+    bool try_push( const T& value ) {
+        size_t position = tail;
+        if ( position - head_cache > mask ) {
+            head_cache = __atomic_load_n( &head, __ATOMIC_ACQUIRE );
+            if ( position - head_cache > mask )  return false;
+        }
+        slots[ position & mask ] = value;
+        __atomic_store_n( &tail, position + 1, __ATOMIC_RELEASE );
+        consumer.wake();
+        return true;
+    }
+
+    void push( const T& value ) {
+        while ( try_push(value) == false ) {
+            producer.block( this, &Ring::full, false );
+        }
+    }
+
+    /**
+     * Consumer side only.
+     */
+    bool try_pop( T *value ) {
+        size_t position = head;
+        if ( position == tail_cache ) {
+            tail_cache = __atomic_load_n( &tail, __ATOMIC_ACQUIRE );
+            if ( position == tail_cache )  return false;
+        }
+        *value = slots[ position & mask ];
+        __atomic_store_n( &head, position + 1, __ATOMIC_RELEASE );
+        producer.wake();
+        return true;
+    }
+
+    T pop() {
+        T value;
+        while ( try_pop(&value) == false ) {
+            consumer.block( this, &Ring::empty, false );
+        }
+        return value;
+    }
+
+    void wait() {
+        consumer.block( this, &Ring::empty, false );
+    }
+
+    int depth() {
+        size_t first = __atomic_load_n( &head, __ATOMIC_ACQUIRE );
+        size_t last = __atomic_load_n( &tail, __ATOMIC_ACQUIRE );
+        return last - first;
+    }
+
+    bool empty() {
+        return __atomic_load_n(&tail, __ATOMIC_ACQUIRE) == __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    }
+
+    bool full() {
+        return __atomic_load_n(&tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&head, __ATOMIC_ACQUIRE) > mask;
+    }
+
+    size_t capacity() const { return mask + 1; }
+};
+
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
@@ -0,0 +1,168 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file ScriptCache.cc
+ * \brief Keep the Tcl_Obj for each recent request so its bytecode is reused
+ *
+ * Entries are chained in a hash table by request text and kind, and
+ * linked newest to oldest for eviction.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ScriptCache.h"
+
+namespace {
+
+    unsigned int
+    hash( const char *text, int length, int kind ) {
+        unsigned int result = 2166136261u ^ (unsigned int)kind;
+        for ( int i = 0 ; i < length ; i++ ) {
+            result ^= (unsigned char)text[i];
+            result *= 16777619u;
+        }
+        return result;
+    }
+
+}
+
+/**
+ */
+ScriptCache::ScriptCache( int capacity )
+: buckets(NULL), bucket_count(0), count(0), capacity(0),
+  newest(NULL), oldest(NULL), _hits(0), _misses(0) {
+    resize( capacity );
+}
+
+/**
+ */
+ScriptCache::~ScriptCache() {
+    while ( oldest != NULL )  evict();
+    free( buckets );
+}
+
+/**
+ * Take an entry off the age list, but leave it in its hash chain.
+ */
+void
+ScriptCache::unlink( Entry *entry ) {
+    if ( entry->newer != NULL )  entry->newer->older = entry->older;
+    else                         newest = entry->older;
+    if ( entry->older != NULL )  entry->older->newer = entry->newer;
+    else                         oldest = entry->newer;
+    entry->newer = entry->older = NULL;
+}
+
+/**
+ */
+void
+ScriptCache::evict() {
+    Entry *entry = oldest;
+    unlink( entry );
+    Entry **link = &buckets[ entry->hash & (bucket_count - 1) ];
+    while ( *link != entry )  link = &(*link)->chain;
+    *link = entry->chain;
+    Tcl_DecrRefCount( entry->script );
+    free( entry );
+    count--;
+}
+
+/**
+ * Change how many requests are kept.  Zero turns the cache off.  The
+ * table keeps at most one entry per bucket on average.
+ */
+void
+ScriptCache::resize( int new_capacity ) {
+    if ( new_capacity < 0 )  new_capacity = 0;
+    if ( new_capacity == capacity && buckets != NULL )  return;
+    capacity = new_capacity;
+    while ( count > capacity )  evict();
+
+    unsigned int wanted = 16;
+    while ( wanted < (unsigned int)capacity )  wanted <<= 1;
+    if ( wanted == bucket_count )  return;
+
+    Entry **table = (Entry **)calloc( wanted, sizeof(Entry *) );
+    for ( Entry *entry = oldest ; entry != NULL ; entry = entry->newer ) {
+        Entry **bucket = &table[ entry->hash & (wanted - 1) ];
+        entry->chain = *bucket;
+        *bucket = entry;
+    }
+    free( buckets );
+    buckets = table;
+    bucket_count = wanted;
+}
+
+/**
+ * Return the object for a request, with a reference held for the
+ * caller, who must release it once it has been evaluated.  The cache
+ * holds its own reference, so the object may be evicted meanwhile.
+ */
+Tcl_Obj *
+ScriptCache::lookup( const char *text, int kind ) {
+    int length = strlen( text );
+    unsigned int h = hash( text, length, kind );
+
+    Entry **bucket = &buckets[ h & (bucket_count - 1) ];
+    for ( Entry *entry = *bucket ; entry != NULL ; entry = entry->chain ) {
+        if ( entry->hash != h || entry->kind != kind )  continue;
+        int size;
+        const char *cached = Tcl_GetStringFromObj( entry->script, &size );
+        if ( size != length || memcmp(cached, text, length) != 0 )  continue;
+        _hits++;
+        if ( entry != newest ) {
+            unlink( entry );
+            entry->older = newest;
+            if ( newest != NULL )  newest->newer = entry;
+            newest = entry;
+            if ( oldest == NULL )  oldest = entry;
+        }
+        Tcl_IncrRefCount( entry->script );
+        return entry->script;
+    }
+
+    _misses++;
+    Tcl_Obj *script = Tcl_NewStringObj( text, length );
+    Tcl_IncrRefCount( script );
+    if ( capacity == 0 )  return script;
+
+    if ( count >= capacity )  evict();
+    Entry *entry = (Entry *)malloc( sizeof(Entry) );
+    entry->script = script;
+    entry->kind = kind;
+    entry->hash = h;
+    entry->chain = *bucket;
+    *bucket = entry;
+    entry->newer = NULL;
+    entry->older = newest;
+    if ( newest != NULL )  newest->newer = entry;
+    newest = entry;
+    if ( oldest == NULL )  oldest = entry;
+    count++;
+
+    Tcl_IncrRefCount( script );
+    return script;
+}
+
+/* vim: set autoindent expandtab sw=4 : */
@@ -0,0 +1,73 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file ScriptCache.h
+ * \brief Keep the Tcl_Obj for each recent request so its bytecode is reused
+ */
+
+#ifndef _SCRIPT_CACHE_H_
+#define _SCRIPT_CACHE_H_
+
+#include <stdint.h>
+#include <tcl.h>
+
+/**
+ * The least recently used requests, each kept as the Tcl_Obj that was
+ * evaluated for it.  Tcl keeps a script's bytecode, or a command's
+ * list, in the object, so a request sent again is not parsed again.
+ *
+ * Tcl objects belong to one interpreter's thread, so each worker has
+ * its own cache.
+ */
+class ScriptCache {
+    struct Entry {
+        Tcl_Obj *script;
+        int kind;
+        unsigned int hash;
+        Entry *chain;
+        Entry *newer, *older;
+    };
+    Entry **buckets;
+    unsigned int bucket_count;
+    int count;
+    int capacity;
+    Entry *newest, *oldest;
+    uint64_t _hits, _misses;
+
+    ScriptCache( const ScriptCache& );
+    ScriptCache& operator = ( const ScriptCache& );
+    void unlink( Entry * );
+    void evict();
+public:
+    ScriptCache( int );
+    ~ScriptCache();
+    Tcl_Obj *lookup( const char *, int );
+    void resize( int );
+    int size() const { return count; }
+    uint64_t hits() const { return _hits; }
+    uint64_t misses() const { return _misses; }
+};
+
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
@@ -16,6 +16,8 @@
 #include <sys/msg.h>
 
 #include <signal.h>
+#include <stdint.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -29,12 +31,17 @@
 #include "TCL_Fixup.h"
 
 #include "util.h"
+#include "Allocator.h"
 #include "Service.h"
+#include "ChannelFrame.h"
 #include "AppInit.h"
 
 /**
  */
-Service::Service( const char *_service_name ) : Thread("service") {
+Service::Service( const char *_service_name )
+: Thread("service"), transport(Channel::msgq), request_arena(0), stats_interval(0), script_cache(256), argc(0), argv(NULL), worker_count(1),
+  workers(NULL), pending(NULL), idle(NULL), setup(NULL), setup_tail(&setup) {
+    pthread_mutex_init( &setup_lock, NULL );
     service_name = strdup( _service_name );
     char buffer[1024];
     sprintf( buffer, "%s.service", service_name );
@@ -57,6 +64,24 @@ Service::set_facility( int syslog_facility ) {
     facility = syslog_facility;
 }
 
+/**
+ * Choose how clients reach the service.  Must be called before
+ * initialize().
+ */
+void
+Service::set_transport( Channel::Kind kind ) {
+    transport = kind;
+}
+
+/**
+ * The number of interpreters evaluating requests.  Takes effect when the
+ * service is started.
+ */
+void
+Service::set_workers( int count ) {
+    worker_count = count;
+}
+
 /**
  */
 Tcl_CmdInfo putsObjCmd;
@@ -188,6 +213,24 @@ static Tcl_Interp* create_tcl_interp( int argc, char **argv ) {
     return interp;
 }
 
+/**
+ * Read the service configuration script and define the helper procs.
+ * Every worker interpreter is configured the same way.
+ */
+static void
+configure_interp( Tcl_Interp *interp, const char *service_name ) {
+    char buffer[1024];
+    sprintf( buffer, "/etc/%s/%s.conf", service_name, service_name );
+    if ( access(buffer, R_OK) == 0 ) {
+        if ( Tcl_EvalFile(interp, buffer) == TCL_ERROR ) {
+            syslog( LOG_ERR, "Failed to read %s initialization: %s", service_name, Tcl_GetStringResult(interp) );
+        }
+    }
+
+    Tcl_EvalEx( interp, "proc clock {command} { namespace eval ::tcl::clock $command}", -1, TCL_EVAL_GLOBAL );
+    Tcl_EvalEx( interp, "proc commands {} {namespace eval commands {info procs}}", -1, TCL_EVAL_GLOBAL );
+}
+
 /**
  * create the rundir 
  * create the channel
@@ -198,6 +241,8 @@ static Tcl_Interp* create_tcl_interp( int argc, char **argv ) {
  */
 bool
 Service::initialize( int argc, char **argv ) {
+    this->argc = argc;
+    this->argv = argv;
     pid_t my_pid = getpid();
     char buffer[1024];
 
@@ -230,10 +275,10 @@ Service::initialize( int argc, char **argv ) {
      * Create a rundir for this service and chdir to it, so temp files, etc
      * are created in one place.
      */
-    sprintf( buffer, "/var/run/%s", service_name );
-    mkdir( buffer, 0755 );
-    chdir( buffer );
-    channel = new Channel( this );
+    snprintf( rundir, sizeof(rundir), "/var/run/%s", service_name );
+    mkdir( rundir, 0755 );
+    chdir( rundir );
+    channel = new Channel( this, transport );
 
     /** * Enable core dumps for this service.
      *
@@ -271,15 +316,33 @@ Service::initialize( int argc, char **argv ) {
      * service configuration script.
      */
     interp = create_tcl_interp( argc, argv );
-    sprintf( buffer, "/etc/%s/%s.conf", service_name, service_name );
-    if ( access(buffer, R_OK) == 0 ) {
-        if ( Tcl_EvalFile(interp, buffer) == TCL_ERROR ) {
-            syslog( LOG_ERR, "Failed to read %s initialization: %s", service_name, Tcl_GetStringResult(interp) );
-        }
+
+    /**
+     * Service::request_arena may be set by the configuration script, but
+     * only for services whose commands keep no C++ objects from one
+     * request to the next.  Service::workers sets the number of
+     * interpreters; commands must be thread safe when it is above one.
+     * Service::script_cache is how many recent requests each worker
+     * keeps compiled, or zero to compile every request afresh.
+     */
+    if ( Tcl_FindNamespace(interp, "Service", NULL, 0) == NULL ) {
+        Tcl_CreateNamespace( interp, "Service", (ClientData)0, NULL );
+    }
+    if ( Tcl_LinkVar(interp, "Service::request_arena", (char *)&request_arena, TCL_LINK_INT) != TCL_OK ) {
+        syslog( LOG_WARNING, "failed to link Service::request_arena" );
     }
+    if ( Tcl_LinkVar(interp, "Service::workers", (char *)&worker_count, TCL_LINK_INT) != TCL_OK ) {
+        syslog( LOG_WARNING, "failed to link Service::workers" );
+    }
+    if ( Tcl_LinkVar(interp, "Service::stats_interval", (char *)&stats_interval, TCL_LINK_INT) != TCL_OK ) {
+        syslog( LOG_WARNING, "failed to link Service::stats_interval" );
+    }
+    if ( Tcl_LinkVar(interp, "Service::script_cache", (char *)&script_cache, TCL_LINK_INT) != TCL_OK ) {
+        syslog( LOG_WARNING, "failed to link Service::script_cache" );
+    }
+    Tcl_CreateObjCommand( interp, "Service::stats", stats_cmd, (ClientData)this, NULL );
 
-    Tcl_EvalEx( interp, "proc clock {command} { namespace eval ::tcl::clock $command}", -1, TCL_EVAL_GLOBAL );
-    Tcl_EvalEx( interp, "proc commands {} {namespace eval commands {info procs}}", -1, TCL_EVAL_GLOBAL );
+    configure_interp( interp, service_name );
 
     return true;
 }
@@ -289,10 +352,10 @@ Service::initialize( int argc, char **argv ) {
  * services interpreter, a method is provided that the service main routine
  * can call to add application specific commands to the interpreter.
  */
-bool
-Service::add_command( char *cmdName, Tcl_ObjCmdProc *proc, ClientData data ) {
+static bool
+interp_add_command( Tcl_Interp *interp, const char *cmdName, Tcl_ObjCmdProc *proc, ClientData data ) {
     Tcl_Command command;
-    command = Tcl_CreateObjCommand(interp, cmdName, proc, data, NULL);
+    command = Tcl_CreateObjCommand(interp, (char *)cmdName, proc, data, NULL);
     return (command != NULL);
 }
 
@@ -300,8 +363,8 @@ Service::add_command( char *cmdName, Tcl_ObjCmdProc *proc, ClientData data ) {
  * Load a command from a filename.  Use the basename of the file for the
  * command name.
  */
-bool
-Service::load_command( const char *filename ) {
+static bool
+interp_load_command( Tcl_Interp *interp, const char *filename ) {
     const char *name = strrchr(filename, '/');
     name = (name == NULL) ? filename : name+1 ;
 
@@ -318,8 +381,8 @@ Service::load_command( const char *filename ) {
 
 /**
  */
-bool
-Service::load_commands( const char *dir ) {
+static bool
+interp_load_commands( Tcl_Interp *interp, const char *dir ) {
     char pattern[80];
     snprintf( pattern, sizeof(pattern), "%s/*", dir );
 
@@ -332,7 +395,7 @@ Service::load_commands( const char *dir ) {
 
         syslog( LOG_NOTICE, "loading '%s'", filename );
         if ( access(filename, R_OK) == 0 ) {
-            if ( load_command(filename) == false ) {
+            if ( interp_load_command(interp, filename) == false ) {
                 syslog( LOG_WARNING, "error: %s", Tcl_GetStringResult(interp) );
             }
         }
@@ -344,8 +407,8 @@ Service::load_commands( const char *dir ) {
 
 /**
  */
-bool
-Service::load_directory( const char *dir ) {
+static bool
+interp_load_directory( Tcl_Interp *interp, const char *dir ) {
     char pattern[80];
     snprintf( pattern, sizeof(pattern), "%s/*", dir );
 
@@ -370,8 +433,8 @@ Service::load_directory( const char *dir ) {
 
 /**
  */
-bool
-Service::load_file( const char *filename ) {
+static bool
+interp_load_file( Tcl_Interp *interp, const char *filename ) {
     if ( access(filename, R_OK) != 0 ) return false;
     syslog( LOG_NOTICE, "evaluating file '%s'", filename );
     if ( Tcl_EvalFile(interp, filename) != TCL_OK ) {
@@ -383,23 +446,513 @@ Service::load_file( const char *filename ) {
 }
 
 /**
- * A service object is a thread that waits for messages from a Channel, processes
- * them in a TCL interpreter and responds.
+ * Each step of setting up the interpreter is recorded, so the same steps
+ * can be replayed into every worker interpreter.
+ */
+struct Service::Setup {
+    enum Kind { command, command_file, command_dir, directory, file };
+    int kind;
+    char *name;
+    Tcl_ObjCmdProc *proc;
+    ClientData data;
+    Setup *next;
+};
+
+/**
+ */
+void
+Service::record( int kind, const char *name, Tcl_ObjCmdProc *proc, ClientData data ) {
+    Setup *step = new Setup;
+    step->kind = kind;
+    step->name = strdup( name );
+    step->proc = proc;
+    step->data = data;
+    step->next = NULL;
+
+    pthread_mutex_lock( &setup_lock );
+    *setup_tail = step;
+    setup_tail = &step->next;
+    pthread_mutex_unlock( &setup_lock );
+}
+
+/**
+ */
+bool
+Service::add_command( char *cmdName, Tcl_ObjCmdProc *proc, ClientData data ) {
+    record( Setup::command, cmdName, proc, data );
+    return interp_add_command( interp, cmdName, proc, data );
+}
+
+/**
+ */
+bool
+Service::load_command( const char *filename ) {
+    record( Setup::command_file, filename, NULL, NULL );
+    return interp_load_command( interp, filename );
+}
+
+/**
+ */
+bool
+Service::load_commands( const char *dir ) {
+    record( Setup::command_dir, dir, NULL, NULL );
+    return interp_load_commands( interp, dir );
+}
+
+/**
+ */
+bool
+Service::load_directory( const char *dir ) {
+    record( Setup::directory, dir, NULL, NULL );
+    return interp_load_directory( interp, dir );
+}
+
+/**
+ */
+bool
+Service::load_file( const char *filename ) {
+    record( Setup::file, filename, NULL, NULL );
+    return interp_load_file( interp, filename );
+}
+
+/**
+ * Build another interpreter the way the service interpreter was built.
+ * This runs in the worker thread, since a Tcl interpreter must only be
+ * used by the thread that created it.
+ *
+ * The AppInit chain is not written to run concurrently, and the Thread
+ * module points thread_create_hook at each new interpreter, so workers
+ * are built one at a time and the hook is put back afterwards.  New
+ * threads stay registered in the service interpreter.
+ */
+Tcl_Interp *
+Service::create_worker_interp() {
+    pthread_mutex_lock( &setup_lock );
+
+    ThreadCallback *hook = thread_create_hook;
+    Tcl_Interp *worker = create_tcl_interp( argc, argv );
+    if ( thread_create_hook != hook ) {
+        delete thread_create_hook;
+        thread_create_hook = hook;
+    }
+
+    if ( Tcl_FindNamespace(worker, "Service", NULL, 0) == NULL ) {
+        Tcl_CreateNamespace( worker, "Service", (ClientData)0, NULL );
+    }
+    Tcl_CreateObjCommand( worker, "Service::stats", stats_cmd, (ClientData)this, NULL );
+    configure_interp( worker, service_name );
+
+    for ( Setup *step = setup ; step != NULL ; step = step->next ) {
+        switch ( step->kind ) {
+        case Setup::command:
+            interp_add_command( worker, step->name, step->proc, step->data );
+            break;
+        case Setup::command_file:
+            interp_load_command( worker, step->name );
+            break;
+        case Setup::command_dir:
+            interp_load_commands( worker, step->name );
+            break;
+        case Setup::directory:
+            interp_load_directory( worker, step->name );
+            break;
+        case Setup::file:
+            interp_load_file( worker, step->name );
+            break;
+        }
+    }
+
+    pthread_mutex_unlock( &setup_lock );
+    return worker;
+}
+
+/**
+ * A request waiting for, or being evaluated by, a worker.  The body
+ * grows to hold whatever the client sent.
+ */
+struct Service::Request {
+    long sender;
+    uint32_t id;
+    int kind;
+    uint64_t received;
+    ChannelMessage body;
+};
+
+namespace {
+    uint64_t
+    nanoseconds() {
+        struct timespec now;
+        clock_gettime( CLOCK_MONOTONIC, &now );
+        return (now.tv_sec * 1000000000ULL) + now.tv_nsec;
+    }
+
+    /**
+     * Command and frame requests are lists whose words are passed to
+     * the command as they are, with no substitution.
+     */
+    int
+    evaluate( Tcl_Interp *interp, Tcl_Obj *script, int kind ) {
+        if ( kind == REQUEST_SCRIPT )  return Tcl_EvalObjEx( interp, script, TCL_EVAL_GLOBAL );
+        int objc;
+        Tcl_Obj **objv;
+        if ( Tcl_ListObjGetElements(interp, script, &objc, &objv) != TCL_OK )  return TCL_ERROR;
+        return Tcl_EvalObjv( interp, objc, objv, TCL_EVAL_GLOBAL );
+    }
+}
+
+/**
+ * A worker evaluates requests in its own interpreter.  Worker 0 uses the
+ * service interpreter; the others build theirs when they start.
+ *
+ * With request_arena set, the C++ objects allocated while a request is
+ * evaluated come from the worker's arena, which is reset once the
+ * response has been sent.  The result is sent straight from the
+ * interpreter, whatever its length.
+ *
+ * Requests are evaluated from the worker's script cache, so one that
+ * has been seen recently reuses its bytecode.  Frame requests are
+ * decoded each time, and their results encoded into the worker's
+ * reply buffer.
+ */
+class Service::Worker : public Thread {
+    Service *service;
+    Tcl_Interp *interp;
+    Allocator::Arena arena;
+    ScriptCache scripts;
+    ChannelMessage reply;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t busy;
+    uint64_t slowest;
+public:
+    Worker( Service *, const char *, Tcl_Interp * );
+    virtual ~Worker() {}
+    virtual void run();
+    virtual void stats( ThreadStatsInjector * );
+    void handle( Request * );
+    uint64_t script_hits() const { return scripts.hits(); }
+    uint64_t script_misses() const { return scripts.misses(); }
+};
+
+/**
+ */
+Service::Worker::Worker( Service *service, const char *name, Tcl_Interp *interp )
+: Thread(name), service(service), interp(interp), scripts(service->script_cache),
+  requests(0), errors(0), busy(0), slowest(0) {
+}
+
+/**
+ */
+void
+Service::Worker::run() {
+    if ( interp == NULL )  interp = service->create_worker_interp();
+    for (;;) {
+        Request *request = (Request *)service->pending->dequeue();
+        handle( request );
+        service->idle->enqueue( request );
+    }
+}
+
+/**
+ * The time spent waiting for this worker, evaluating and sending is
+ * added to the request's command in the service's latency table.
+ */
+void
+Service::Worker::handle( Request *request ) {
+    uint64_t start = nanoseconds();
+
+    bool framed = request->kind == REQUEST_FRAME;
+    Tcl_Obj *script;
+    if ( framed ) {
+        script = frame_decode( interp, request->body.data(), request->body.length() );
+        if ( script != NULL )  Tcl_IncrRefCount( script );
+    } else {
+        scripts.resize( service->script_cache );
+        script = scripts.lookup( request->body.data(), request->kind );
+    }
+
+    bool scoped = service->request_arena != 0;
+    if ( scoped )  arena.push();
+    int result = TCL_ERROR;
+    if ( script != NULL )  result = evaluate( interp, script, request->kind );
+    if ( scoped )  arena.pop();
+    uint64_t evaluated = nanoseconds();
+
+    if ( framed ) {
+        reply.clear();
+        frame_encode( Tcl_GetObjResult(interp), reply );
+        service->channel->send( request->sender, request->id, result, reply.data(), reply.length() );
+    } else {
+        int length;
+        const char *response = Tcl_GetStringFromObj( Tcl_GetObjResult(interp), &length );
+        service->channel->send( request->sender, request->id, result, response, length );
+    }
+    Tcl_ResetResult( interp );
+    if ( scoped )  arena.reset();
+
+    uint64_t finish = nanoseconds();
+    uint64_t phases[LatencyTable::phase_count];
+    phases[LatencyTable::queue] = start - request->received;
+    phases[LatencyTable::eval] = evaluated - start;
+    phases[LatencyTable::send] = finish - evaluated;
+    const char *command = request->body.data();
+    if ( framed ) {
+        Tcl_Obj *word = NULL;
+        if ( script != NULL )  Tcl_ListObjIndex( NULL, script, 0, &word );
+        command = (word != NULL) ? Tcl_GetString(word) : "(frame)";
+    }
+    service->latency.record( command, result, phases );
+    if ( script != NULL )  Tcl_DecrRefCount( script );
+
+    uint64_t elapsed = finish - start;
+    requests++;
+    if ( result != TCL_OK )  errors++;
+    busy += elapsed;
+    if ( elapsed > slowest )  slowest = elapsed;
+}
+
+/**
+ * The counters are written by the worker and read here without a lock,
+ * so they may be one request behind.
+ */
+void
+Service::Worker::stats( ThreadStatsInjector *injector ) {
+    ThreadStatsInjector& f = *injector;
+    Thread::stats( injector );
+    f( "requests", requests );
+    f( "errors", errors );
+    f( "busy_ns", busy );
+    f( "slowest_ns", slowest );
+    f( "script_hits", scripts.hits() );
+    f( "script_misses", scripts.misses() );
+    f( "scripts", scripts.size() );
+}
+
+/**
+ * Writes the latency table to <rundir>/latency every stats_interval
+ * seconds.
+ */
+class Service::StatsWriter : public Thread {
+    Service *service;
+public:
+    StatsWriter( Service *service, const char *name ) : Thread(name), service(service) {}
+    virtual ~StatsWriter() {}
+    virtual void run();
+};
+
+/**
+ */
+void
+Service::StatsWriter::run() {
+    char path[128];
+    snprintf( path, sizeof(path), "%s/latency", service->rundir );
+    for (;;) {
+        int interval = service->stats_interval;
+        if ( interval < 1 )  interval = 1;
+        struct timespec delay = { interval, 0 };
+        while ( nanosleep(&delay, &delay) < 0 && errno == EINTR ) ;
+        if ( service->stats_interval > 0 )  service->latency.dump( path );
+    }
+}
+
+namespace {
+
+    Tcl_Obj *
+    histogram_obj( const LatencyHistogram& h ) {
+        uint64_t count = h.count;
+        Tcl_Obj *dict = Tcl_NewDictObj();
+        Tcl_DictObjPut( NULL, dict, Tcl_NewStringObj("count", -1), Tcl_NewWideIntObj(count) );
+        Tcl_DictObjPut( NULL, dict, Tcl_NewStringObj("mean", -1), Tcl_NewWideIntObj(count ? h.sum / count : 0) );
+        Tcl_DictObjPut( NULL, dict, Tcl_NewStringObj("p50", -1), Tcl_NewWideIntObj(h.percentile(0.50)) );
+        Tcl_DictObjPut( NULL, dict, Tcl_NewStringObj("p90", -1), Tcl_NewWideIntObj(h.percentile(0.90)) );
+        Tcl_DictObjPut( NULL, dict, Tcl_NewStringObj("p99", -1), Tcl_NewWideIntObj(h.percentile(0.99)) );
+        Tcl_DictObjPut( NULL, dict, Tcl_NewStringObj("max", -1), Tcl_NewWideIntObj(h.max) );
+        return dict;
+    }
+
+    /**
+     * Builds a dict of command to {errors n queue {...} eval {...} send {...}}.
+     */
+    class TclLatencyInjector : public LatencyInjector {
+        Tcl_Obj *result;
+    public:
+        TclLatencyInjector( Tcl_Obj *result ) : result(result) {}
+        virtual ~TclLatencyInjector() {}
+        virtual void operator () ( const char *command, uint64_t errors, const LatencyHistogram *phases ) {
+            Tcl_Obj *dict = Tcl_NewDictObj();
+            Tcl_DictObjPut( NULL, dict, Tcl_NewStringObj("errors", -1), Tcl_NewWideIntObj(errors) );
+            Tcl_DictObjPut( NULL, dict, Tcl_NewStringObj("queue", -1), histogram_obj(phases[LatencyTable::queue]) );
+            Tcl_DictObjPut( NULL, dict, Tcl_NewStringObj("eval", -1), histogram_obj(phases[LatencyTable::eval]) );
+            Tcl_DictObjPut( NULL, dict, Tcl_NewStringObj("send", -1), histogram_obj(phases[LatencyTable::send]) );
+            Tcl_DictObjPut( NULL, result, Tcl_NewStringObj(command, -1), dict );
+        }
+    };
+
+}
+
+/**
+ * Service::stats ?reset|dump ?path?|cache?
+ *
+ * With no arguments, returns the latency of each command the service
+ * has been sent, in nanoseconds.  The cache subcommand returns the
+ * script cache counts summed over the workers.
+ */
+int
+Service::stats_cmd( ClientData data, Tcl_Interp *interp,
+                    int objc, Tcl_Obj * CONST *objv )
+{
+    Service *service = (Service *)data;
+
+    if ( objc == 1 ) {
+        Tcl_Obj *result = Tcl_NewDictObj();
+        TclLatencyInjector injector( result );
+        service->latency.report( &injector );
+        Tcl_SetObjResult( interp, result );
+        return TCL_OK;
+    }
+
+    char *command = Tcl_GetStringFromObj( objv[1], NULL );
+    if ( objc == 2 && Tcl_StringMatch(command, "reset") ) {
+        service->latency.reset();
+        Tcl_ResetResult( interp );
+        return TCL_OK;
+    }
+
+    if ( objc == 2 && Tcl_StringMatch(command, "cache") ) {
+        uint64_t hits, misses;
+        service->script_counts( &hits, &misses );
+        uint64_t total = hits + misses;
+        Tcl_Obj *result = Tcl_NewDictObj();
+        Tcl_DictObjPut( NULL, result, Tcl_NewStringObj("size", -1), Tcl_NewIntObj(service->script_cache) );
+        Tcl_DictObjPut( NULL, result, Tcl_NewStringObj("hits", -1), Tcl_NewWideIntObj(hits) );
+        Tcl_DictObjPut( NULL, result, Tcl_NewStringObj("misses", -1), Tcl_NewWideIntObj(misses) );
+        Tcl_DictObjPut( NULL, result, Tcl_NewStringObj("hit_rate", -1),
+                        Tcl_NewDoubleObj(total ? (double)hits / total : 0.0) );
+        Tcl_SetObjResult( interp, result );
+        return TCL_OK;
+    }
+
+    if ( objc <= 3 && Tcl_StringMatch(command, "dump") ) {
+        char path[128];
+        if ( objc == 3 ) {
+            strlcpy( path, Tcl_GetStringFromObj(objv[2], NULL), sizeof(path) );
+        } else {
+            snprintf( path, sizeof(path), "%s/latency", service->rundir );
+        }
+        if ( service->latency.dump(path) == false ) {
+            Svc_SetResult( interp, "could not write latency table", TCL_STATIC );
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult( interp, Tcl_NewStringObj(path, -1) );
+        return TCL_OK;
+    }
+
+    Tcl_ResetResult( interp );
+    Tcl_WrongNumArgs( interp, 1, objv, "?reset|dump ?path?|cache?" );
+    return TCL_ERROR;
+}
+
+/**
+ * The workers' script cache counts, summed.  They are read without a
+ * lock, as the workers' own stats are.  The list of workers ends with
+ * NULL, since Service::workers may change once they are running.
+ */
+void
+Service::script_counts( uint64_t *hits, uint64_t *misses ) {
+    *hits = *misses = 0;
+    if ( workers == NULL )  return;
+    for ( int i = 0 ; workers[i] != NULL ; i++ ) {
+        *hits += workers[i]->script_hits();
+        *misses += workers[i]->script_misses();
+    }
+}
+
+/**
+ */
+void
+Service::stats( ThreadStatsInjector *injector ) {
+    ThreadStatsInjector& f = *injector;
+    Thread::stats( injector );
+    f( "workers", worker_count );
+    f( "pending", (pending == NULL) ? 0 : pending->depth() );
+    uint64_t hits, misses;
+    script_counts( &hits, &misses );
+    f( "script_hits", hits );
+    f( "script_misses", misses );
+}
+
+/**
+ * A service object is a thread that waits for messages from a Channel and
+ * hands them to its workers, which process them in a TCL interpreter and
+ * respond.  The workers all take requests from one queue, so a request
+ * goes to whichever worker is idle first.  With a single worker the
+ * request is evaluated on this thread in the service interpreter, as it
+ * always was.  With more, every worker builds its own interpreter on its
+ * own thread, since an interpreter must stay on one thread.
+ *
+ * Each worker appears as Thread::<service>.worker<n>, and its stats
+ * subcommand reports its counters.
  */
 void
 Service::run() {
-    syslog( LOG_NOTICE, "Channel listening" );
-    char request[1024];
-    char response[1024];
+    if ( worker_count < 1 )  worker_count = 1;
+    int count = worker_count;
+
+    /**
+     * Queues are bounded, so these are sized to hold every request at
+     * once, however many workers there are.
+     */
+    idle = new Queue( count * 2 );
+    pending = new Queue( count * 2 );
+
+    Worker **list = new Worker *[count + 1];
+    for ( int i = 0 ; i < count ; i++ ) {
+        char name[80];
+        snprintf( name, sizeof(name), "%s.worker%d", service_name, i );
+        list[i] = new Worker( this, name, (count == 1) ? interp : NULL );
+    }
+    list[count] = NULL;
+    workers = list;
+    if ( count > 1 ) {
+        for ( int i = 0 ; i < count ; i++ ) {
+            workers[i]->start();
+        }
+    }
+
+    /**
+     * Two requests per worker, so the next request can be read from the
+     * channel while every worker is busy.
+     */
+    for ( int i = 0 ; i < (count * 2) ; i++ ) {
+        idle->enqueue( new Request );
+    }
+
+    /**
+     * Service::stats_interval, in seconds, may be set by the configuration
+     * script to have the latency table written to the rundir.
+     */
+    if ( stats_interval > 0 ) {
+        char name[80];
+        snprintf( name, sizeof(name), "%s.stats", service_name );
+        (new StatsWriter(this, name))->start();
+    }
+
+    syslog( LOG_NOTICE, "Channel listening with %d worker(s)", count );
     for (;;) {
-        long sender = channel->receive( request, sizeof(request) );
-        if ( ::kill(sender, 0) < 0 ) {
-            syslog( LOG_ERR, "client is dead: %s. Ignoring message", strerror(errno) );
+        Request *request = (Request *)idle->dequeue();
+        request->sender = channel->receive( request->body, &request->id, &request->kind );
+        request->received = nanoseconds();
+        if ( channel->alive(request->sender) == false ) {
+            syslog( LOG_ERR, "client is dead. Ignoring message" );
+            idle->enqueue( request );
+            continue;
+        }
+        if ( count == 1 ) {
+            workers[0]->handle( request );
+            idle->enqueue( request );
             continue;
         }
-        int result = Tcl_EvalEx( interp, request, -1, TCL_EVAL_GLOBAL );
-        strlcpy( response, Tcl_GetStringResult(interp), sizeof(response) );
-        channel->send( sender, result, response );
+        pending->enqueue( request );
     }
 }
 
@@ -10,6 +10,8 @@
 #include <tcl.h>
 #include "Thread.h"
 #include "Channel.h"
+#include "Latency.h"
+#include "ScriptCache.h"
 
 /**
  * run() should not be able to execute unless initialized
@@ -25,6 +27,32 @@ private:
     char rundir[80];
     Channel *channel;
     int facility;
+    Channel::Kind transport;
+    int request_arena;
+    int stats_interval;
+    int script_cache;
+    LatencyTable latency;
+
+    class Worker;
+    class StatsWriter;
+    struct Request;
+    struct Setup;
+    friend class Worker;
+    friend class StatsWriter;
+
+    int argc;
+    char **argv;
+    int worker_count;
+    Worker **workers;
+    Queue *pending;
+    Queue *idle;
+    Setup *setup, **setup_tail;
+    pthread_mutex_t setup_lock;
+
+    void record( int, const char *, Tcl_ObjCmdProc *, ClientData );
+    Tcl_Interp *create_worker_interp();
+    static int stats_cmd( ClientData, Tcl_Interp *, int, Tcl_Obj * CONST * );
+    void script_counts( uint64_t *, uint64_t * );
 public:
     Service( const char * );
     virtual ~Service();
@@ -32,6 +60,9 @@ public:
     virtual void run();
     const char *name() const { return service_name; }
     void set_facility( int );
+    void set_transport( Channel::Kind );
+    void set_workers( int );
+    virtual void stats( ThreadStatsInjector * );
     bool add_command( char *, Tcl_ObjCmdProc *, ClientData );
     bool load_command( const char * );
     bool load_commands( const char * );
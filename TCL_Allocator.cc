@@ -9,6 +9,7 @@
 #include <sys/mman.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <execinfo.h>
 
 #include <exception>
@@ -18,17 +19,16 @@
 #include <pthread.h>
 #include <tcl.h>
 
+#include "tcl_util.h"
 #include "Allocator.h"
 #include "AppInit.h"
 
 namespace {
-    int debug = 0;
-
     void
     print_stack() {
         void *pointers[256];
 
-        int frame_count = backtrace( pointers, sizeof(pointers) );
+        int frame_count = backtrace( pointers, sizeof(pointers)/sizeof(pointers[0]) );
         char **frames = backtrace_symbols( pointers, frame_count );
         for ( int i = 0 ; i < frame_count ; ++i ) {
             fprintf( stderr, "frame(%03d): %s\n", i, frames[i] );
@@ -75,19 +75,203 @@ TclInjector::operator () ( size_t size, int count, uint32_t available_slots ) {
     Tcl_ListObjAppendElement( interp, result, element );
 }
 
+/**
+ */
+class TclCacheInjector : public Allocator::CacheInjector {
+    Tcl_Interp *interp;
+    Tcl_Obj * result;
+public:
+    TclCacheInjector( Tcl_Interp *, Tcl_Obj * );
+    virtual ~TclCacheInjector() {}
+    virtual void operator () ( pid_t, size_t, int );
+};
+
+TclCacheInjector::TclCacheInjector( Tcl_Interp *interp, Tcl_Obj *result ) :
+Allocator::CacheInjector(), interp(interp), result(result) {
+}
+
+void
+TclCacheInjector::operator () ( pid_t thread, size_t size, int cached ) {
+    Tcl_Obj *element = Tcl_NewListObj( 0, 0 );
+
+    Tcl_ListObjAppendElement( interp, element, Tcl_NewStringObj("thread", -1) );
+    Tcl_ListObjAppendElement( interp, element, Tcl_NewLongObj(thread) );
+
+    Tcl_ListObjAppendElement( interp, element, Tcl_NewStringObj("size", -1) );
+    Tcl_ListObjAppendElement( interp, element, Tcl_NewLongObj(size) );
+
+    Tcl_ListObjAppendElement( interp, element, Tcl_NewStringObj("cached", -1) );
+    Tcl_ListObjAppendElement( interp, element, Tcl_NewLongObj(cached) );
+
+    Tcl_ListObjAppendElement( interp, result, element );
+}
+
+/**
+ * Internal fragmentation is the share of the allocated bytes that
+ * were not asked for, because requests were rounded up to the class.
+ */
+class TclClassInjector : public Allocator::ClassInjector {
+    Tcl_Interp *interp;
+    Tcl_Obj * result;
+public:
+    TclClassInjector( Tcl_Interp *, Tcl_Obj * );
+    virtual ~TclClassInjector() {}
+    virtual void operator () ( const Allocator::ClassUsage& );
+};
+
+TclClassInjector::TclClassInjector( Tcl_Interp *interp, Tcl_Obj *result ) :
+Allocator::ClassInjector(), interp(interp), result(result) {
+}
+
+void
+TclClassInjector::operator () ( const Allocator::ClassUsage& usage ) {
+    Tcl_Obj *element = Tcl_NewListObj( 0, 0 );
+
+    Tcl_ListObjAppendElement( interp, element, Tcl_NewStringObj("class", -1) );
+    if ( usage.size == 0 ) {
+        Tcl_ListObjAppendElement( interp, element, Tcl_NewStringObj("large", -1) );
+    } else {
+        Tcl_ListObjAppendElement( interp, element, Tcl_NewLongObj(usage.size) );
+    }
+
+    Tcl_ListObjAppendElement( interp, element, Tcl_NewStringObj("slabs", -1) );
+    Tcl_ListObjAppendElement( interp, element, Tcl_NewLongObj(usage.slabs) );
+
+    Tcl_ListObjAppendElement( interp, element, Tcl_NewStringObj("mapped", -1) );
+    Tcl_ListObjAppendElement( interp, element, Tcl_NewWideIntObj(usage.mapped) );
+
+    Tcl_ListObjAppendElement( interp, element, Tcl_NewStringObj("objects", -1) );
+    Tcl_ListObjAppendElement( interp, element, Tcl_NewWideIntObj(usage.objects) );
+
+    Tcl_ListObjAppendElement( interp, element, Tcl_NewStringObj("requested", -1) );
+    Tcl_ListObjAppendElement( interp, element, Tcl_NewWideIntObj(usage.traffic.requested) );
+
+    Tcl_ListObjAppendElement( interp, element, Tcl_NewStringObj("allocated", -1) );
+    Tcl_ListObjAppendElement( interp, element, Tcl_NewWideIntObj(usage.traffic.allocated) );
+
+    double fragmentation = 0.0;
+    if ( usage.traffic.allocated > 0 ) {
+        fragmentation = 1.0 - ((double)usage.traffic.requested / usage.traffic.allocated);
+    }
+    Tcl_ListObjAppendElement( interp, element, Tcl_NewStringObj("fragmentation", -1) );
+    Tcl_ListObjAppendElement( interp, element, Tcl_NewDoubleObj(fragmentation) );
+
+    Tcl_ListObjAppendElement( interp, result, element );
+}
+
+/**
+ * Allocator::stats reports each class as a dict keyed by its size.
+ */
+class TclStatsInjector : public Allocator::ClassInjector {
+    Tcl_Interp *interp;
+    Tcl_Obj * result;
+    void put( Tcl_Obj *, const char *, Tcl_WideInt );
+public:
+    TclStatsInjector( Tcl_Interp * );
+    virtual ~TclStatsInjector() {}
+    virtual void operator () ( const Allocator::ClassUsage& );
+    Tcl_Obj *get_result() { return result; }
+};
+
+TclStatsInjector::TclStatsInjector( Tcl_Interp *interp ) :
+Allocator::ClassInjector(), interp(interp) {
+    result = Tcl_NewListObj( 0, 0 );
+}
+
+void
+TclStatsInjector::put( Tcl_Obj *element, const char *key, Tcl_WideInt value ) {
+    Tcl_ListObjAppendElement( interp, element, Tcl_NewStringObj(key, -1) );
+    Tcl_ListObjAppendElement( interp, element, Tcl_NewWideIntObj(value) );
+}
+
+void
+TclStatsInjector::operator () ( const Allocator::ClassUsage& usage ) {
+    if ( usage.size == 0 ) {
+        Tcl_ListObjAppendElement( interp, result, Tcl_NewStringObj("large", -1) );
+    } else {
+        Tcl_ListObjAppendElement( interp, result, Tcl_NewLongObj(usage.size) );
+    }
+
+    Tcl_Obj *element = Tcl_NewListObj( 0, 0 );
+    put( element, "allocations", usage.traffic.allocations );
+    put( element, "frees", usage.traffic.frees );
+    put( element, "live", usage.traffic.live() );
+    put( element, "peak", usage.peak );
+    put( element, "slabs", usage.slabs );
+    put( element, "contention", usage.contention );
+    Tcl_ListObjAppendElement( interp, result, element );
+}
+
+/**
+ * A histogram is a dict of bucket upper bound (in ns) to count, with
+ * the empty buckets left out.
+ */
+static Tcl_Obj *
+histogram_dict( Tcl_Interp *interp, const uint64_t *histogram ) {
+    Tcl_Obj *result = Tcl_NewListObj( 0, 0 );
+    for ( int bucket = 0 ; bucket < Allocator::Latency::buckets ; bucket++ ) {
+        if ( histogram[bucket] == 0 )  continue;
+        Tcl_ListObjAppendElement( interp, result, Tcl_NewWideIntObj(1LL << bucket) );
+        Tcl_ListObjAppendElement( interp, result, Tcl_NewWideIntObj(histogram[bucket]) );
+    }
+    return result;
+}
+
+/**
+ */
+static Tcl_Obj *
+latency_dict( Tcl_Interp *interp, const Allocator::Latency& latency ) {
+    Tcl_Obj *result = Tcl_NewListObj( 0, 0 );
+    Tcl_ListObjAppendElement( interp, result, Tcl_NewStringObj("allocate", -1) );
+    Tcl_ListObjAppendElement( interp, result, histogram_dict(interp, latency.allocate) );
+    Tcl_ListObjAppendElement( interp, result, Tcl_NewStringObj("free", -1) );
+    Tcl_ListObjAppendElement( interp, result, histogram_dict(interp, latency.free) );
+    return result;
+}
+
 /**
  */
 static int
 stats_cmd( ClientData data, Tcl_Interp *interp,
              int objc, Tcl_Obj * CONST *objv )
 {
+    if ( objc == 3 ) {
+        char *command = Tcl_GetStringFromObj( objv[1], NULL );
+        if ( Tcl_StringMatch(command, "dump") == 0 ) {
+            Tcl_ResetResult( interp );
+            Tcl_WrongNumArgs( interp, 1, objv, "?dump filename?" );
+            return TCL_ERROR;
+        }
+        char *filename = Tcl_GetStringFromObj( objv[2], NULL );
+        if ( Allocator::dump(filename) == false ) {
+            Tcl_StaticSetResult( interp, "failed to write allocator stats" );
+            return TCL_ERROR;
+        }
+        Tcl_ResetResult( interp );
+        return TCL_OK;
+    }
+
     if ( objc != 1 ) {
         Tcl_ResetResult( interp );
-        Tcl_WrongNumArgs( interp, 1, objv, "" );
+        Tcl_WrongNumArgs( interp, 1, objv, "?dump filename?" );
         return TCL_ERROR;
     }
 
-    Tcl_ResetResult( interp );
+    TclStatsInjector *injector = new TclStatsInjector( interp );
+    Allocator::inject( injector );
+
+    Allocator::Latency latency;
+    Allocator::latency( &latency );
+
+    Tcl_Obj *result = Tcl_NewListObj( 0, 0 );
+    Tcl_ListObjAppendElement( interp, result, Tcl_NewStringObj("classes", -1) );
+    Tcl_ListObjAppendElement( interp, result, injector->get_result() );
+    Tcl_ListObjAppendElement( interp, result, Tcl_NewStringObj("latency", -1) );
+    Tcl_ListObjAppendElement( interp, result, latency_dict(interp, latency) );
+
+    Tcl_SetObjResult( interp, result );
+
+    delete injector;
     return TCL_OK;
 }
 
@@ -106,12 +290,93 @@ usage_cmd( ClientData data, Tcl_Interp *interp,
     TclInjector *injector = new TclInjector( interp );
     Allocator::inject( injector );
 
+    TclCacheInjector *caches = new TclCacheInjector( interp, injector->get_result() );
+    Allocator::inject( caches );
+
+    TclClassInjector *classes = new TclClassInjector( interp, injector->get_result() );
+    Allocator::inject( classes );
+
     Tcl_SetObjResult( interp, injector->get_result() );
 
+    delete classes;
+    delete caches;
     delete injector;
     return TCL_OK;
 }
 
+/**
+ */
+static int
+trim_cmd( ClientData data, Tcl_Interp *interp,
+             int objc, Tcl_Obj * CONST *objv )
+{
+    if ( objc != 1 ) {
+        Tcl_ResetResult( interp );
+        Tcl_WrongNumArgs( interp, 1, objv, "" );
+        return TCL_ERROR;
+    }
+
+    size_t released = Allocator::trim();
+
+    Tcl_SetObjResult( interp, Tcl_NewWideIntObj(released) );
+    return TCL_OK;
+}
+
+/**
+ * Allocator::profile ?-folded? ?filename?
+ *
+ * Without a filename the profile is returned as the result.
+ */
+static int
+profile_cmd( ClientData data, Tcl_Interp *interp,
+             int objc, Tcl_Obj * CONST *objv )
+{
+    Allocator::ProfileFormat format = Allocator::pprof;
+    int arg = 1;
+    if ( objc > arg && Tcl_StringMatch(Tcl_GetStringFromObj(objv[arg], NULL), "-folded") ) {
+        format = Allocator::folded;
+        arg++;
+    }
+
+    if ( objc > arg + 1 ) {
+        Tcl_ResetResult( interp );
+        Tcl_WrongNumArgs( interp, 1, objv, "?-folded? ?filename?" );
+        return TCL_ERROR;
+    }
+
+    if ( objc == arg + 1 ) {
+        char *filename = Tcl_GetStringFromObj( objv[arg], NULL );
+        FILE *f = fopen( filename, "w" );
+        bool written = (f != NULL) && Allocator::profile( f, format );
+        if ( f != NULL && fclose(f) != 0 )  written = false;
+        if ( written == false ) {
+            Tcl_StaticSetResult( interp, "failed to write heap profile" );
+            return TCL_ERROR;
+        }
+        Tcl_ResetResult( interp );
+        return TCL_OK;
+    }
+
+    char *text = NULL;
+    size_t length = 0;
+    FILE *f = open_memstream( &text, &length );
+    if ( f == NULL ) {
+        Tcl_StaticSetResult( interp, "failed to open heap profile stream" );
+        return TCL_ERROR;
+    }
+    bool written = Allocator::profile( f, format );
+    if ( fclose(f) != 0 )  written = false;
+    if ( written == false ) {
+        free( text );
+        Tcl_StaticSetResult( interp, "failed to write heap profile" );
+        return TCL_ERROR;
+    }
+
+    Tcl_SetObjResult( interp, Tcl_NewStringObj(text, length) );
+    free( text );
+    return TCL_OK;
+}
+
 /**
  */
 static bool
@@ -123,11 +388,31 @@ Allocator_Module( Tcl_Interp *interp ) {
         return false;
     }
 
-    if ( Tcl_LinkVar(interp, "Allocator::debug", (char *)&debug, TCL_LINK_INT) != TCL_OK ) {
+    if ( Tcl_LinkVar(interp, "Allocator::debug", (char *)&Allocator::debug, TCL_LINK_INT) != TCL_OK ) {
         syslog( LOG_ERR, "failed to link Allocator::debug" );
         return false;
     }
 
+    if ( Tcl_LinkVar(interp, "Allocator::profile_interval", (char *)&Allocator::profile_interval, TCL_LINK_INT) != TCL_OK ) {
+        syslog( LOG_ERR, "failed to link Allocator::profile_interval" );
+        return false;
+    }
+
+    if ( Tcl_LinkVar(interp, "Allocator::retain_slabs", (char *)&Allocator::retain_slabs, TCL_LINK_INT) != TCL_OK ) {
+        syslog( LOG_ERR, "failed to link Allocator::retain_slabs" );
+        return false;
+    }
+
+    if ( Tcl_LinkVar(interp, "Allocator::sample_interval", (char *)&Allocator::sample_interval, TCL_LINK_INT) != TCL_OK ) {
+        syslog( LOG_ERR, "failed to link Allocator::sample_interval" );
+        return false;
+    }
+
+    if ( Tcl_LinkVar(interp, "Allocator::unmap_slabs", (char *)&Allocator::unmap_slabs, TCL_LINK_INT) != TCL_OK ) {
+        syslog( LOG_ERR, "failed to link Allocator::unmap_slabs" );
+        return false;
+    }
+
     command = Tcl_CreateObjCommand(interp, "Allocator::stats", stats_cmd, (ClientData)0, NULL);
     if ( command == NULL ) {
         return false;
@@ -138,6 +423,16 @@ Allocator_Module( Tcl_Interp *interp ) {
         return false;
     }
 
+    command = Tcl_CreateObjCommand(interp, "Allocator::profile", profile_cmd, (ClientData)0, NULL);
+    if ( command == NULL ) {
+        return false;
+    }
+
+    command = Tcl_CreateObjCommand(interp, "Allocator::trim", trim_cmd, (ClientData)0, NULL);
+    if ( command == NULL ) {
+        return false;
+    }
+
     return true;
 }
 
@@ -44,6 +44,7 @@
 
 #include "util.h"
 #include "Channel.h"
+#include "ChannelFrame.h"
 #include "Service.h"
 
 #include "AppInit.h"
@@ -52,6 +53,32 @@ namespace {
     int debug = 0;
 }
 
+/**
+ * A negative timeout waits for ever.  The response may be any length.
+ */
+static int
+wait_response( Tcl_Interp *interp, ChannelClient *channel, uint32_t id, int timeout ) {
+    ChannelMessage message;
+    int result = channel->wait( id, message, timeout );
+    Tcl_SetObjResult( interp, Tcl_NewStringObj(message.data(), message.length()) );
+    return result;
+}
+
+/**
+ * Parse an optional "-timeout milliseconds" after the subcommand, and
+ * set *next to the first argument after it.
+ */
+static int
+timeout_option( Tcl_Interp *interp, int objc, Tcl_Obj * CONST *objv, int *timeout, int *next ) {
+    *timeout = -1;
+    *next = 2;
+    if ( objc > 3 && Tcl_StringMatch(Tcl_GetStringFromObj(objv[2], NULL), "-timeout") ) {
+        if ( Tcl_GetIntFromObj(interp, objv[3], timeout) != TCL_OK )  return TCL_ERROR;
+        *next = 4;
+    }
+    return TCL_OK;
+}
+
 /**
  */
 static int
@@ -84,29 +111,141 @@ Channel_obj( ClientData data, Tcl_Interp *interp,
     }
 
     if ( Tcl_StringMatch(command, "receive") ) {
-        if ( objc != 2 ) {
+        int timeout, next;
+        if ( timeout_option(interp, objc, objv, &timeout, &next) != TCL_OK )  return TCL_ERROR;
+        if ( objc != next ) {
             Tcl_ResetResult( interp );
-            Tcl_WrongNumArgs( interp, 2, objv, "" );
+            Tcl_WrongNumArgs( interp, 2, objv, "?-timeout milliseconds?" );
             return TCL_ERROR;
         }
-        char buffer[1024];
-        int result = channel->receive( buffer, sizeof(buffer) );
-        Tcl_SetObjResult( interp, Tcl_NewStringObj(buffer, -1) );
+        ChannelMessage message;
+        int result = channel->receive( message, timeout );
+        Tcl_SetObjResult( interp, Tcl_NewStringObj(message.data(), message.length()) );
         return result;
     }
 
     if ( Tcl_StringMatch(command, "ask") ) {
+        int timeout, next;
+        if ( timeout_option(interp, objc, objv, &timeout, &next) != TCL_OK )  return TCL_ERROR;
+        if ( objc != next + 1 ) {
+            Tcl_ResetResult( interp );
+            Tcl_WrongNumArgs( interp, 2, objv, "?-timeout milliseconds? request" );
+            return TCL_ERROR;
+        }
+        char *request = Tcl_GetStringFromObj( objv[next], NULL );
+        return wait_response( interp, channel, channel->submit(request), timeout );
+    }
+
+    /**
+     * The service passes the arguments to the command as they are, so
+     * they need no quoting and are never substituted.
+     */
+    if ( Tcl_StringMatch(command, "invoke") ) {
+        int timeout, next;
+        if ( timeout_option(interp, objc, objv, &timeout, &next) != TCL_OK )  return TCL_ERROR;
+        if ( objc < next + 1 ) {
+            Tcl_ResetResult( interp );
+            Tcl_WrongNumArgs( interp, 2, objv, "?-timeout milliseconds? command ?arg ...?" );
+            return TCL_ERROR;
+        }
+        Tcl_Obj *words = Tcl_NewListObj( objc - next, objv + next );
+        Tcl_IncrRefCount( words );
+        uint32_t id = channel->submit( Tcl_GetStringFromObj(words, NULL), REQUEST_COMMAND );
+        Tcl_DecrRefCount( words );
+        return wait_response( interp, channel, id, timeout );
+    }
+
+    /**
+     * Like invoke, but the arguments and the result cross the channel
+     * as typed frames, so byte arrays and numbers arrive as they are.
+     */
+    if ( Tcl_StringMatch(command, "call") ) {
+        int timeout, next;
+        if ( timeout_option(interp, objc, objv, &timeout, &next) != TCL_OK )  return TCL_ERROR;
+        if ( objc < next + 1 ) {
+            Tcl_ResetResult( interp );
+            Tcl_WrongNumArgs( interp, 2, objv, "?-timeout milliseconds? command ?arg ...?" );
+            return TCL_ERROR;
+        }
+        ChannelMessage message;
+        Tcl_Obj *words = Tcl_NewListObj( objc - next, objv + next );
+        Tcl_IncrRefCount( words );
+        frame_encode( words, message );
+        Tcl_DecrRefCount( words );
+        uint32_t id = channel->submit( message.data(), message.length(), REQUEST_FRAME );
+
+        int result = channel->wait( id, message, timeout );
+        if ( message.length() == 0 ) {
+            Tcl_ResetResult( interp );
+            return result;
+        }
+        Tcl_Obj *value = frame_decode( interp, message.data(), message.length() );
+        if ( value == NULL )  return TCL_ERROR;
+        Tcl_SetObjResult( interp, value );
+        return result;
+    }
+
+    if ( Tcl_StringMatch(command, "submit") ) {
         if ( objc != 3 ) {
             Tcl_ResetResult( interp );
             Tcl_WrongNumArgs( interp, 2, objv, "request" );
             return TCL_ERROR;
         }
         char *request = Tcl_GetStringFromObj( objv[2], NULL );
-        channel->send( request );
-        char buffer[1024];
-        int result = channel->receive( buffer, sizeof(buffer) );
-        Tcl_SetObjResult( interp, Tcl_NewStringObj(buffer, -1) );
-        return result;
+        Tcl_SetObjResult( interp, Tcl_NewWideIntObj(channel->submit(request)) );
+        return TCL_OK;
+    }
+
+    if ( Tcl_StringMatch(command, "wait") ) {
+        int timeout, next;
+        if ( timeout_option(interp, objc, objv, &timeout, &next) != TCL_OK )  return TCL_ERROR;
+        if ( objc != next + 1 ) {
+            Tcl_ResetResult( interp );
+            Tcl_WrongNumArgs( interp, 2, objv, "?-timeout milliseconds? id" );
+            return TCL_ERROR;
+        }
+        Tcl_WideInt id;
+        if ( Tcl_GetWideIntFromObj(interp, objv[next], &id) != TCL_OK )  return TCL_ERROR;
+        return wait_response( interp, channel, (uint32_t)id, timeout );
+    }
+
+    /**
+     * Send every request before waiting for any response, and return a
+     * list of {code result} pairs in the order of the requests.
+     */
+    if ( Tcl_StringMatch(command, "batch") ) {
+        int timeout, next;
+        if ( timeout_option(interp, objc, objv, &timeout, &next) != TCL_OK )  return TCL_ERROR;
+        if ( objc != next + 1 ) {
+            Tcl_ResetResult( interp );
+            Tcl_WrongNumArgs( interp, 2, objv, "?-timeout milliseconds? requests" );
+            return TCL_ERROR;
+        }
+        int count;
+        Tcl_Obj **requests;
+        if ( Tcl_ListObjGetElements(interp, objv[next], &count, &requests) != TCL_OK )  return TCL_ERROR;
+
+        uint32_t *ids = (uint32_t *)ckalloc( sizeof(uint32_t) * (count + 1) );
+        for ( int i = 0 ; i < count ; i++ ) {
+            ids[i] = channel->submit( Tcl_GetStringFromObj(requests[i], NULL) );
+        }
+        Tcl_Obj *list = Tcl_NewListObj( 0, NULL );
+        for ( int i = 0 ; i < count ; i++ ) {
+            ChannelMessage message;
+            int result = channel->wait( ids[i], message, timeout );
+            Tcl_Obj *pair[2];
+            pair[0] = Tcl_NewIntObj( result );
+            pair[1] = Tcl_NewStringObj( message.data(), message.length() );
+            Tcl_ListObjAppendElement( interp, list, Tcl_NewListObj(2, pair) );
+        }
+        ckfree( (char *)ids );
+        Tcl_SetObjResult( interp, list );
+        return TCL_OK;
+    }
+
+    if ( Tcl_StringMatch(command, "outstanding") ) {
+        Tcl_SetObjResult( interp, Tcl_NewIntObj(channel->outstanding()) );
+        return TCL_OK;
     }
 
     if ( Tcl_StringMatch(command, "tell") ) {
@@ -123,9 +262,8 @@ Channel_obj( ClientData data, Tcl_Interp *interp,
         setsid();
         openlog( "(background:channel)", LOG_PERROR, LOG_USER );
         syslog( LOG_NOTICE, "send '%s'", request );
-        channel->send( request );
-        char buffer[1024];
-        int result = channel->receive( buffer, sizeof(buffer), 60 );
+        ChannelMessage message;
+        int result = channel->wait( channel->submit(request), message, 60 * 1000 );
         if ( result != TCL_OK ) {
             syslog( LOG_ERR, "channel failed" );
         }
@@ -0,0 +1,242 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file TCL_Fiber.cc
+ * \brief TCL commands to look at fibers and their schedulers
+ *
+ * Fibers come and go too quickly to have a command each, as threads
+ * do, so they are looked up by id.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <tcl.h>
+#include "tcl_util.h"
+#include "Fiber.h"
+#include "AppInit.h"
+
+namespace {
+
+    const char *
+    state_name( Fiber::State state ) {
+        switch ( state ) {
+        case Fiber::STOPPED:  return "STOPPED";
+        case Fiber::RUNNABLE: return "RUNNABLE";
+        case Fiber::RUNNING:  return "RUNNING";
+        case Fiber::BLOCKED:  return "BLOCKED";
+        }
+        return "UNKNOWN";
+    }
+
+    void
+    put( Tcl_Obj *dict, const char *key, Tcl_Obj *value ) {
+        Tcl_DictObjPut( NULL, dict, Tcl_NewStringObj(key, -1), value );
+    }
+
+    /**
+     * Collects the ids of every fiber, or the details of one.
+     */
+    class TclFiberInjector : public FiberInjector {
+        Tcl_WideInt wanted;
+        Tcl_Obj *result;
+    public:
+        TclFiberInjector( Tcl_WideInt wanted ) : wanted(wanted), result(NULL) {}
+        virtual ~TclFiberInjector() {}
+        virtual void operator () ( Fiber *fiber, const char *scheduler, uint64_t switches ) {
+            if ( wanted == 0 ) {
+                if ( result == NULL )  result = Tcl_NewListObj( 0, NULL );
+                Tcl_ListObjAppendElement( NULL, result, Tcl_NewWideIntObj(fiber->id()) );
+                return;
+            }
+            if ( (Tcl_WideInt)fiber->id() != wanted )  return;
+            result = Tcl_NewDictObj();
+            put( result, "name", Tcl_NewStringObj(fiber->fiber_name(), -1) );
+            put( result, "state", Tcl_NewStringObj(state_name(fiber->state), -1) );
+            put( result, "scheduler", Tcl_NewStringObj(scheduler, -1) );
+            put( result, "switches", Tcl_NewWideIntObj(switches) );
+            put( result, "stack_size", Tcl_NewWideIntObj(fiber->stack_size()) );
+            put( result, "stack_used", Tcl_NewWideIntObj(fiber->stack_used()) );
+        }
+        Tcl_Obj *get_result() { return result; }
+    };
+
+    /**
+     */
+    class TclSchedulerInjector : public SchedulerInjector {
+        Tcl_Obj *result;
+    public:
+        TclSchedulerInjector() { result = Tcl_NewDictObj(); }
+        virtual ~TclSchedulerInjector() {}
+        virtual void operator () ( const char *name, int fibers, int runnable, int sleeping,
+                                   int parked, uint64_t switches ) {
+            Tcl_Obj *dict = Tcl_NewDictObj();
+            put( dict, "fibers", Tcl_NewIntObj(fibers) );
+            put( dict, "runnable", Tcl_NewIntObj(runnable) );
+            put( dict, "sleeping", Tcl_NewIntObj(sleeping) );
+            put( dict, "parked", Tcl_NewIntObj(parked) );
+            put( dict, "switches", Tcl_NewWideIntObj(switches) );
+            put( result, name, dict );
+        }
+        Tcl_Obj *get_result() { return result; }
+    };
+
+    /**
+     */
+    class TclStackPoolInjector : public StackPoolInjector {
+        Tcl_Obj *result;
+    public:
+        TclStackPoolInjector() { result = Tcl_NewDictObj(); }
+        virtual ~TclStackPoolInjector() {}
+        virtual void operator () ( size_t size, int mapped, int cached, int resident,
+                                   size_t deepest, uint64_t reused ) {
+            Tcl_Obj *dict = Tcl_NewDictObj();
+            put( dict, "mapped", Tcl_NewIntObj(mapped) );
+            put( dict, "cached", Tcl_NewIntObj(cached) );
+            put( dict, "resident", Tcl_NewIntObj(resident) );
+            put( dict, "deepest", Tcl_NewWideIntObj(deepest) );
+            put( dict, "reused", Tcl_NewWideIntObj(reused) );
+            Tcl_DictObjPut( NULL, result, Tcl_NewWideIntObj(size), dict );
+        }
+        Tcl_Obj *get_result() { return result; }
+    };
+
+}
+
+/**
+ * Fiber::list
+ */
+static int
+FiberList_cmd( ClientData data, Tcl_Interp *interp,
+               int objc, Tcl_Obj * CONST *objv )
+{
+    if ( objc != 1 ) {
+        Tcl_ResetResult( interp );
+        Tcl_WrongNumArgs( interp, 1, objv, "" );
+        return TCL_ERROR;
+    }
+    TclFiberInjector injector( 0 );
+    Scheduler::report( &injector );
+    if ( injector.get_result() != NULL )  Tcl_SetObjResult( interp, injector.get_result() );
+    else                                  Tcl_ResetResult( interp );
+    return TCL_OK;
+}
+
+/**
+ * Fiber::info id
+ */
+static int
+FiberInfo_cmd( ClientData data, Tcl_Interp *interp,
+               int objc, Tcl_Obj * CONST *objv )
+{
+    if ( objc != 2 ) {
+        Tcl_ResetResult( interp );
+        Tcl_WrongNumArgs( interp, 1, objv, "id" );
+        return TCL_ERROR;
+    }
+    Tcl_WideInt id;
+    if ( Tcl_GetWideIntFromObj(interp, objv[1], &id) != TCL_OK )  return TCL_ERROR;
+    if ( id > 0 ) {
+        TclFiberInjector injector( id );
+        Scheduler::report( &injector );
+        if ( injector.get_result() != NULL ) {
+            Tcl_SetObjResult( interp, injector.get_result() );
+            return TCL_OK;
+        }
+    }
+    Tcl_StaticSetResult( interp, "no such fiber" );
+    return TCL_ERROR;
+}
+
+/**
+ * Fiber::schedulers
+ */
+static int
+FiberSchedulers_cmd( ClientData data, Tcl_Interp *interp,
+                     int objc, Tcl_Obj * CONST *objv )
+{
+    if ( objc != 1 ) {
+        Tcl_ResetResult( interp );
+        Tcl_WrongNumArgs( interp, 1, objv, "" );
+        return TCL_ERROR;
+    }
+    TclSchedulerInjector injector;
+    Scheduler::report( &injector );
+    Tcl_SetObjResult( interp, injector.get_result() );
+    return TCL_OK;
+}
+
+/**
+ * Fiber::stacks ?trim ?keep?|limit ?count??
+ *
+ * With no arguments, a dict of the stack pool keyed by stack size.
+ */
+static int
+FiberStacks_cmd( ClientData data, Tcl_Interp *interp,
+                 int objc, Tcl_Obj * CONST *objv )
+{
+    if ( objc == 1 ) {
+        TclStackPoolInjector injector;
+        StackPool::report( &injector );
+        Tcl_SetObjResult( interp, injector.get_result() );
+        return TCL_OK;
+    }
+
+    char *option = Tcl_GetStringFromObj( objv[1], NULL );
+    if ( objc <= 3 && Tcl_StringMatch(option, "trim") ) {
+        int keep = 0;
+        if ( objc == 3 && Tcl_GetIntFromObj(interp, objv[2], &keep) != TCL_OK )  return TCL_ERROR;
+        Tcl_SetObjResult( interp, Tcl_NewIntObj(StackPool::trim(keep)) );
+        return TCL_OK;
+    }
+    if ( objc <= 3 && Tcl_StringMatch(option, "limit") ) {
+        if ( objc == 3 ) {
+            int limit;
+            if ( Tcl_GetIntFromObj(interp, objv[2], &limit) != TCL_OK )  return TCL_ERROR;
+            StackPool::cache_limit = (limit < 0) ? 0 : limit;
+        }
+        Tcl_SetObjResult( interp, Tcl_NewIntObj(StackPool::cache_limit) );
+        return TCL_OK;
+    }
+
+    Tcl_ResetResult( interp );
+    Tcl_WrongNumArgs( interp, 1, objv, "?trim ?keep?|limit ?count??" );
+    return TCL_ERROR;
+}
+
+/**
+ */
+static bool
+Fiber_Module( Tcl_Interp *interp ) {
+    Tcl_Namespace *ns = Tcl_CreateNamespace(interp, "Fiber", (ClientData)0, NULL);
+    if ( ns == NULL )  return false;
+
+    Tcl_CreateObjCommand( interp, "Fiber::list", FiberList_cmd, (ClientData)0, NULL );
+    Tcl_CreateObjCommand( interp, "Fiber::info", FiberInfo_cmd, (ClientData)0, NULL );
+    Tcl_CreateObjCommand( interp, "Fiber::schedulers", FiberSchedulers_cmd, (ClientData)0, NULL );
+    Tcl_CreateObjCommand( interp, "Fiber::stacks", FiberStacks_cmd, (ClientData)0, NULL );
+    return true;
+}
+
+app_init( Fiber_Module );
+
+/* vim: set autoindent expandtab sw=4 : */
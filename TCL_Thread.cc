@@ -57,6 +57,111 @@ RegisterThreadWithTcl::RegisterThreadWithTcl( Tcl_Interp *interpreter )
 RegisterThreadWithTcl::~RegisterThreadWithTcl() {
 }
 
+/**
+ * Collect a thread's counters as a flat name/value list, which can be
+ * read as a dict.
+ */
+class TclThreadStatsInjector : public ThreadStatsInjector {
+    Tcl_Interp *interp;
+    Tcl_Obj *result;
+public:
+    TclThreadStatsInjector( Tcl_Interp *interp ) : interp(interp) {
+        result = Tcl_NewListObj( 0, 0 );
+    }
+    virtual ~TclThreadStatsInjector() {}
+    virtual void operator () ( const char *name, uint64_t value ) {
+        Tcl_ListObjAppendElement( interp, result, Tcl_NewStringObj(name, -1) );
+        Tcl_ListObjAppendElement( interp, result, Tcl_NewWideIntObj(value) );
+    }
+    Tcl_Obj *get_result() { return result; }
+};
+
+namespace {
+
+    struct PolicyName {
+        const char *name;
+        Thread::Policy policy;
+    } policy_names[] = {
+        { "inherit", Thread::inherit },
+        { "normal", Thread::normal },
+        { "batch", Thread::batch },
+        { "idle", Thread::idle },
+        { "fifo", Thread::fifo },
+        { "rr", Thread::round_robin },
+        { NULL, Thread::inherit }
+    };
+
+    const char *
+    policy_name( Thread::Policy policy ) {
+        for ( PolicyName *p = policy_names ; p->name != NULL ; p++ ) {
+            if ( p->policy == policy )  return p->name;
+        }
+        return "unknown";
+    }
+
+    /**
+     * A CPU list in the form the kernel uses, such as "0-3,8,10-11".
+     */
+    Tcl_Obj *
+    format_cpus( const uint64_t *mask ) {
+        Tcl_Obj *result = Tcl_NewObj();
+        int cpus = Thread::cpu_words * 64;
+        for ( int cpu = 0 ; cpu < cpus ; cpu++ ) {
+            if ( (mask[cpu / 64] & (1ULL << (cpu % 64))) == 0 )  continue;
+            int last = cpu;
+            while ( last + 1 < cpus && (mask[(last + 1) / 64] & (1ULL << ((last + 1) % 64))) )  last++;
+            char buffer[32];
+            if ( last == cpu )  snprintf( buffer, sizeof(buffer), "%d", cpu );
+            else                snprintf( buffer, sizeof(buffer), "%d-%d", cpu, last );
+            if ( Tcl_GetCharLength(result) > 0 )  Tcl_AppendToObj( result, ",", 1 );
+            Tcl_AppendToObj( result, buffer, -1 );
+            cpu = last;
+        }
+        return result;
+    }
+
+    bool
+    parse_cpus( const char *list, uint64_t *mask ) {
+        memset( mask, 0, Thread::cpu_words * sizeof(uint64_t) );
+        const char *p = list;
+        int cpus = Thread::cpu_words * 64;
+        while ( *p != '\0' ) {
+            char *end;
+            long first = strtol( p, &end, 10 );
+            if ( end == p )  return false;
+            long last = first;
+            p = end;
+            if ( *p == '-' ) {
+                last = strtol( p + 1, &end, 10 );
+                if ( end == p + 1 )  return false;
+                p = end;
+            }
+            if ( first < 0 || last < first || last >= cpus )  return false;
+            for ( long cpu = first ; cpu <= last ; cpu++ ) {
+                mask[cpu / 64] |= 1ULL << (cpu % 64);
+            }
+            if ( *p == ',' )  p++;
+            else if ( *p != '\0' )  return false;
+        }
+        return true;
+    }
+
+    void
+    put( Tcl_Obj *dict, const char *key, Tcl_Obj *value ) {
+        Tcl_DictObjPut( NULL, dict, Tcl_NewStringObj(key, -1), value );
+    }
+
+}
+
+/**
+ * Thread::<name> command ?args?
+ *
+ *   start, pid, status, stats, info
+ *   stack_size ?bytes?            only before start
+ *   affinity ?cpulist?            "" for any CPU
+ *   numa_node ?node?              -1 for any node, only before start
+ *   policy ?policy ?priority??    inherit normal batch idle fifo rr
+ */
 static int
 Thread_obj( ClientData data, Tcl_Interp *interp,
             int objc, Tcl_Obj * CONST *objv )
@@ -87,6 +192,100 @@ Thread_obj( ClientData data, Tcl_Interp *interp,
         return TCL_OK;
     }
 
+    if ( Tcl_StringMatch(command, "stats") ) {
+        TclThreadStatsInjector injector( interp );
+        thread->stats( &injector );
+        Tcl_SetObjResult( interp, injector.get_result() );
+        return TCL_OK;
+    }
+
+    if ( Tcl_StringMatch(command, "info") ) {
+        Tcl_Obj *result = Tcl_NewDictObj();
+        put( result, "name", Tcl_NewStringObj(thread->thread_name(), -1) );
+        put( result, "status", Tcl_NewStringObj(thread->status, -1) );
+        put( result, "stack_size", Tcl_NewWideIntObj(thread->stack_size()) );
+        uint64_t mask[Thread::cpu_words];
+        if ( thread->get_affinity(mask) )  put( result, "affinity", format_cpus(mask) );
+        else                           put( result, "affinity", Tcl_NewObj() );
+        put( result, "numa_node", Tcl_NewIntObj(thread->numa_node()) );
+        int priority;
+        Thread::Policy policy = thread->policy( &priority );
+        put( result, "policy", Tcl_NewStringObj(policy_name(policy), -1) );
+        put( result, "priority", Tcl_NewIntObj(priority) );
+        Tcl_SetObjResult( interp, result );
+        return TCL_OK;
+    }
+
+    if ( Tcl_StringMatch(command, "stack_size") ) {
+        if ( objc == 3 ) {
+            Tcl_WideInt size;
+            if ( Tcl_GetWideIntFromObj(interp, objv[2], &size) != TCL_OK )  return TCL_ERROR;
+            if ( size < 0 || thread->stack_size((size_t)size) == false ) {
+                Tcl_StaticSetResult( interp, "cannot set that stack size" );
+                return TCL_ERROR;
+            }
+        }
+        Tcl_SetObjResult( interp, Tcl_NewWideIntObj(thread->stack_size()) );
+        return TCL_OK;
+    }
+
+    if ( Tcl_StringMatch(command, "affinity") ) {
+        uint64_t mask[Thread::cpu_words];
+        if ( objc == 3 ) {
+            const char *list = Tcl_GetStringFromObj( objv[2], NULL );
+            bool any = (*list == '\0');
+            if ( any == false && parse_cpus(list, mask) == false ) {
+                Tcl_StaticSetResult( interp, "invalid CPU list" );
+                return TCL_ERROR;
+            }
+            if ( thread->set_affinity(any ? (const uint64_t *)NULL : (const uint64_t *)mask) == false ) {
+                Tcl_StaticSetResult( interp, "cannot set the CPU affinity" );
+                return TCL_ERROR;
+            }
+        }
+        if ( thread->get_affinity(mask) )  Tcl_SetObjResult( interp, format_cpus(mask) );
+        else                           Tcl_ResetResult( interp );
+        return TCL_OK;
+    }
+
+    if ( Tcl_StringMatch(command, "numa_node") ) {
+        if ( objc == 3 ) {
+            int node;
+            if ( Tcl_GetIntFromObj(interp, objv[2], &node) != TCL_OK )  return TCL_ERROR;
+            if ( thread->numa_node(node) == false ) {
+                Tcl_StaticSetResult( interp, "cannot bind the thread to that memory node" );
+                return TCL_ERROR;
+            }
+        }
+        Tcl_SetObjResult( interp, Tcl_NewIntObj(thread->numa_node()) );
+        return TCL_OK;
+    }
+
+    if ( Tcl_StringMatch(command, "policy") ) {
+        if ( objc == 3 || objc == 4 ) {
+            const char *name = Tcl_GetStringFromObj( objv[2], NULL );
+            PolicyName *p = policy_names;
+            while ( p->name != NULL && strcmp(p->name, name) != 0 )  p++;
+            if ( p->name == NULL ) {
+                Tcl_StaticSetResult( interp, "unknown scheduling policy" );
+                return TCL_ERROR;
+            }
+            int priority = 0;
+            if ( objc == 4 && Tcl_GetIntFromObj(interp, objv[3], &priority) != TCL_OK )  return TCL_ERROR;
+            if ( thread->policy(p->policy, priority) == false ) {
+                Tcl_StaticSetResult( interp, "cannot set the scheduling policy" );
+                return TCL_ERROR;
+            }
+        }
+        int priority;
+        Thread::Policy policy = thread->policy( &priority );
+        Tcl_Obj *result = Tcl_NewListObj( 0, NULL );
+        Tcl_ListObjAppendElement( interp, result, Tcl_NewStringObj(policy_name(policy), -1) );
+        Tcl_ListObjAppendElement( interp, result, Tcl_NewIntObj(priority) );
+        Tcl_SetObjResult( interp, result );
+        return TCL_OK;
+    }
+
     Tcl_StaticSetResult( interp, "Unknown command for thread object" );
     return TCL_ERROR;
 }
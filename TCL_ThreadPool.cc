@@ -0,0 +1,267 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/** \file TCL_ThreadPool.cc
+ * \brief TCL command to run scripts on a pool of threads
+ *
+ * Each pool worker evaluates scripts in an interpreter of its own,
+ * built on first use, so scripts share nothing but what the AppInit
+ * chain provides.  Results come back as strings.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <tcl.h>
+#include "tcl_util.h"
+#include "Thread.h"
+#include "ThreadPool.h"
+#include "AppInit.h"
+
+namespace {
+
+    pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+    ThreadPool *pool;
+
+    __thread Tcl_Interp *worker_interp;
+
+    /**
+     * The AppInit chain is not written to run concurrently, and the
+     * Thread module points thread_create_hook at each interpreter it
+     * initializes, so that is put back.
+     */
+    Tcl_Interp *
+    interp_for_worker() {
+        if ( worker_interp != NULL )  return worker_interp;
+
+        pthread_mutex_lock( &pool_lock );
+        ThreadCallback *hook = thread_create_hook;
+        worker_interp = Tcl_CreateInterp();
+        Tcl_SetVar( worker_interp, "tcl_interactive", "0", TCL_GLOBAL_ONLY );
+        Tcl_CallAppInitChain( worker_interp );
+        if ( thread_create_hook != hook ) {
+            delete thread_create_hook;
+            thread_create_hook = hook;
+        }
+        pthread_mutex_unlock( &pool_lock );
+        return worker_interp;
+    }
+
+    ThreadPool *
+    default_pool( int workers ) {
+        pthread_mutex_lock( &pool_lock );
+        if ( pool == NULL )  pool = new ThreadPool( "pool", workers );
+        pthread_mutex_unlock( &pool_lock );
+        return pool;
+    }
+
+    /**
+     */
+    class ScriptTask : public Task {
+        char *script;
+    public:
+        int code;
+        char *result;
+        ScriptTask( const char *script ) : script(strdup(script)), code(TCL_OK), result(NULL) {}
+        virtual ~ScriptTask() {
+            free( script );
+            free( result );
+        }
+        virtual void run() {
+            Tcl_Interp *interp = interp_for_worker();
+            code = Tcl_EvalEx( interp, script, -1, TCL_EVAL_GLOBAL );
+            result = strdup( Tcl_GetStringResult(interp) );
+            Tcl_ResetResult( interp );
+        }
+    };
+
+    /**
+     * The tasks an interpreter has submitted and not yet collected.
+     */
+    struct Pending {
+        Tcl_HashTable tasks;
+        int next;
+    };
+
+    /**
+     * Tasks cannot be abandoned while they may still be running, so an
+     * interpreter being deleted waits for its own.
+     */
+    void
+    delete_pending( ClientData data, Tcl_Interp *interp ) {
+        Pending *pending = (Pending *)data;
+        Tcl_HashSearch search;
+        for ( Tcl_HashEntry *entry = Tcl_FirstHashEntry(&pending->tasks, &search) ;
+              entry != NULL ; entry = Tcl_NextHashEntry(&search) ) {
+            ScriptTask *task = (ScriptTask *)Tcl_GetHashValue( entry );
+            task->wait();
+            delete task;
+        }
+        Tcl_DeleteHashTable( &pending->tasks );
+        delete pending;
+    }
+
+    Pending *
+    pending_for( Tcl_Interp *interp ) {
+        Pending *pending = (Pending *)Tcl_GetAssocData( interp, "ThreadPool", NULL );
+        if ( pending != NULL )  return pending;
+        pending = new Pending;
+        Tcl_InitHashTable( &pending->tasks, TCL_STRING_KEYS );
+        pending->next = 0;
+        Tcl_SetAssocData( interp, "ThreadPool", delete_pending, (ClientData)pending );
+        return pending;
+    }
+
+    /**
+     */
+    class TclPoolStatsInjector : public ThreadStatsInjector {
+        Tcl_Obj *result;
+    public:
+        TclPoolStatsInjector() { result = Tcl_NewDictObj(); }
+        virtual ~TclPoolStatsInjector() {}
+        virtual void operator () ( const char *name, uint64_t value ) {
+            Tcl_DictObjPut( NULL, result, Tcl_NewStringObj(name, -1), Tcl_NewWideIntObj(value) );
+        }
+        Tcl_Obj *get_result() { return result; }
+    };
+
+}
+
+/**
+ * Thread::pool start ?workers?
+ * Thread::pool submit script
+ * Thread::pool wait task ?milliseconds?
+ * Thread::pool ready task
+ * Thread::pool size
+ * Thread::pool stats
+ *
+ * The pool is started with one worker per CPU by the first submit if
+ * start has not been called.  wait returns the script's result, or
+ * raises its error, and forgets the task; if the wait times out the
+ * task can be waited for again.
+ */
+static int
+ThreadPool_cmd( ClientData data, Tcl_Interp *interp,
+                int objc, Tcl_Obj * CONST *objv )
+{
+    if ( objc < 2 ) {
+        Tcl_ResetResult( interp );
+        Tcl_WrongNumArgs( interp, 1, objv, "command ..." );
+        return TCL_ERROR;
+    }
+    char *command = Tcl_GetStringFromObj( objv[1], NULL );
+
+    if ( Tcl_StringMatch(command, "start") ) {
+        int workers = 0;
+        if ( objc > 3 ) {
+            Tcl_ResetResult( interp );
+            Tcl_WrongNumArgs( interp, 2, objv, "?workers?" );
+            return TCL_ERROR;
+        }
+        if ( objc == 3 && Tcl_GetIntFromObj(interp, objv[2], &workers) != TCL_OK )  return TCL_ERROR;
+        Tcl_SetObjResult( interp, Tcl_NewIntObj(default_pool(workers)->size()) );
+        return TCL_OK;
+    }
+
+    if ( Tcl_StringMatch(command, "size") ) {
+        pthread_mutex_lock( &pool_lock );
+        int size = (pool == NULL) ? 0 : pool->size();
+        pthread_mutex_unlock( &pool_lock );
+        Tcl_SetObjResult( interp, Tcl_NewIntObj(size) );
+        return TCL_OK;
+    }
+
+    if ( Tcl_StringMatch(command, "stats") ) {
+        TclPoolStatsInjector injector;
+        if ( pool != NULL )  pool->stats( &injector );
+        Tcl_SetObjResult( interp, injector.get_result() );
+        return TCL_OK;
+    }
+
+    Pending *pending = pending_for( interp );
+
+    if ( Tcl_StringMatch(command, "submit") ) {
+        if ( objc != 3 ) {
+            Tcl_ResetResult( interp );
+            Tcl_WrongNumArgs( interp, 2, objv, "script" );
+            return TCL_ERROR;
+        }
+        ScriptTask *task = new ScriptTask( Tcl_GetStringFromObj(objv[2], NULL) );
+        char name[32];
+        snprintf( name, sizeof(name), "task%d", ++pending->next );
+        int created;
+        Tcl_HashEntry *entry = Tcl_CreateHashEntry( &pending->tasks, name, &created );
+        Tcl_SetHashValue( entry, task );
+        default_pool(0)->submit( task );
+        Tcl_SetObjResult( interp, Tcl_NewStringObj(name, -1) );
+        return TCL_OK;
+    }
+
+    if ( Tcl_StringMatch(command, "wait") || Tcl_StringMatch(command, "ready") ) {
+        bool waiting = Tcl_StringMatch( command, "wait" );
+        if ( objc != 3 && (waiting == false || objc != 4) ) {
+            Tcl_ResetResult( interp );
+            Tcl_WrongNumArgs( interp, 2, objv, waiting ? "task ?milliseconds?" : "task" );
+            return TCL_ERROR;
+        }
+        Tcl_HashEntry *entry = Tcl_FindHashEntry( &pending->tasks, Tcl_GetStringFromObj(objv[2], NULL) );
+        if ( entry == NULL ) {
+            Tcl_StaticSetResult( interp, "no such task" );
+            return TCL_ERROR;
+        }
+        ScriptTask *task = (ScriptTask *)Tcl_GetHashValue( entry );
+
+        if ( waiting == false ) {
+            Tcl_SetObjResult( interp, Tcl_NewBooleanObj(task->ready()) );
+            return TCL_OK;
+        }
+
+        int timeout = -1;
+        if ( objc == 4 && Tcl_GetIntFromObj(interp, objv[3], &timeout) != TCL_OK )  return TCL_ERROR;
+        if ( task->wait(timeout) == false ) {
+            Tcl_StaticSetResult( interp, "timed out" );
+            return TCL_ERROR;
+        }
+        Tcl_DeleteHashEntry( entry );
+        Tcl_SetObjResult( interp, Tcl_NewStringObj(task->result, -1) );
+        int code = task->code;
+        delete task;
+        return code;
+    }
+
+    Tcl_StaticSetResult( interp, "Unknown command for thread pool" );
+    return TCL_ERROR;
+}
+
+/**
+ */
+static bool
+ThreadPool_Module( Tcl_Interp *interp ) {
+    Tcl_EvalEx( interp, "namespace eval Thread {}", -1, TCL_EVAL_GLOBAL );
+    Tcl_CreateObjCommand( interp, "Thread::pool", ThreadPool_cmd, (ClientData)0, NULL );
+    return true;
+}
+
+app_init( ThreadPool_Module );
+
+/* vim: set autoindent expandtab sw=4 : */
@@ -30,6 +30,9 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <sched.h>
+#include <syslog.h>
 #include <pthread.h>
 #include "Thread.h"
 #include "PlatformThread.h"
@@ -57,6 +60,7 @@ public:
         set_main_thread_name();
         id = pthread_self();
         pid = ::getpid();
+        started = true;
     }
     virtual ~MainThread() {}
     virtual void run() { }
@@ -98,13 +102,63 @@ public:
 };
 ThreadList threads;
 
+namespace {
+
+    int
+    native_policy( Thread::Policy policy ) {
+        switch ( policy ) {
+        case Thread::fifo:        return SCHED_FIFO;
+        case Thread::round_robin: return SCHED_RR;
+#ifdef SCHED_BATCH
+        case Thread::batch:       return SCHED_BATCH;
+#endif
+#ifdef SCHED_IDLE
+        case Thread::idle:        return SCHED_IDLE;
+#endif
+        default:                  return SCHED_OTHER;
+        }
+    }
+
+    /**
+     * Only the real-time policies take a priority.
+     */
+    bool
+    set_policy( pthread_t id, Thread::Policy policy, int priority ) {
+        int native = native_policy( policy );
+        struct sched_param param;
+        memset( &param, 0, sizeof(param) );
+        if ( native == SCHED_FIFO || native == SCHED_RR )  param.sched_priority = priority;
+        return pthread_setschedparam( id, native, &param ) == 0;
+    }
+
+}
+
+/**
+ * Called on the new thread before run(), so a thread that cannot be
+ * placed as asked still runs, and says why in the log.
+ */
+void Thread::place() {
+    pthread_t self = pthread_self();
+    if ( pinned && set_thread_affinity(self, cpus) == false ) {
+        syslog( LOG_WARNING, "could not set the CPU affinity of thread '%s'", _thread_name );
+    }
+    if ( _numa_node >= 0 && set_thread_memory_node(_numa_node) == false ) {
+        syslog( LOG_WARNING, "could not bind thread '%s' to memory node %d", _thread_name, _numa_node );
+        _numa_node = -1;
+    }
+    if ( _policy != inherit && set_policy(self, _policy, _priority) == false ) {
+        syslog( LOG_WARNING, "could not set the scheduling policy of thread '%s'", _thread_name );
+    }
+}
+
 /**
  */
-static void *boot( void *data ) {
+void *Thread::boot( void *data ) {
     Thread *thread = (Thread *)data;
     pthread_setspecific( CurrentThread, thread );
     pthread_setcancelstate( PTHREAD_CANCEL_ENABLE, NULL );
     thread->setpid();
+    thread->place();
     thread->running();
     set_thread_name( thread->thread_name() );
     thread->run();
@@ -114,9 +168,122 @@ static void *boot( void *data ) {
 /**
  */
 bool Thread::start() {
-    if ( pthread_create(&id, NULL, boot, this) ) {
+    pthread_attr_t attributes;
+    pthread_attr_init( &attributes );
+    if ( _stack_size > 0 && pthread_attr_setstacksize(&attributes, _stack_size) != 0 ) {
+        syslog( LOG_WARNING, "invalid stack size %lu for thread '%s'",
+                (unsigned long)_stack_size, _thread_name );
+    }
+    int error = pthread_create( &id, &attributes, boot, this );
+    pthread_attr_destroy( &attributes );
+    if ( error != 0 ) {
         return false;
     }
+    started = true;
+    return true;
+}
+
+/**
+ * The stack size asked for, or else the system default.
+ */
+size_t Thread::stack_size() const {
+    if ( _stack_size > 0 )  return _stack_size;
+    pthread_attr_t attributes;
+    size_t size = 0;
+    pthread_attr_init( &attributes );
+    pthread_attr_getstacksize( &attributes, &size );
+    pthread_attr_destroy( &attributes );
+    return size;
+}
+
+/**
+ * Zero restores the default.
+ */
+bool Thread::stack_size( size_t size ) {
+    if ( started )  return false;
+    if ( size > 0 && size < (size_t)PTHREAD_STACK_MIN )  return false;
+    _stack_size = size;
+    return true;
+}
+
+/**
+ * Fills in the CPUs the thread may run on, as the system has it once
+ * the thread has started.  Returns false if it is not pinned and has
+ * not started.
+ */
+bool Thread::get_affinity( uint64_t *mask ) const {
+    if ( started )  return get_thread_affinity( id, mask );
+    if ( pinned == false )  return false;
+    memcpy( mask, cpus, sizeof(cpus) );
+    return true;
+}
+
+/**
+ * A NULL mask lets the thread run on any CPU again.
+ */
+bool Thread::set_affinity( const uint64_t *mask ) {
+    if ( started && set_thread_affinity(id, mask) == false )  return false;
+    if ( mask == NULL ) {
+        pinned = false;
+        return true;
+    }
+    memcpy( cpus, mask, sizeof(cpus) );
+    pinned = true;
+    return true;
+}
+
+/**
+ * Once started, only the thread itself can change its memory node.
+ */
+bool Thread::numa_node( int node ) {
+    if ( node < 0 )  node = -1;
+    if ( started ) {
+        if ( pthread_equal(id, pthread_self()) == 0 )  return false;
+        if ( set_thread_memory_node(node) == false )  return false;
+    }
+    _numa_node = node;
+    return true;
+}
+
+/**
+ * The scheduling policy and, for the real-time ones, priority.  Once
+ * started, these are read back from the system.
+ */
+Thread::Policy Thread::policy( int *priority ) const {
+    if ( started == false ) {
+        if ( priority != NULL )  *priority = _priority;
+        return _policy;
+    }
+    int native;
+    struct sched_param param;
+    if ( pthread_getschedparam(id, &native, &param) != 0 )  return _policy;
+    if ( priority != NULL )  *priority = param.sched_priority;
+    switch ( native ) {
+    case SCHED_FIFO:  return fifo;
+    case SCHED_RR:    return round_robin;
+#ifdef SCHED_BATCH
+    case SCHED_BATCH: return batch;
+#endif
+#ifdef SCHED_IDLE
+    case SCHED_IDLE:  return idle;
+#endif
+    }
+    return normal;
+}
+
+/**
+ * The real-time policies usually need CAP_SYS_NICE, and take a priority
+ * within the range the system gives for them.
+ */
+bool Thread::policy( Policy policy, int priority ) {
+    int native = native_policy( policy );
+    if ( policy != inherit && (native == SCHED_FIFO || native == SCHED_RR) ) {
+        if ( priority < sched_get_priority_min(native) )  return false;
+        if ( priority > sched_get_priority_max(native) )  return false;
+    }
+    if ( started && policy != inherit && set_policy(id, policy, priority) == false )  return false;
+    _policy = policy;
+    _priority = priority;
     return true;
 }
 
@@ -130,8 +297,13 @@ bool Thread::stop() {
 }
 
 /**
+ * A thread that is only ever sent messages by one other thread can ask
+ * for a single producer mailbox.
  */
-Thread::Thread( const char *_name ) : _thread_name(NULL) {
+Thread::Thread( const char *_name, Mailbox::Kind mailbox )
+: q(Mailbox::create(mailbox)), _thread_name(NULL), started(false), _stack_size(0),
+  pinned(false), _numa_node(-1), _policy(inherit), _priority(0) {
+    memset( cpus, 0, sizeof(cpus) );
     thread_name( _name );
     status = "stop ready";
     threads.add( this );
@@ -148,4 +320,12 @@ void Thread::thread_name( const char *_name ) {
     _thread_name = strdup(_name);
 }
 
+/**
+ * Subclasses that keep counters report them after these.
+ */
+void Thread::stats( ThreadStatsInjector *injector ) {
+    ThreadStatsInjector& f = *injector;
+    f( "mailbox", q->depth() );
+}
+
 /* vim: set autoindent expandtab sw=4 : */
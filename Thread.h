@@ -32,9 +32,10 @@
 #define _THREAD_H_
 
 #include <sys/types.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <pthread.h>
-#include "Queue.h"
+#include "Mailbox.h"
 
 extern pthread_key_t CurrentThread;
 extern void InitializeThreads();
@@ -50,20 +51,49 @@ public:
 
 extern ThreadCallback *thread_create_hook;
 
+/**
+ * Called once for each counter a thread reports.
+ */
+class ThreadStatsInjector {
+public:
+    ThreadStatsInjector() {}
+    virtual ~ThreadStatsInjector() {}
+    virtual void operator () ( const char *name, uint64_t value ) = 0;
+};
+
 /**
  * A class to wrap thread management.  It also connects the TCL interpreter
  * to an instance of the class for managing its state.
+ *
+ * Stack size, CPU affinity, NUMA memory node and scheduling policy may
+ * be set before the thread starts, and are then applied by the thread
+ * itself before run().  Affinity and policy may also be changed while
+ * it runs; the stack size and memory node may not, as a thread can
+ * only set its own memory policy.  A NULL cpu mask, a negative node
+ * and the inherit policy leave the system's choice alone.
  */
 class Thread {
+public:
+    enum Policy { inherit, normal, batch, idle, fifo, round_robin };
+    static const int cpu_words = 16;
 protected:
     pthread_t id;
     pid_t pid;
-    Queue q;
+    Mailbox *q;
     char *_thread_name;
+    bool started;
+    size_t _stack_size;
+    bool pinned;
+    uint64_t cpus[cpu_words];
+    int _numa_node;
+    Policy _policy;
+    int _priority;
+    static void *boot( void * );
+    void place();
 public:
     const char *status;
-    Thread( const char * );
-    virtual ~Thread() {} // TODO clean up name
+    Thread( const char *, Mailbox::Kind = Mailbox::shared );
+    virtual ~Thread() { delete q; } // TODO clean up name
     void running() { status = "running"; }
     virtual void run() = 0;
     virtual bool start();
@@ -72,6 +102,17 @@ public:
     pid_t getpid() { return pid; }
     const char *thread_name() const { return _thread_name; }
     void thread_name( const char * );
+    virtual void stats( ThreadStatsInjector * );
+
+    bool is_started() const { return started; }
+    size_t stack_size() const;
+    bool stack_size( size_t );
+    bool get_affinity( uint64_t * ) const;
+    bool set_affinity( const uint64_t * );
+    int numa_node() const { return _numa_node; }
+    bool numa_node( int );
+    Policy policy( int * = NULL ) const;
+    bool policy( Policy, int = 0 );
 };
 
 #endif
@@ -0,0 +1,416 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/** \file ThreadPool.cc
+ * \brief A pool of threads that run short tasks, stealing from each other
+ */
+
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "ThreadPool.h"
+
+/**
+ * A pool thread and its deque.  The owner pushes and pops at bottom,
+ * thieves take from top; only the last task is contended.
+ */
+class ThreadPool::Worker : public Thread {
+    static const int64_t capacity = 1024;
+    char pad0[64];
+    int64_t top;
+    char pad1[64];
+    int64_t bottom;
+    char pad2[64];
+    Task *slots[capacity];
+public:
+    ThreadPool *pool;
+    uint64_t executed;
+    uint64_t stolen;
+    unsigned int seed;
+
+    Worker( const char *name, ThreadPool *pool, int index )
+    : Thread(name, Mailbox::single), top(0), bottom(0), pool(pool), executed(0), stolen(0),
+      seed(index) {}
+    virtual ~Worker() {}
+
+    /**
+     * Fails when the deque is full.
+     */
+    bool push( Task *task ) {
+        int64_t b = __atomic_load_n( &bottom, __ATOMIC_RELAXED );
+        int64_t t = __atomic_load_n( &top, __ATOMIC_ACQUIRE );
+        if ( b - t >= capacity )  return false;
+        __atomic_store_n( &slots[b & (capacity - 1)], task, __ATOMIC_RELAXED );
+        __atomic_store_n( &bottom, b + 1, __ATOMIC_RELEASE );
+        return true;
+    }
+
+    /**
+     * Only the owner pops.  Claiming the last task races the thieves
+     * for top.
+     */
+    Task *pop() {
+        int64_t b = __atomic_load_n( &bottom, __ATOMIC_RELAXED ) - 1;
+        __atomic_store_n( &bottom, b, __ATOMIC_RELAXED );
+        __atomic_thread_fence( __ATOMIC_SEQ_CST );
+        int64_t t = __atomic_load_n( &top, __ATOMIC_RELAXED );
+        if ( t > b ) {
+            __atomic_store_n( &bottom, b + 1, __ATOMIC_RELAXED );
+            return NULL;
+        }
+        Task *task = __atomic_load_n( &slots[b & (capacity - 1)], __ATOMIC_RELAXED );
+        if ( t == b ) {
+            if ( __atomic_compare_exchange_n(&top, &t, t + 1, false,
+                                             __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) == false ) {
+                task = NULL;
+            }
+            __atomic_store_n( &bottom, b + 1, __ATOMIC_RELAXED );
+        }
+        return task;
+    }
+
+    /**
+     * Returns NULL when empty or when another thread took the task.
+     */
+    Task *steal() {
+        int64_t t = __atomic_load_n( &top, __ATOMIC_ACQUIRE );
+        __atomic_thread_fence( __ATOMIC_SEQ_CST );
+        int64_t b = __atomic_load_n( &bottom, __ATOMIC_ACQUIRE );
+        if ( t >= b )  return NULL;
+        Task *task = __atomic_load_n( &slots[t & (capacity - 1)], __ATOMIC_RELAXED );
+        if ( __atomic_compare_exchange_n(&top, &t, t + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) == false ) {
+            return NULL;
+        }
+        return task;
+    }
+
+    int depth() {
+        int64_t t = __atomic_load_n( &top, __ATOMIC_RELAXED );
+        int64_t b = __atomic_load_n( &bottom, __ATOMIC_RELAXED );
+        return (b > t) ? (int)(b - t) : 0;
+    }
+
+    void join() { pthread_join( id, NULL ); }
+    virtual void run();
+    virtual void stats( ThreadStatsInjector * );
+};
+
+namespace {
+
+    __thread ThreadPool::Worker *current_worker;
+
+    int64_t
+    clock_ms() {
+        struct timespec now;
+        clock_gettime( CLOCK_MONOTONIC, &now );
+        return (now.tv_sec * 1000LL) + (now.tv_nsec / 1000000);
+    }
+
+}
+
+/**
+ * state is 0 while pending, 1 while pending with a thread asleep on it
+ * and 2 once complete.  The exchange is the completing thread's last
+ * touch of the future, since a waiter may delete it as soon as it sees
+ * 2; the futex wake only uses the address.
+ */
+void
+Future::complete() {
+    if ( __atomic_exchange_n(&state, 2, __ATOMIC_SEQ_CST) == 1 ) {
+        syscall( SYS_futex, &state, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0 );
+    }
+}
+
+/**
+ */
+bool
+Future::ready() {
+    return __atomic_load_n( &state, __ATOMIC_ACQUIRE ) == 2;
+}
+
+/**
+ * Sleep until complete() or for at most milliseconds, unless it is
+ * negative.
+ */
+void
+Future::sleep( int milliseconds ) {
+    int seen = __atomic_load_n( &state, __ATOMIC_ACQUIRE );
+    if ( seen == 0 ) {
+        if ( __atomic_compare_exchange_n(&state, &seen, 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) == false ) {
+            return;
+        }
+        seen = 1;
+    }
+    if ( seen != 1 )  return;
+
+    if ( milliseconds < 0 ) {
+        syscall( SYS_futex, &state, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0 );
+        return;
+    }
+    struct timespec timeout;
+    timeout.tv_sec = milliseconds / 1000;
+    timeout.tv_nsec = (milliseconds % 1000) * 1000000L;
+    syscall( SYS_futex, &state, FUTEX_WAIT_PRIVATE, 1, &timeout, NULL, 0 );
+}
+
+/**
+ */
+void
+Future::wait() {
+    wait( -1 );
+}
+
+/**
+ * Returns false if the task has not run within milliseconds.  A pool
+ * worker runs other tasks while it waits, checking back at least every
+ * millisecond.
+ */
+bool
+Future::wait( int milliseconds ) {
+    int64_t deadline = (milliseconds < 0) ? -1 : clock_ms() + milliseconds;
+    ThreadPool::Worker *worker = current_worker;
+
+    while ( ready() == false ) {
+        int timeout = -1;
+        if ( deadline >= 0 ) {
+            int64_t remaining = deadline - clock_ms();
+            if ( remaining <= 0 )  return false;
+            timeout = (int)remaining;
+        }
+        if ( worker != NULL ) {
+            Task *task = worker->pool->find( worker );
+            if ( task != NULL ) {
+                worker->pool->execute( worker, task );
+                continue;
+            }
+            if ( timeout < 0 || timeout > 1 )  timeout = 1;
+        }
+        sleep( timeout );
+    }
+    return true;
+}
+
+/**
+ * Workers drain the pool before they stop.
+ */
+void
+ThreadPool::Worker::run() {
+    current_worker = this;
+    for (;;) {
+        Task *task = pool->find( this );
+        if ( task != NULL ) {
+            pool->execute( this, task );
+            continue;
+        }
+        if ( __atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE) )  break;
+        pool->idle.block( pool, &ThreadPool::has_work, true );
+    }
+    current_worker = NULL;
+    status = "stopped";
+}
+
+/**
+ */
+void
+ThreadPool::Worker::stats( ThreadStatsInjector *injector ) {
+    Thread::stats( injector );
+    ThreadStatsInjector& f = *injector;
+    f( "executed", executed );
+    f( "stolen", stolen );
+    f( "queued", depth() );
+}
+
+/**
+ * A zero worker count means one per online CPU.
+ */
+ThreadPool::ThreadPool( const char *name, int workers )
+: name(strdup(name)), workers(NULL), count(workers), shared(4096), stopping(0), submitted(0) {
+    if ( count <= 0 )  count = sysconf( _SC_NPROCESSORS_ONLN );
+    if ( count <= 0 )  count = 1;
+
+    this->workers = new Worker*[count];
+    for ( int i = 0 ; i < count ; i++ ) {
+        char buffer[80];
+        snprintf( buffer, sizeof(buffer), "%s-%d", name, i );
+        this->workers[i] = new Worker( buffer, this, i );
+    }
+    for ( int i = 0 ; i < count ; i++ ) {
+        this->workers[i]->start();
+    }
+}
+
+/**
+ * The workers belong to the thread list, like every Thread, so only
+ * the array is freed here.
+ */
+ThreadPool::~ThreadPool() {
+    shutdown();
+    delete [] workers;
+    free( name );
+}
+
+/**
+ * Stop the workers once every queued task has run, and wait for them.
+ * Anything a late submit() queued after the workers left is run here.
+ */
+void
+ThreadPool::shutdown() {
+    if ( __atomic_exchange_n(&stopping, 1, __ATOMIC_SEQ_CST) )  return;
+    idle.wake();
+    for ( int i = 0 ; i < count ; i++ ) {
+        workers[i]->join();
+    }
+    drain();
+}
+
+/**
+ * Run whatever is left on the shared queue on the calling thread.
+ */
+void
+ThreadPool::drain() {
+    void *message;
+    while ( shared.try_dequeue(&message) ) {
+        execute( NULL, (Task *)message );
+    }
+}
+
+/**
+ * A worker submitting to its own pool pushes onto its deque, then the
+ * shared queue, and runs the task itself when both are full.  Anyone
+ * else waits for room on the shared queue.  Once the pool has stopped,
+ * the caller runs the task.  A shutdown() that starts while the task is
+ * being queued may find the workers already gone, so the caller looks
+ * again afterwards and runs what is left itself.
+ */
+void
+ThreadPool::submit( Task *task ) {
+    __atomic_add_fetch( &submitted, 1, __ATOMIC_RELAXED );
+    if ( __atomic_load_n(&stopping, __ATOMIC_ACQUIRE) ) {
+        execute( NULL, task );
+        return;
+    }
+
+    Worker *worker = current_worker;
+    if ( worker != NULL && worker->pool == this ) {
+        if ( worker->push(task) == false && shared.try_enqueue(task) == false ) {
+            execute( worker, task );
+            return;
+        }
+    } else {
+        shared.enqueue( task );
+        __atomic_thread_fence( __ATOMIC_SEQ_CST );
+        if ( __atomic_load_n(&stopping, __ATOMIC_RELAXED) ) {
+            drain();
+            return;
+        }
+    }
+    idle.wake();
+}
+
+/**
+ * True when there may be a task to run, or the pool is stopping.
+ */
+bool
+ThreadPool::has_work() {
+    if ( __atomic_load_n(&stopping, __ATOMIC_ACQUIRE) )  return true;
+    if ( shared.empty() == false )  return true;
+    for ( int i = 0 ; i < count ; i++ ) {
+        if ( workers[i]->depth() > 0 )  return true;
+    }
+    return false;
+}
+
+/**
+ * The worker's own deque first, newest task first since its data is
+ * likely still in cache, then the shared queue, then the oldest task
+ * of each other worker in turn, starting from a different one each
+ * time.
+ */
+Task *
+ThreadPool::find( Worker *self ) {
+    Task *task = self->pop();
+    if ( task != NULL )  return task;
+
+    void *message;
+    if ( shared.try_dequeue(&message) )  return (Task *)message;
+
+    int start = rand_r( &self->seed );
+    for ( int i = 0 ; i < count ; i++ ) {
+        Worker *victim = workers[ (start + i) % count ];
+        if ( victim == self )  continue;
+        task = victim->steal();
+        if ( task != NULL ) {
+            self->stolen++;
+            return task;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * The task must not be touched after complete(), since its owner may
+ * delete it at once.
+ */
+void
+ThreadPool::execute( Worker *worker, Task *task ) {
+    bool detached = task->detached;
+    task->run();
+    if ( worker != NULL )  worker->executed++;
+    if ( detached )  delete task;
+    else             task->complete();
+}
+
+/**
+ */
+void
+ThreadPool::stats( ThreadStatsInjector *injector ) {
+    ThreadStatsInjector& f = *injector;
+    uint64_t executed = 0, stolen = 0;
+    int queued = shared.depth();
+    for ( int i = 0 ; i < count ; i++ ) {
+        executed += workers[i]->executed;
+        stolen += workers[i]->stolen;
+        queued += workers[i]->depth();
+    }
+    f( "workers", count );
+    f( "submitted", submitted );
+    f( "executed", executed );
+    f( "stolen", stolen );
+    f( "queued", queued );
+}
+
+/**
+ * The pool the calling thread works for, or NULL.
+ */
+ThreadPool *
+ThreadPool::current() {
+    return (current_worker == NULL) ? NULL : current_worker->pool;
+}
+
+/* vim: set autoindent expandtab sw=4 : */
@@ -0,0 +1,112 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/** \file ThreadPool.h
+ * \brief A pool of threads that run short tasks, stealing from each other
+ */
+
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "Thread.h"
+#include "Queue.h"
+
+/**
+ * The result of a task, once it has run.  Waiting on a pool worker
+ * runs other tasks in the meantime, so a task may wait for tasks it
+ * submitted without tying up its thread.
+ */
+class Future {
+    int state;
+    Future( const Future& );
+    Future& operator = ( const Future& );
+    void sleep( int );
+protected:
+    void complete();
+public:
+    Future() : state(0) {}
+    virtual ~Future() {}
+    bool ready();
+    void wait();
+    bool wait( int );
+};
+
+/**
+ * Work for a pool.  A subclass keeps its own arguments and results and
+ * is its own future.  A detached task is deleted by the pool once it
+ * has run, and must not be waited for.
+ */
+class Task : public Future {
+    friend class ThreadPool;
+    bool detached;
+public:
+    Task( bool detached = false ) : detached(detached) {}
+    virtual ~Task() {}
+    virtual void run() = 0;
+};
+
+/**
+ * Each worker keeps a deque of tasks: it pushes and pops its own at one
+ * end while idle workers steal from the other (Chase and Lev).  Tasks
+ * submitted from outside the pool, or that overflow a deque, go on one
+ * shared queue.  Idle workers sleep on a futex until there is work.
+ *
+ * Workers are Threads, so they are registered with Tcl through
+ * thread_create_hook like any other, as Thread::<pool>-<n>.  Like other
+ * Threads they are never deleted; shutdown() only stops them.
+ */
+class ThreadPool {
+public:
+    class Worker;
+    friend class Future;
+    friend class Worker;
+private:
+    char *name;
+    Worker **workers;
+    int count;
+    Queue shared;
+    Waiters idle;
+    int stopping;
+    uint64_t submitted;
+
+    ThreadPool( const ThreadPool& );
+    ThreadPool& operator = ( const ThreadPool& );
+    bool has_work();
+    Task *find( Worker * );
+    void execute( Worker *, Task * );
+    void drain();
+public:
+    ThreadPool( const char *, int = 0 );
+    ~ThreadPool();
+    void submit( Task * );
+    void shutdown();
+    int size() const { return count; }
+    const char *pool_name() const { return name; }
+    void stats( ThreadStatsInjector * );
+    static ThreadPool *current();
+};
+
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
@@ -0,0 +1,155 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file allocbench.cc
+ * \brief Allocation throughput for the global allocator.
+ *
+ * Runs a few allocation patterns in one or more threads and reports
+ * allocations per second for each.
+ *
+ *   allocbench ?threads? ?iterations?
+ */
+
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+namespace {
+
+    int iterations = 1000000;
+
+    /**
+     * Allocate and immediately free one object, which should never
+     * leave the thread's cache.
+     */
+    void
+    churn( unsigned int *seed ) {
+        for ( int i = 0 ; i < iterations ; i++ ) {
+            char *object = new char[64];
+            object[0] = i;
+            delete [] object;
+        }
+    }
+
+    /**
+     * Hold a working set of mixed size objects, replacing one at
+     * random on each iteration.
+     */
+    void
+    mixed( unsigned int *seed ) {
+        static const int live = 1024;
+        char *objects[live];
+        for ( int i = 0 ; i < live ; i++ ) {
+            objects[i] = new char[ 1 + (rand_r(seed) % 2048) ];
+        }
+        for ( int i = 0 ; i < iterations ; i++ ) {
+            int slot = rand_r(seed) % live;
+            delete [] objects[slot];
+            objects[slot] = new char[ 1 + (rand_r(seed) % 2048) ];
+        }
+        for ( int i = 0 ; i < live ; i++ ) {
+            delete [] objects[i];
+        }
+    }
+
+    /**
+     * Fill up a batch of large objects and then release all of them,
+     * so every allocation goes to the slabs rather than a cache.
+     */
+    void
+    batch( unsigned int *seed ) {
+        static const int depth = 4096;
+        char *objects[depth];
+        for ( int i = 0 ; i < iterations ; i += depth ) {
+            for ( int j = 0 ; j < depth ; j++ ) {
+                objects[j] = new char[ 512 + (rand_r(seed) % 1024) ];
+            }
+            for ( int j = 0 ; j < depth ; j++ ) {
+                delete [] objects[j];
+            }
+        }
+    }
+
+    struct Pattern {
+        const char *name;
+        void (*run)( unsigned int * );
+    } patterns[] = {
+        { "churn", churn },
+        { "mixed", mixed },
+        { "batch", batch },
+        { NULL, NULL }
+    };
+
+    struct Worker {
+        pthread_t id;
+        unsigned int seed;
+        Pattern *pattern;
+    };
+
+    void *
+    worker( void *data ) {
+        Worker *w = (Worker *)data;
+        w->pattern->run( &w->seed );
+        return NULL;
+    }
+
+    double
+    now() {
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return ts.tv_sec + (ts.tv_nsec / 1e9);
+    }
+
+}
+
+/**
+ */
+int main( int argc, char **argv ) {
+    int threads = (argc > 1) ? atoi(argv[1]) : 1;
+    if ( argc > 2 )  iterations = atoi( argv[2] );
+    if ( threads < 1 )  threads = 1;
+
+    Worker *workers = new Worker[threads];
+
+    for ( Pattern *p = patterns ; p->name != NULL ; p++ ) {
+        double start = now();
+        for ( int i = 0 ; i < threads ; i++ ) {
+            workers[i].seed = i + 1;
+            workers[i].pattern = p;
+            pthread_create( &workers[i].id, NULL, worker, &workers[i] );
+        }
+        for ( int i = 0 ; i < threads ; i++ ) {
+            pthread_join( workers[i].id, NULL );
+        }
+        double elapsed = now() - start;
+        double total = (double)iterations * threads;
+        printf( "%-8s %2d thread(s) %10.0f allocations/sec\n", p->name, threads, total / elapsed );
+    }
+
+    delete [] workers;
+    return 0;
+}
+
+/* vim: set autoindent expandtab sw=4 : */
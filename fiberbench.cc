@@ -0,0 +1,125 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file fiberbench.cc
+ * \brief Context switch rate of Fiber::yield, against bare swapcontext.
+ *
+ * A few fibers on one scheduler yield to each other in turn, each yield
+ * being two switches: into the dispatcher and out to the next fiber.
+ * The same number of switches is then made with swapcontext() between
+ * two ucontexts, which is what a fiber switch cost before.
+ *
+ *   fiberbench ?yields? ?fibers?
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+
+#include "Fiber.h"
+
+namespace {
+
+    int yields = 1000000;
+    int fiber_count = 2;
+
+    uint64_t
+    nanoseconds() {
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+    }
+
+    class Yielder : public Fiber {
+        int count;
+    public:
+        Yielder( int count ) : Fiber("yielder"), count(count) {}
+        virtual ~Yielder() {}
+        virtual void run() {
+            for ( int i = 0 ; i < count ; i++ )  Fiber::yield();
+        }
+    };
+
+    ucontext_t main_context, peer_context;
+    int swaps;
+
+    void
+    peer() {
+        for (;;)  swapcontext( &peer_context, &main_context );
+    }
+
+    void
+    report( const char *name, uint64_t switches, uint64_t elapsed ) {
+        printf( "%-12s %12.0f switches/sec  %6.1f ns/switch\n", name,
+                switches / (elapsed / 1e9), (double)elapsed / switches );
+    }
+
+}
+
+/**
+ */
+int main( int argc, char **argv ) {
+    if ( argc > 1 )  yields = atoi( argv[1] );
+    if ( argc > 2 )  fiber_count = atoi( argv[2] );
+    if ( yields < 1 )  yields = 1;
+    if ( fiber_count < 1 )  fiber_count = 1;
+
+    Scheduler scheduler( "bench" );
+    int each = yields / fiber_count;
+    for ( int i = 0 ; i < fiber_count ; i++ ) {
+        Fiber *fiber = new Yielder( each );
+        fiber->start( &scheduler );
+    }
+    uint64_t start = nanoseconds();
+    scheduler.schedule();
+    uint64_t elapsed = nanoseconds() - start;
+#ifdef FIBER_STACK_SWITCH
+    report( "fiber", 2ULL * each * fiber_count, elapsed );
+#else
+    report( "fiber/uc", 2ULL * each * fiber_count, elapsed );
+#endif
+
+    size_t size = Fiber::default_stack_size;
+    void *stack = mmap( 0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    getcontext( &peer_context );
+    peer_context.uc_stack.ss_sp = stack;
+    peer_context.uc_stack.ss_size = size;
+    peer_context.uc_link = NULL;
+    makecontext( &peer_context, peer, 0 );
+
+    swaps = each * fiber_count;
+    start = nanoseconds();
+    for ( int i = 0 ; i < swaps ; i++ ) {
+        swapcontext( &main_context, &peer_context );
+    }
+    elapsed = nanoseconds() - start;
+    report( "swapcontext", 2ULL * swaps, elapsed );
+
+    munmap( stack, size );
+    return 0;
+}
+
+/* vim: set autoindent expandtab sw=4 : */
@@ -0,0 +1,127 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file queuebench.cc
+ * \brief Message rate and latency of the Thread mailboxes.
+ *
+ * One thread sends timestamps through a mailbox to another, which
+ * records how long each took to arrive.  Reports messages per second and
+ * latency percentiles for each kind of mailbox.
+ *
+ *   queuebench ?messages?
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <algorithm>
+
+#include "Mailbox.h"
+
+namespace {
+
+    int messages = 1000000;
+
+    uint64_t
+    nanoseconds() {
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+    }
+
+    struct Run {
+        Mailbox *mailbox;
+        uint64_t *latency;
+    };
+
+    /**
+     * A message is its send time, plus one so it is never NULL.
+     */
+    void *
+    producer( void *data ) {
+        Run *run = (Run *)data;
+        for ( int i = 0 ; i < messages ; i++ ) {
+            run->mailbox->enqueue( (void *)(uintptr_t)(nanoseconds() + 1) );
+        }
+        return NULL;
+    }
+
+    void *
+    consumer( void *data ) {
+        Run *run = (Run *)data;
+        for ( int i = 0 ; i < messages ; i++ ) {
+            uint64_t sent = (uintptr_t)run->mailbox->dequeue() - 1;
+            run->latency[i] = nanoseconds() - sent;
+        }
+        return NULL;
+    }
+
+    struct Kind {
+        const char *name;
+        Mailbox::Kind kind;
+    } kinds[] = {
+        { "shared", Mailbox::shared },
+        { "single", Mailbox::single },
+        { NULL, Mailbox::shared }
+    };
+
+}
+
+/**
+ */
+int main( int argc, char **argv ) {
+    if ( argc > 1 )  messages = atoi( argv[1] );
+    if ( messages < 1 )  messages = 1;
+
+    Run run;
+    run.latency = new uint64_t[messages];
+
+    for ( Kind *k = kinds ; k->name != NULL ; k++ ) {
+        run.mailbox = Mailbox::create( k->kind );
+
+        pthread_t send, receive;
+        uint64_t start = nanoseconds();
+        pthread_create( &receive, NULL, consumer, &run );
+        pthread_create( &send, NULL, producer, &run );
+        pthread_join( send, NULL );
+        pthread_join( receive, NULL );
+        double elapsed = (nanoseconds() - start) / 1e9;
+
+        std::sort( run.latency, run.latency + messages );
+        printf( "%-8s %10.0f messages/sec  latency ns p50 %llu p99 %llu p99.9 %llu max %llu\n",
+                k->name, messages / elapsed,
+                (unsigned long long)run.latency[ messages / 2 ],
+                (unsigned long long)run.latency[ (messages * 99LL) / 100 ],
+                (unsigned long long)run.latency[ (messages * 999LL) / 1000 ],
+                (unsigned long long)run.latency[ messages - 1 ] );
+
+        delete run.mailbox;
+    }
+
+    delete [] run.latency;
+    return 0;
+}
+
+/* vim: set autoindent expandtab sw=4 : */